@@ -0,0 +1,189 @@
+/*
+ * affinity.c
+ *
+ * Placement of processors on CPUs for the XPVM. With a policy set by the
+ * -a option each processor pins its thread to a CPU chosen from its id
+ * when it starts, and its allocator chunks are first touched from there,
+ * so on a NUMA machine they end up in memory on its own node.
+ *
+ * Author: Jeffrey Picard
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "xpvm.h"
+
+int xpvm_affinity = AFFINITY_NONE;
+
+/* CPU for each slot of the plan; processor id i uses slot i % aff_n */
+static int aff_cpus[CPU_SETSIZE];
+static int aff_nodes[CPU_SETSIZE];
+static int aff_n = 0;
+
+/*
+ * cpu_node
+ *
+ * Returns the NUMA node of a CPU, found through the nodeN link sysfs
+ * keeps in the CPU's directory, or 0 if there is none.
+ */
+static int cpu_node( int cpu )
+{
+  char path[64];
+  DIR *d;
+  struct dirent *e;
+  int node = 0;
+
+  snprintf( path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu );
+  if( !(d = opendir( path )) )
+    return 0;
+  while( (e = readdir( d )) )
+  {
+    if( !strncmp( e->d_name, "node", 4 ) &&
+        e->d_name[4] >= '0' && e->d_name[4] <= '9' )
+    {
+      node = atoi( e->d_name + 4 );
+      break;
+    }
+  }
+  closedir( d );
+  return node;
+}
+
+/*
+ * affinity_init
+ *
+ * Sets up the placement policy from the argument of -a, which is "rr" to
+ * spread processors across nodes round robin, "compact" to fill each node
+ * before moving to the next, or a comma separated list of CPUs to use in
+ * order. Only CPUs the process is allowed to run on are used by the first
+ * two. Returns 0, or -1 if spec is not understood.
+ */
+int affinity_init( const char *spec )
+{
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+  int n = 0, max_node = 0;
+  int i, node, round;
+  char *end;
+  long c;
+
+  if( !strcmp( spec, "rr" ) || !strcmp( spec, "compact" ) )
+  {
+    if( sched_getaffinity( 0, sizeof(allowed), &allowed ) )
+      return -1;
+    for( i = 0; i < CPU_SETSIZE; i++ )
+    {
+      if( !CPU_ISSET( i, &allowed ) )
+        continue;
+      cpus[n] = i;
+      nodes[n] = cpu_node( i );
+      if( nodes[n] > max_node )
+        max_node = nodes[n];
+      n++;
+    }
+    if( !n )
+      return -1;
+    if( 'c' == spec[0] )
+    {
+      xpvm_affinity = AFFINITY_COMPACT;
+      for( node = 0; node <= max_node; node++ )
+        for( i = 0; i < n; i++ )
+          if( nodes[i] == node )
+          {
+            aff_cpus[aff_n] = cpus[i];
+            aff_nodes[aff_n++] = node;
+          }
+    }
+    else
+    {
+      /* Take the first CPU of every node, then the second, and so on */
+      xpvm_affinity = AFFINITY_RR;
+      for( round = 0; aff_n < n; round++ )
+        for( node = 0; node <= max_node; node++ )
+        {
+          int k = 0;
+          for( i = 0; i < n; i++ )
+            if( nodes[i] == node && k++ == round )
+            {
+              aff_cpus[aff_n] = cpus[i];
+              aff_nodes[aff_n++] = node;
+              break;
+            }
+        }
+    }
+    return 0;
+  }
+
+  xpvm_affinity = AFFINITY_LIST;
+  while( *spec )
+  {
+    c = strtol( spec, &end, 10 );
+    if( end == spec || c < 0 || c >= CPU_SETSIZE || aff_n == CPU_SETSIZE ||
+        (*end && ',' != *end) )
+    {
+      xpvm_affinity = AFFINITY_NONE;
+      aff_n = 0;
+      return -1;
+    }
+    aff_cpus[aff_n] = c;
+    aff_nodes[aff_n++] = cpu_node( c );
+    spec = *end ? end + 1 : end;
+  }
+  if( !aff_n )
+  {
+    xpvm_affinity = AFFINITY_NONE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * affinity_report
+ *
+ * Prints the processor to CPU mapping on stderr.
+ */
+void affinity_report( void )
+{
+  static const char *names[] = { "none", "rr", "compact", "list" };
+  int i;
+
+  fprintf( stderr, "xpvm: affinity %s, %d cpu%s:",
+           names[xpvm_affinity], aff_n, aff_n == 1 ? "" : "s" );
+  for( i = 0; i < aff_n; i++ )
+    fprintf( stderr, " %d->%d(node %d)", i, aff_cpus[i], aff_nodes[i] );
+  fprintf( stderr, "%s\n", aff_n < XPVM_MAX_PROCESSORS ?
+                           ", then repeating" : "" );
+}
+
+/*
+ * affinity_apply
+ *
+ * Pins the calling thread, which is about to run processor p, to the
+ * processor's CPU. Called first thing by every processor thread.
+ */
+void affinity_apply( xpvm_proc *p )
+{
+  cpu_set_t set;
+  int slot;
+
+  p->cpu = -1;
+  p->node = -1;
+  if( AFFINITY_NONE == xpvm_affinity )
+    return;
+  slot = p->id % aff_n;
+  CPU_ZERO( &set );
+  CPU_SET( aff_cpus[slot], &set );
+  if( pthread_setaffinity_np( pthread_self(), sizeof(set), &set ) )
+  {
+    fprintf( stderr, "xpvm: could not pin processor %u to cpu %d\n",
+             p->id, aff_cpus[slot] );
+    return;
+  }
+  p->cpu = aff_cpus[slot];
+  p->node = aff_nodes[slot];
+}
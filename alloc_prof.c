@@ -0,0 +1,264 @@
+/*
+ * alloc_prof.c
+ *
+ * Allocation profile for the XPVM, turned on with -A. Every block the
+ * guest allocates, with alloc_blk, alloc_private_blk or a native calling
+ * malloc_xpvm_native, is counted against the instruction that asked for
+ * it, by whether it is shared, private or native, and by the power of two
+ * its size rounds up to. The counts belong to the processor making the
+ * allocation and are only added up when the profile is written, which is
+ * at exit, including the exit for running out of heap, and whenever the
+ * VM gets SIGUSR1.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xpvm.h"
+
+/* Sites a processor has room for before its table first grows */
+#define ALLOC_SITES_MIN 64
+/* Sites written out, most heap first */
+#define ALLOC_PROF_TOP  100
+
+int alloc_prof_on = 0;
+static const char *alloc_prof_path = NULL;
+static pthread_mutex_t alloc_prof_dump_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *alloc_kind_names[ALLOC_KINDS] = { "shared", "private",
+                                                     "native" };
+
+static uint32_t alloc_site_hash( uint64_t cib, uint32_t cio )
+{
+  uint64_t h = (cib ^ ((uint64_t) cio << 32)) * 0x9e3779b97f4a7c15ull;
+  return h >> 32;
+}
+
+/* Returns the slot for cib and cio in a table of cap slots */
+static xpvm_alloc_site *alloc_site_slot( xpvm_alloc_site *sites,
+                                         uint32_t cap, uint64_t cib,
+                                         uint32_t cio )
+{
+  uint32_t i = alloc_site_hash( cib, cio ) & (cap - 1);
+
+  while( sites[i].count && (sites[i].cib != cib || sites[i].cio != cio) )
+    i = (i + 1) & (cap - 1);
+  return &sites[i];
+}
+
+/* Doubles the site table of ap, which is locked */
+static void alloc_sites_grow( xpvm_alloc_prof *ap )
+{
+  uint32_t cap = ap->cap ? ap->cap * 2 : ALLOC_SITES_MIN, i;
+  xpvm_alloc_site *sites = calloc( cap, sizeof(xpvm_alloc_site) );
+
+  if( !sites )
+    EXIT_WITH_ERROR("Error: malloc failed in alloc_sites_grow\n");
+  for( i = 0; i < ap->cap; i++ )
+    if( ap->sites[i].count )
+      *alloc_site_slot( sites, cap, ap->sites[i].cib,
+                        ap->sites[i].cio ) = ap->sites[i];
+  free( ap->sites );
+  ap->sites = sites;
+  ap->cap = cap;
+}
+
+/*
+ * alloc_prof_record
+ *
+ * Counts an allocation of bytes of the given kind by processor p, made
+ * by the instruction before CIO in reg. Called before the allocation so
+ * that one which runs the heap out is counted too.
+ */
+void alloc_prof_record( xpvm_proc *p, uint64_t *reg, uint32_t bytes,
+                        int kind )
+{
+  xpvm_alloc_prof *ap = p->alloc_prof;
+  xpvm_alloc_site *s;
+  uint64_t heap = BLOCK_HEADER_LENGTH + ((bytes + 7) & ~7);
+  uint64_t cib = reg ? CIB : 0;
+  uint32_t cio = reg ? CIO - 4 : 0;
+  uint32_t size = bytes > 1 ? 64 - __builtin_clzll( bytes - 1 ) : 0;
+
+  if( !ap )
+  {
+    if( !(ap = calloc( 1, sizeof(xpvm_alloc_prof) )) )
+      EXIT_WITH_ERROR("Error: malloc failed in alloc_prof_record\n");
+    pthread_mutex_init( &ap->mu, NULL );
+    __atomic_store_n( &p->alloc_prof, ap, __ATOMIC_RELEASE );
+  }
+  pthread_mutex_lock( &ap->mu );
+  ap->kind_count[kind]++;
+  ap->kind_bytes[kind] += bytes;
+  ap->kind_heap[kind] += heap;
+  ap->size_count[size]++;
+  ap->size_bytes[size] += bytes;
+  if( 2 * (ap->n + 1) > ap->cap )
+    alloc_sites_grow( ap );
+  s = alloc_site_slot( ap->sites, ap->cap, cib, cio );
+  if( !s->count++ )
+  {
+    s->cib = cib;
+    s->cio = cio;
+    s->kind = kind;
+    ap->n++;
+  }
+  s->bytes += bytes;
+  s->heap += heap;
+  pthread_mutex_unlock( &ap->mu );
+}
+
+static int alloc_site_cmp( const void *x, const void *y )
+{
+  const xpvm_alloc_site *a = x, *b = y;
+
+  if( a->cib != b->cib )
+    return a->cib < b->cib ? -1 : 1;
+  return (a->cio > b->cio) - (a->cio < b->cio);
+}
+
+static int alloc_site_heap_cmp( const void *x, const void *y )
+{
+  const xpvm_alloc_site *a = x, *b = y;
+
+  if( a->heap != b->heap )
+    return a->heap < b->heap ? 1 : -1;
+  return alloc_site_cmp( x, y );
+}
+
+/*
+ * alloc_prof_dump
+ *
+ * Adds up the profiles of all processors and writes them to the path
+ * given to alloc_prof_init, replacing what was there.
+ */
+void alloc_prof_dump( void )
+{
+  uint64_t kind_count[ALLOC_KINDS] = { 0 }, kind_bytes[ALLOC_KINDS] = { 0 };
+  uint64_t kind_heap[ALLOC_KINDS] = { 0 };
+  uint64_t size_count[ALLOC_SIZES] = { 0 }, size_bytes[ALLOC_SIZES] = { 0 };
+  uint64_t count = 0, heap = 0;
+  xpvm_alloc_site *all = NULL, *grown;
+  xpvm_alloc_prof *ap;
+  uint32_t i, j, n = 0;
+  char buf[32];
+  FILE *fp;
+
+  if( !alloc_prof_on )
+    return;
+  pthread_mutex_lock( &alloc_prof_dump_mu );
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !(ap = __atomic_load_n( &procs[i].alloc_prof, __ATOMIC_ACQUIRE )) )
+      continue;
+    pthread_mutex_lock( &ap->mu );
+    for( j = 0; j < ALLOC_KINDS; j++ )
+    {
+      kind_count[j] += ap->kind_count[j];
+      kind_bytes[j] += ap->kind_bytes[j];
+      kind_heap[j] += ap->kind_heap[j];
+    }
+    for( j = 0; j < ALLOC_SIZES; j++ )
+    {
+      size_count[j] += ap->size_count[j];
+      size_bytes[j] += ap->size_bytes[j];
+    }
+    if( ap->n )
+    {
+      if( !(grown = realloc( all, (n + ap->n) * sizeof(xpvm_alloc_site) )) )
+        EXIT_WITH_ERROR("Error: malloc failed in alloc_prof_dump\n");
+      all = grown;
+      for( j = 0; j < ap->cap; j++ )
+        if( ap->sites[j].count )
+          all[n++] = ap->sites[j];
+    }
+    pthread_mutex_unlock( &ap->mu );
+  }
+
+  /* The same site on different processors is one line */
+  if( n )
+  {
+    qsort( all, n, sizeof(xpvm_alloc_site), alloc_site_cmp );
+    for( i = 1, j = 0; i < n; i++ )
+    {
+      if( !alloc_site_cmp( &all[j], &all[i] ) )
+      {
+        all[j].count += all[i].count;
+        all[j].bytes += all[i].bytes;
+        all[j].heap += all[i].heap;
+      }
+      else
+        all[++j] = all[i];
+    }
+    n = j + 1;
+    qsort( all, n, sizeof(xpvm_alloc_site), alloc_site_heap_cmp );
+  }
+
+  if( !(fp = fopen( alloc_prof_path, "w" )) )
+  {
+    perror( alloc_prof_path );
+    goto out;
+  }
+  for( i = 0; i < ALLOC_KINDS; i++ )
+  {
+    count += kind_count[i];
+    heap += kind_heap[i];
+  }
+  fprintf( fp, "allocations %" PRIu64 ", heap %" PRIu64 " bytes"
+               " (heap size %" PRIu64 ", %" PRIu64 " in use or reserved"
+               " by processors)\n\n", count, heap, xpvm_mem_amt,
+           (uint64_t)(next_block - allocd_memory) );
+
+  fprintf( fp, "%-10s %12s %14s %14s\n", "kind", "count", "bytes", "heap" );
+  for( i = 0; i < ALLOC_KINDS; i++ )
+    fprintf( fp, "%-10s %12" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n",
+             alloc_kind_names[i], kind_count[i], kind_bytes[i],
+             kind_heap[i] );
+
+  fprintf( fp, "\n%-10s %12s %14s\n", "size", "count", "bytes" );
+  for( i = 0; i < ALLOC_SIZES; i++ )
+    if( size_count[i] )
+      fprintf( fp, "<= %-7" PRIu64 " %12" PRIu64 " %14" PRIu64 "\n",
+               (uint64_t) 1 << i, size_count[i], size_bytes[i] );
+
+  fprintf( fp, "\n%12s %14s %14s  %-8s %s\n", "count", "bytes", "heap",
+           "kind", "site" );
+  for( i = 0; i < n && i < ALLOC_PROF_TOP; i++ )
+  {
+    fprintf( fp, "%12" PRIu64 " %14" PRIu64 " %14" PRIu64 "  %-8s ",
+             all[i].count, all[i].bytes, all[i].heap,
+             alloc_kind_names[all[i].kind] );
+    if( all[i].cib )
+      fprintf( fp, "%s+0x%x\n", prof_block_name( prof_find_block(
+                 (uint8_t*) CAST_INT all[i].cib ), buf, sizeof(buf) ),
+               all[i].cio );
+    else
+      fprintf( fp, "?\n" );
+  }
+  if( n > ALLOC_PROF_TOP )
+    fprintf( fp, "... %u more sites\n", n - ALLOC_PROF_TOP );
+  fclose( fp );
+  fprintf( stderr, "xpvm: allocation profile of %" PRIu64 " allocations"
+           " written to %s\n", count, alloc_prof_path );
+out:
+  free( all );
+  pthread_mutex_unlock( &alloc_prof_dump_mu );
+}
+
+/*
+ * alloc_prof_init
+ *
+ * Turns on the allocation profile, to be written to path. Called by main
+ * before any processor starts. Returns 0, or -1 if the report cannot be
+ * added.
+ */
+int alloc_prof_init( const char *path )
+{
+  alloc_prof_path = path;
+  if( report_add( alloc_prof_dump ) )
+    return -1;
+  alloc_prof_on = 1;
+  return 0;
+}
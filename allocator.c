@@ -7,7 +7,9 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #include "xpvm.h"
 
@@ -19,7 +21,17 @@ uint32_t  num_blocks_allocd;
 
 int malloc_xpvm_init( uint64_t bytes )
 {
-  allocd_memory = calloc( bytes, sizeof(uint8_t) );
+  /* With processors pinned, get pages nobody has touched yet so each
+   * lands on the node of the processor which uses it first. */
+  if( AFFINITY_NONE != xpvm_affinity )
+  {
+    allocd_memory = mmap( NULL, bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( MAP_FAILED == allocd_memory )
+      allocd_memory = NULL;
+  }
+  else
+    allocd_memory = calloc( bytes, sizeof(uint8_t) );
   if( !allocd_memory )
     EXIT_WITH_ERROR("Error: malloc failed in malloc_xpvm_init\n");
 
@@ -33,12 +45,14 @@ uint64_t malloc_xpvm( uint32_t bytes )
 {
   uint8_t *b = NULL;
 
-  uint8_t *new_next_block = next_block + bytes + BLOCK_HEADER_LENGTH + 
-                            (4-(bytes%4)); /* Round to next 4 byte boundary */
+  /* Round to next 8 byte boundary so the owner word in the header of the
+   * next block is aligned for the atomics in aquire_blk. */
+  uint8_t *new_next_block = next_block + BLOCK_HEADER_LENGTH +
+                            ((bytes + 7) & ~7);
   if( xpvm_mem_amt - 4 <= new_next_block - allocd_memory )
     EXIT_WITH_ERROR("Error: malloc_xpvm failed. Out of memory.\n");
 
-  num_blocks_allocd++;
+  __atomic_add_fetch( &num_blocks_allocd, 1, __ATOMIC_RELAXED );
 
   b = next_block + BLOCK_HEADER_LENGTH;
 
@@ -49,9 +63,74 @@ uint64_t malloc_xpvm( uint32_t bytes )
   return (uint64_t) CAST_INT b;
 }
 
-uint64_t malloc_xpvm_native( uint32_t bytes )
+/*
+ * malloc_xpvm_proc
+ *
+ * Allocates a block on behalf of processor p. Small blocks are carved out
+ * of a chunk of the heap reserved for that processor, so they take no
+ * lock; the chunk is refilled from the shared heap when it runs out.
+ * Large blocks, and small ones once the heap has no room for another
+ * chunk, go through malloc_xpvm under the allocator mutex.
+ */
+uint64_t malloc_xpvm_proc( xpvm_proc *p, uint32_t bytes )
 {
+  uint64_t size = BLOCK_HEADER_LENGTH + ((bytes + 7) & ~7);
+  uint64_t b = 0;
+
+  p->allocs++;
+  p->alloc_bytes += size;
+  if( bytes <= XPVM_PROC_CACHE_MAX )
+  {
+    if( p->alloc_end - p->alloc_next < size )
+    {
+      uint64_t chunk = XPVM_PROC_CACHE_CHUNK;
+      uint8_t *start;
+      int touch = 0;
+
+      pthread_mutex_lock( &malloc_xpvm_mu );
+      start = next_block;
+      /* A pinned processor takes whole pages, see malloc_xpvm_init */
+      if( p->cpu >= 0 )
+      {
+        chunk = XPVM_PAGE_SIZE;
+        start = allocd_memory + ((next_block - allocd_memory +
+                                  XPVM_PAGE_SIZE - 1) & ~(XPVM_PAGE_SIZE - 1));
+        touch = 1;
+      }
+      if( start - allocd_memory + chunk < xpvm_mem_amt - 4 )
+      {
+        p->alloc_next = start;
+        p->alloc_end = start + chunk;
+        next_block = p->alloc_end;
+      }
+      else
+        touch = 0;
+      pthread_mutex_unlock( &malloc_xpvm_mu );
+      if( touch )
+        memset( p->alloc_next, 0, chunk );
+    }
+    if( p->alloc_end - p->alloc_next >= size )
+    {
+      b = (uint64_t) CAST_INT (p->alloc_next + BLOCK_HEADER_LENGTH);
+      p->alloc_next += size;
+      __atomic_add_fetch( &num_blocks_allocd, 1, __ATOMIC_RELAXED );
+      add_blk( &blocks, b );
+      return b;
+    }
+  }
+
   pthread_mutex_lock( &malloc_xpvm_mu );
-  return malloc_xpvm( bytes );
+  b = malloc_xpvm( bytes );
   pthread_mutex_unlock( &malloc_xpvm_mu );
+  return b;
+}
+
+uint64_t malloc_xpvm_native( uint32_t bytes )
+{
+  uint64_t b;
+
+  ALLOC_PROF( cur_proc, cur_proc->reg, bytes, ALLOC_NATIVE );
+  b = malloc_xpvm_proc( cur_proc, bytes );
+  CONTEND_ALLOC( cur_proc, cur_proc->reg, (uint8_t*) CAST_INT b );
+  return b;
 }
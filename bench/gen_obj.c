@@ -0,0 +1,197 @@
+/*
+ * gen_obj.c
+ *
+ * Generates object files for the xpvm far bigger than anything written by
+ * hand, for measuring how loading and starting the VM scale. Block 0 is
+ * main and the others are named f1, f2, ... Every block adds one to r01
+ * and calls its children, so the blocks form a tree with main at the
+ * root; with a fanout of 1 it is a single chain of calls as deep as there
+ * are blocks. Each block can also carry an exception table and native
+ * function references, patched in by the loader, and is padded out with
+ * extra instructions if asked. main prints the number of blocks run,
+ * which is the number of blocks in the file.
+ *
+ *   gen_obj [-n blocks] [-f fanout] [-e handlers] [-r native_refs]
+ *           [-p padding] outfile.obj
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EXIT_WITH_ERROR( ... ) do { \
+  fprintf( stderr, __VA_ARGS__ );   \
+  exit(-1);                         \
+} while(0)
+
+#define USAGE "Usage: gen_obj [-n blocks] [-f fanout] [-e handlers]" \
+              " [-r native_refs] [-p padding] outfile.obj\n"
+
+/* ldfunc takes the block number as a 16 bit constant */
+#define MAX_BLOCKS 65536
+
+/* Natives only loaded, in turn, from native_funcs.cfg */
+static const char *natives[] = { "print_string", "print_int", "xpvm_printf",
+                                 "print_double" };
+#define NUM_NATIVES (sizeof(natives) / sizeof(natives[0]))
+
+struct native_ref
+{
+  const char  *name;
+  uint32_t    offset;
+};
+
+static uint32_t *code;
+static uint32_t code_len;
+static struct native_ref *refs;
+static uint32_t num_refs;
+
+static void put_word( FILE *fp, uint32_t w )
+{
+  putc( w >> 24, fp );
+  putc( w >> 16, fp );
+  putc( w >> 8, fp );
+  putc( w, fp );
+}
+
+static void emit( uint32_t insn )
+{
+  code[code_len++] = insn;
+}
+
+/* ldnative into ri of the function name, patched when loaded */
+static void emit_native( uint8_t ri, const char *name )
+{
+  refs[num_refs].name = name;
+  refs[num_refs++].offset = 4 * code_len + 2;
+  emit( 0x1d000000 | ri << 16 );
+}
+
+static uint32_t parse( const char *s, uint32_t max )
+{
+  char *end;
+  unsigned long n = strtoul( s, &end, 10 );
+
+  if( end == s || *end || n > max )
+    EXIT_WITH_ERROR(USAGE);
+  return n;
+}
+
+int main( int argc, char **argv )
+{
+  uint32_t blocks = 1000, fanout = 4, handlers = 0, natives_per = 0;
+  uint32_t padding = 0, max_len, i, j, ret_at;
+  uint64_t c;
+  char name[32];
+  int opt;
+  FILE *fp;
+
+  while( (opt = getopt( argc, argv, "e:f:n:p:r:" )) != -1 )
+  {
+    switch( opt )
+    {
+      case 'e':
+        handlers = parse( optarg, 1 << 20 );
+        break;
+      case 'f':
+        fanout = parse( optarg, MAX_BLOCKS );
+        break;
+      case 'n':
+        blocks = parse( optarg, MAX_BLOCKS );
+        break;
+      case 'p':
+        padding = parse( optarg, 1 << 20 );
+        break;
+      case 'r':
+        natives_per = parse( optarg, 1 << 20 );
+        break;
+      default:
+        EXIT_WITH_ERROR(USAGE);
+    }
+  }
+  if( optind != argc - 1 || !blocks || !fanout )
+    EXIT_WITH_ERROR(USAGE);
+  if( !(fp = fopen( argv[optind], "w" )) )
+    EXIT_WITH_ERROR("Error: fopen failed in main.\n");
+
+  /* The longest block: main with every instruction below */
+  max_len = 8 + padding + natives_per + 2 * fanout;
+  code = calloc( max_len, sizeof(uint32_t) );
+  refs = calloc( natives_per + 2, sizeof(struct native_ref) );
+  if( !code || !refs )
+    EXIT_WITH_ERROR("Error: malloc failed in main.\n");
+
+  put_word( fp, 0x31303636 );
+  put_word( fp, blocks );
+  for( i = 0; i < blocks; i++ )
+  {
+    code_len = 0;
+    num_refs = 0;
+    if( !i )
+      emit( 0x0e010000 );                   /* ldimm   01 <-- 0 */
+    emit( 0x21010101 );                     /* addl    01 <-- 01 + 1 */
+    for( j = 0; j < padding; j++ )
+      emit( 0x21222201 );                   /* addl    22 <-- 22 + 1 */
+    for( j = 0; j + 1 < natives_per; j++ )
+      emit_native( 0x12, natives[j % NUM_NATIVES] );
+    for( j = 1; j <= fanout; j++ )
+    {
+      c = (uint64_t) i * fanout + j;
+      if( c >= blocks )
+        break;
+      emit( 0x70210000 | c );               /* ldfunc  21 <-- block c */
+      emit( 0x72202100 );                   /* call    20, 21 */
+    }
+    /* Calling the last one checks the refs were patched in the right place */
+    if( natives_per )
+    {
+      emit_native( 0x10, "xpvm_nop" );
+      emit( 0x73111001 );                   /* calln   11, 10, 1 arg */
+    }
+    if( !i )
+    {
+      emit_native( 0x10, "print_int" );
+      emit( 0x73111001 );                   /* calln   11, 10, 1 arg */
+    }
+    ret_at = 4 * code_len;
+    emit( i ? 0x7420ffff : 0x7401ffff );    /* ret */
+
+    if( i )
+      snprintf( name, sizeof(name), "f%u", i );
+    else
+      strcpy( name, "main" );
+    fwrite( name, 1, strlen( name ) + 1, fp );
+    put_word( fp, 0 );                      /* annotations, executable */
+    put_word( fp, 2 );
+    put_word( fp, 16 );                     /* frame size */
+    put_word( fp, 4 * code_len );
+    for( j = 0; j < code_len; j++ )
+      put_word( fp, code[j] );
+
+    /* Each handler covers one instruction and returns */
+    put_word( fp, handlers );
+    for( j = 0; j < handlers; j++ )
+    {
+      put_word( fp, 4 * (j % code_len) );
+      put_word( fp, 4 * (j % code_len) );
+      put_word( fp, ret_at );
+    }
+    put_word( fp, 0 );                      /* outsymbol references */
+    put_word( fp, num_refs );
+    for( j = 0; j < num_refs; j++ )
+    {
+      fwrite( refs[j].name, 1, strlen( refs[j].name ) + 1, fp );
+      put_word( fp, refs[j].offset );
+    }
+    put_word( fp, 0 );                      /* auxiliary data length */
+  }
+
+  if( fclose( fp ) )
+    EXIT_WITH_ERROR("Error: write failed in main.\n");
+  free( code );
+  free( refs );
+  return 0;
+}
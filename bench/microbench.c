@@ -0,0 +1,542 @@
+/*
+ * microbench.c
+ *
+ * Microbenchmarks for the internals of the XPVM. Rather than running an
+ * object file, each benchmark builds what it needs in memory and drives
+ * the VM's own functions directly: the fetch/execute cycle on blocks of
+ * one kind of instruction, call_114 and ret_116, calln_115, malloc_xpvm
+ * and malloc_xpvm_proc from several threads, find_blk and
+ * process_exception. Each is run a number of times and the percentiles of
+ * the time per operation are printed.
+ *
+ *   microbench [-r reps] [-f filter] [-b results_file] [-l]
+ *
+ * Built and run from the top directory with make microbench.
+ *
+ * Author: Jeffrey Picard
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../xpvm.h"
+
+/* Instructions in each dispatch block, and times the block is run */
+#define MB_BLOCK_INSNS   1024
+#define MB_BLOCK_RUNS    64
+/* Calls made per repetition of the call and calln benchmarks */
+#define MB_CALLS         65536
+/* Allocations each thread makes per repetition */
+#define MB_ALLOCS        2000
+#define MB_ALLOC_SIZE    32
+#define MB_MAX_THREADS   16
+#define MB_HEAP_SIZE     (8 << 20)
+/* Throws per repetition of the exception benchmark */
+#define MB_THROWS        4096
+/* Registers the benchmark blocks use */
+#define MB_R0            0x20
+#define MB_R1            0x21
+#define MB_R2            0x22
+#define MB_R3            0x23
+#define MB_R4            0x24
+
+struct mb_bench
+{
+  const char  *name;
+  /* Runs one repetition and returns the time per operation in ns */
+  double      (*run)( int arg );
+  int         arg;
+  const char  *op;
+};
+
+static xpvm_proc *mb_procs[MB_MAX_THREADS + 1];
+static uint64_t mb_reg[NUM_REGS];
+
+static uint64_t mb_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * mb_block
+ *
+ * Builds an executable block the way read_block would from n
+ * instructions, each given as the four bytes of the instruction from the
+ * most significant. With handler set the block has one exception handler
+ * covering all of it, jumping to offset 0.
+ */
+static uint8_t *mb_block( const uint32_t *code, uint32_t n,
+                          uint32_t frame_size, int handler )
+{
+  uint8_t *b = calloc( 1, BLOCK_HEADER_LENGTH + 4 * n );
+  uint32_t *except = calloc( 4, sizeof(uint32_t) );
+  uint32_t i;
+
+  if( !b || !except )
+    EXIT_WITH_ERROR("Error: malloc failed in mb_block\n");
+  b += BLOCK_HEADER_LENGTH;
+  for( i = 0; i < n; i++ )
+  {
+    b[4*i] = code[i] >> 24;
+    b[4*i+1] = code[i] >> 16;
+    b[4*i+2] = code[i] >> 8;
+    b[4*i+3] = code[i];
+  }
+  if( handler )
+  {
+    except[0] = 1;
+    except[2] = 4 * n;
+  }
+  BLOCK_ANNOTS( b )           = INST_MASK;
+  BLOCK_EXCEPT_HANDLERS( b )  = CAST_INT except;
+  BLOCK_NATIVE_REFS( b )      = 0;
+  BLOCK_FRAME_SIZE( b )       = frame_size;
+  BLOCK_LENGTH( b )           = 4 * n;
+  return b;
+}
+
+/* A block of MB_BLOCK_INSNS copies of insn followed by a ret */
+static uint8_t *mb_repeat( uint32_t insn )
+{
+  static uint32_t code[MB_BLOCK_INSNS + 1];
+  uint32_t i;
+
+  for( i = 0; i < MB_BLOCK_INSNS; i++ )
+    code[i] = insn;
+  code[i] = 0x74000000 | MB_R0 << 16 | 0xffff;
+  return mb_block( code, MB_BLOCK_INSNS + 1, 0, 0 );
+}
+
+/*
+ * Dispatch. Runs a block of one instruction over and over through
+ * interp_run, so the time includes the fetch, the checks and the call
+ * through the opcode table as well as the opcode itself.
+ */
+static const uint32_t mb_dispatch_insns[] =
+{
+  0x0e200001,                               /* ldimm   20 <-- 1 */
+  0x20202021,                               /* addl    20 <-- 20 + 21 */
+  0x2b222223,                               /* addd    22 <-- 22 + 23 */
+  0x44202021,                               /* cmplt   20 <-- 20 < 21 */
+  0x50000000,                               /* jmp     CIO <-- CIO + 0 */
+  0x06202400,                               /* ldi     20 <-- 24[0] */
+  0x15202400,                               /* sti     24[0] <-- 20 */
+};
+
+static double mb_dispatch( int family )
+{
+  static uint8_t *blocks[sizeof(mb_dispatch_insns) / sizeof(uint32_t)];
+  static uint8_t *data;
+  xpvm_proc *p = mb_procs[0];
+  stack_frame *stack;
+  int64_t ret_val;
+  uint64_t t0;
+  double one = 1.0;
+  int i;
+
+  if( !blocks[family] )
+    blocks[family] = mb_repeat( mb_dispatch_insns[family] );
+  /* A block owned by the processor for the loads and stores */
+  if( !data )
+  {
+    if( !(data = calloc( 1, BLOCK_HEADER_LENGTH + 8 )) )
+      EXIT_WITH_ERROR("Error: malloc failed in mb_dispatch\n");
+    data += BLOCK_HEADER_LENGTH;
+    BLOCK_ANNOTS( data ) = OWNED_MASK;
+    BLOCK_OWNER( data ) = OWNER_TAG( p->id );
+    BLOCK_LENGTH( data ) = 8;
+  }
+  t0 = mb_ns();
+  for( i = 0; i < MB_BLOCK_RUNS; i++ )
+  {
+    mb_reg[MB_R1] = 1;
+    memcpy( &mb_reg[MB_R3], &one, sizeof(double) );
+    mb_reg[MB_R4] = (uint64_t) CAST_INT data;
+    stack = interp_enter( p, mb_reg, blocks[family] );
+    interp_run( p, p->id, mb_reg, &stack, 0, &ret_val );
+  }
+  return (double)(mb_ns() - t0) / (MB_BLOCK_RUNS * (MB_BLOCK_INSNS + 1));
+}
+
+/*
+ * call_114 and ret_116 called back to back, pushing and popping a frame
+ * with frame_size bytes of locals.
+ */
+static double mb_call_ret( int frame_size )
+{
+  static uint8_t *caller, *callee[2];
+  static const uint32_t ret = 0x7420ffff;
+  xpvm_proc *p = mb_procs[0];
+  stack_frame *stack;
+  uint64_t t0;
+  int i;
+
+  if( !caller )
+  {
+    caller = mb_block( &ret, 1, 0, 0 );
+    callee[0] = mb_block( &ret, 1, 0, 0 );
+    callee[1] = mb_block( &ret, 1, 64, 0 );
+  }
+  stack = interp_enter( p, mb_reg, caller );
+  mb_reg[MB_R1] = (uint64_t) CAST_INT callee[frame_size ? 1 : 0];
+  t0 = mb_ns();
+  for( i = 0; i < MB_CALLS; i++ )
+  {
+    p->budget = XPVM_BUDGET;
+    call_114( p->id, mb_reg, &stack, 0x72, MB_R0, MB_R1, 0 );
+    ret_116( p->id, mb_reg, &stack, 0x74, MB_R0, 0xff, 0xff );
+  }
+  t0 = mb_ns() - t0;
+  frame_free( p, stack );
+  return (double) t0 / MB_CALLS;
+}
+
+/* calln_115 of xpvm_nop with nargs arguments */
+static double mb_calln( int nargs )
+{
+  xpvm_proc *p = mb_procs[0];
+  stack_frame *stack = NULL;
+  int ind = get_native_func_ind( "xpvm_nop" );
+  uint64_t t0;
+  int i;
+
+  if( ind < 0 )
+    EXIT_WITH_ERROR("Error: xpvm_nop is not in native_funcs.cfg\n");
+  mb_reg[0x10] = (uint64_t) CAST_INT native_funcs[ind].fp;
+  for( i = 1; i <= 10; i++ )
+    mb_reg[i] = i;
+  t0 = mb_ns();
+  for( i = 0; i < MB_CALLS; i++ )
+    calln_115( p->id, mb_reg, &stack, 0x73, 0x11, 0x10, nargs );
+  return (double)(mb_ns() - t0) / MB_CALLS;
+}
+
+/*
+ * Allocation. Threads start together on a barrier and each makes
+ * MB_ALLOCS allocations, either all through malloc_xpvm under the
+ * allocator mutex or through malloc_xpvm_proc and the processor's cache.
+ * The time is from the first thread starting to the last one finishing,
+ * divided by the allocations of one thread, so it stays flat while the
+ * threads do not get in each other's way.
+ */
+struct mb_alloc_arg
+{
+  xpvm_proc          *p;
+  int                shared;
+  pthread_barrier_t  *start;
+  uint64_t           t0, t1;
+};
+
+static void *mb_alloc_thread( void *v )
+{
+  struct mb_alloc_arg *a = v;
+  int i;
+
+  cur_proc = a->p;
+  pthread_barrier_wait( a->start );
+  a->t0 = mb_ns();
+  for( i = 0; i < MB_ALLOCS; i++ )
+  {
+    if( a->shared )
+    {
+      pthread_mutex_lock( &malloc_xpvm_mu );
+      malloc_xpvm( MB_ALLOC_SIZE );
+      pthread_mutex_unlock( &malloc_xpvm_mu );
+    }
+    else
+      malloc_xpvm_proc( a->p, MB_ALLOC_SIZE );
+  }
+  a->t1 = mb_ns();
+  return NULL;
+}
+
+/* Empties the heap and the block list between repetitions */
+static void mb_heap_reset( void )
+{
+  blk_list *l, *next;
+  int i;
+
+  for( l = blocks; l; l = next )
+  {
+    next = l->next;
+    free( l );
+  }
+  blocks = NULL;
+  next_block = allocd_memory;
+  num_blocks_allocd = 0;
+  for( i = 0; i <= MB_MAX_THREADS; i++ )
+    mb_procs[i]->alloc_next = mb_procs[i]->alloc_end = NULL;
+}
+
+static double mb_alloc( int threads, int shared )
+{
+  struct mb_alloc_arg args[MB_MAX_THREADS];
+  pthread_t tids[MB_MAX_THREADS];
+  pthread_barrier_t start;
+  uint64_t t0 = UINT64_MAX, t1 = 0;
+  int i;
+
+  mb_heap_reset();
+  pthread_barrier_init( &start, NULL, threads );
+  for( i = 0; i < threads; i++ )
+  {
+    args[i].p = mb_procs[i + 1];
+    args[i].shared = shared;
+    args[i].start = &start;
+    if( pthread_create( &tids[i], NULL, mb_alloc_thread, &args[i] ) )
+      EXIT_WITH_ERROR("Error: pthread_create failed in mb_alloc\n");
+  }
+  for( i = 0; i < threads; i++ )
+  {
+    pthread_join( tids[i], NULL );
+    if( args[i].t0 < t0 )
+      t0 = args[i].t0;
+    if( args[i].t1 > t1 )
+      t1 = args[i].t1;
+  }
+  pthread_barrier_destroy( &start );
+  return (double)(t1 - t0) / MB_ALLOCS;
+}
+
+static double mb_alloc_shared( int threads )
+{
+  return mb_alloc( threads, 1 );
+}
+
+static double mb_alloc_proc( int threads )
+{
+  return mb_alloc( threads, 0 );
+}
+
+/* find_blk of blocks picked at random from a list of n */
+static double mb_find_blk( int n )
+{
+  static blk_list *list;
+  static uint64_t *ids;
+  static int list_n;
+  uint32_t rng = 2463534242u;
+  uint64_t t0, lookups = (16 << 20) / n + 16, found = 0, i;
+
+  if( list_n != n )
+  {
+    while( list )
+    {
+      blk_list *next = list->next;
+      free( list );
+      list = next;
+    }
+    free( ids );
+    if( !(ids = calloc( n, sizeof(uint64_t) )) )
+      EXIT_WITH_ERROR("Error: malloc failed in mb_find_blk\n");
+    for( i = 0; i < n; i++ )
+    {
+      ids[i] = 0x100000 + 128 * i;
+      if( add_blk( &list, ids[i] ) )
+        EXIT_WITH_ERROR("Error: malloc failed in mb_find_blk\n");
+    }
+    list_n = n;
+  }
+  t0 = mb_ns();
+  for( i = 0; i < lookups; i++ )
+  {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    found += find_blk( list, ids[rng % n] );
+  }
+  t0 = mb_ns() - t0;
+  if( found != lookups )
+    EXIT_WITH_ERROR("Error: find_blk missed a block in mb_find_blk\n");
+  return (double) t0 / lookups;
+}
+
+/*
+ * process_exception thrown depth frames below a handler. The frames are
+ * pushed as call_114 would push them, which is included in the time, so
+ * the cost of the unwind itself is this less depth times the frame push
+ * in call_ret.
+ */
+static double mb_exception( int depth )
+{
+  static uint8_t *handler, *thrower;
+  static const uint32_t ret = 0x7420ffff;
+  xpvm_proc *p = mb_procs[0];
+  stack_frame *stack, *f;
+  uint64_t t0;
+  int i, d;
+
+  if( !handler )
+  {
+    handler = mb_block( &ret, 1, 0, 1 );
+    thrower = mb_block( &ret, 1, 0, 0 );
+  }
+  stack = interp_enter( p, mb_reg, handler );
+  t0 = mb_ns();
+  for( i = 0; i < MB_THROWS; i++ )
+  {
+    for( d = 0; d < depth; d++ )
+    {
+      f = frame_alloc( p, 0 );
+      f->cib = mb_reg[CIB_REG];
+      f->cio = 4;
+      f->prev = stack;
+      stack = f;
+      mb_reg[CIB_REG] = (uint64_t) CAST_INT thrower;
+      mb_reg[CIO_REG] = 4;
+    }
+    if( 1 != process_exception( p->id, mb_reg, &stack, 1, 0 ) )
+      EXIT_WITH_ERROR("Error: exception not caught in mb_exception\n");
+  }
+  t0 = mb_ns() - t0;
+  frame_free( p, stack );
+  return (double) t0 / MB_THROWS;
+}
+
+static struct mb_bench mb_benches[] =
+{
+  { "dispatch_ldimm",      mb_dispatch,      0, "insn" },
+  { "dispatch_addl",       mb_dispatch,      1, "insn" },
+  { "dispatch_addd",       mb_dispatch,      2, "insn" },
+  { "dispatch_cmplt",      mb_dispatch,      3, "insn" },
+  { "dispatch_jmp",        mb_dispatch,      4, "insn" },
+  { "dispatch_ldi",        mb_dispatch,      5, "insn" },
+  { "dispatch_sti",        mb_dispatch,      6, "insn" },
+  { "call_ret",            mb_call_ret,      0, "call" },
+  { "call_ret_frame64",    mb_call_ret,      64, "call" },
+  { "calln_0",             mb_calln,         0, "call" },
+  { "calln_1",             mb_calln,         1, "call" },
+  { "calln_2",             mb_calln,         2, "call" },
+  { "calln_4",             mb_calln,         4, "call" },
+  { "calln_6",             mb_calln,         6, "call" },
+  { "calln_8",             mb_calln,         8, "call" },
+  { "calln_10",            mb_calln,         10, "call" },
+  { "malloc_xpvm_1t",      mb_alloc_shared,  1, "alloc" },
+  { "malloc_xpvm_2t",      mb_alloc_shared,  2, "alloc" },
+  { "malloc_xpvm_4t",      mb_alloc_shared,  4, "alloc" },
+  { "malloc_xpvm_8t",      mb_alloc_shared,  8, "alloc" },
+  { "malloc_xpvm_16t",     mb_alloc_shared,  16, "alloc" },
+  { "malloc_xpvm_proc_1t", mb_alloc_proc,    1, "alloc" },
+  { "malloc_xpvm_proc_2t", mb_alloc_proc,    2, "alloc" },
+  { "malloc_xpvm_proc_4t", mb_alloc_proc,    4, "alloc" },
+  { "malloc_xpvm_proc_8t", mb_alloc_proc,    8, "alloc" },
+  { "malloc_xpvm_proc_16t", mb_alloc_proc,   16, "alloc" },
+  { "find_blk_16",         mb_find_blk,      16, "lookup" },
+  { "find_blk_256",        mb_find_blk,      256, "lookup" },
+  { "find_blk_4096",       mb_find_blk,      4096, "lookup" },
+  { "find_blk_65536",      mb_find_blk,      65536, "lookup" },
+  { "exception_depth_0",   mb_exception,     0, "throw" },
+  { "exception_depth_1",   mb_exception,     1, "throw" },
+  { "exception_depth_4",   mb_exception,     4, "throw" },
+  { "exception_depth_16",  mb_exception,     16, "throw" },
+  { "exception_depth_64",  mb_exception,     64, "throw" },
+};
+
+static int mb_double_cmp( const void *x, const void *y )
+{
+  const double *a = x, *b = y;
+  return (*a > *b) - (*a < *b);
+}
+
+/* Nearest rank percentile of n sorted values */
+static double mb_pct( const double *v, int n, int pct )
+{
+  int rank = (pct * n + 99) / 100;
+  return v[rank ? rank - 1 : 0];
+}
+
+static void mb_usage( void )
+{
+  EXIT_WITH_ERROR("Usage: microbench [-r reps] [-f filter]"
+                  " [-b results_file] [-l]\n");
+}
+
+int main( int argc, char **argv )
+{
+  const char *filter = NULL, *out_path = NULL;
+  struct mb_bench *mb;
+  double *ns;
+  int reps = 31, list = 0, opt, i, r;
+  FILE *out = NULL;
+
+  while( (opt = getopt( argc, argv, "b:f:lr:" )) != -1 )
+  {
+    switch( opt )
+    {
+      case 'b':
+        out_path = optarg;
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'l':
+        list = 1;
+        break;
+      case 'r':
+        if( (reps = atoi( optarg )) < 1 )
+          mb_usage();
+        break;
+      default:
+        mb_usage();
+    }
+  }
+  if( optind != argc )
+    mb_usage();
+  if( list )
+  {
+    for( i = 0; i < sizeof(mb_benches) / sizeof(mb_benches[0]); i++ )
+      printf( "%s\n", mb_benches[i].name );
+    return 0;
+  }
+  if( out_path && !(out = fopen( out_path, "a" )) )
+  {
+    perror( out_path );
+    return 1;
+  }
+
+  pthread_mutex_init( &malloc_xpvm_mu, NULL );
+  malloc_xpvm_init( MB_HEAP_SIZE );
+  load_native_funcs();
+  for( i = 0; i <= MB_MAX_THREADS; i++ )
+  {
+    if( !(mb_procs[i] = proc_try_alloc()) )
+      EXIT_WITH_ERROR("Error: no free processors in microbench\n");
+    affinity_apply( mb_procs[i] );
+  }
+  cur_proc = mb_procs[0];
+  if( !(ns = calloc( reps, sizeof(double) )) )
+    EXIT_WITH_ERROR("Error: malloc failed in microbench\n");
+
+  printf( "%-22s %-7s %9s %9s %9s %9s %9s\n", "benchmark", "ns per",
+          "min", "p50", "p90", "p99", "max" );
+  for( i = 0; i < sizeof(mb_benches) / sizeof(mb_benches[0]); i++ )
+  {
+    mb = &mb_benches[i];
+    if( filter && !strstr( mb->name, filter ) )
+      continue;
+    /* The first run warms the caches and the frame free list */
+    mb->run( mb->arg );
+    for( r = 0; r < reps; r++ )
+      ns[r] = mb->run( mb->arg );
+    qsort( ns, reps, sizeof(double), mb_double_cmp );
+    printf( "%-22s %-7s %9.2f %9.2f %9.2f %9.2f %9.2f\n", mb->name, mb->op,
+            ns[0], mb_pct( ns, reps, 50 ), mb_pct( ns, reps, 90 ),
+            mb_pct( ns, reps, 99 ), ns[reps - 1] );
+    fflush( stdout );
+    if( out )
+      fprintf( out, "{\"benchmark\": \"%s\", \"unit\": \"ns per %s\", "
+                    "\"reps\": %d, \"min\": %.3f, \"p50\": %.3f, "
+                    "\"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}\n",
+               mb->name, mb->op, reps, ns[0], mb_pct( ns, reps, 50 ),
+               mb_pct( ns, reps, 90 ), mb_pct( ns, reps, 99 ),
+               ns[reps - 1] );
+  }
+  if( out )
+    fclose( out );
+  free( ns );
+  return 0;
+}
@@ -0,0 +1,363 @@
+/*
+ * contend.c
+ *
+ * Block contention profile for the XPVM, turned on with -L. Every try at
+ * aquiring a block with aquire_blk or aquire_blkw is counted against the
+ * block, along with whether it found the block held, how long aquire_blkw
+ * waited for it and how long it was held until release_blk. Shared blocks
+ * are remembered with the instruction which allocated them, so the report
+ * can put the most contended blocks next to the code that made them. Like
+ * the allocation profile the counts belong to the processor and are only
+ * added up when the report is written, at exit and on SIGUSR1.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xpvm.h"
+
+/* Blocks a processor has room for before its table first grows */
+#define CONTEND_BLKS_MIN  64
+/* Blocks and allocation sites written out, most contended first */
+#define CONTEND_TOP       50
+
+int contend_on = 0;
+static const char *contend_path = NULL;
+static pthread_mutex_t contend_dump_mu = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t contend_tick0, contend_ns0;
+
+static uint64_t contend_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Returns the slot for b in a table of cap slots */
+static xpvm_contend_blk *contend_slot( xpvm_contend_blk *blks, uint32_t cap,
+                                       uint64_t b )
+{
+  uint32_t i = (b * 0x9e3779b97f4a7c15ull) >> 32 & (cap - 1);
+
+  while( blks[i].b && blks[i].b != b )
+    i = (i + 1) & (cap - 1);
+  return &blks[i];
+}
+
+/* Doubles the block table of c, which is locked */
+static void contend_grow( xpvm_contend *c )
+{
+  uint32_t cap = c->cap ? c->cap * 2 : CONTEND_BLKS_MIN, i;
+  xpvm_contend_blk *blks = calloc( cap, sizeof(xpvm_contend_blk) );
+
+  if( !blks )
+    EXIT_WITH_ERROR("Error: malloc failed in contend_grow\n");
+  for( i = 0; i < c->cap; i++ )
+    if( c->blks[i].b )
+      *contend_slot( blks, cap, c->blks[i].b ) = c->blks[i];
+  free( c->blks );
+  c->blks = blks;
+  c->cap = cap;
+}
+
+/* Locks the table of p and returns the entry for b, adding it if new */
+static xpvm_contend_blk *contend_get( xpvm_proc *p, uint8_t *b )
+{
+  xpvm_contend *c = p->contend;
+  xpvm_contend_blk *e;
+
+  if( !c )
+  {
+    if( !(c = calloc( 1, sizeof(xpvm_contend) )) )
+      EXIT_WITH_ERROR("Error: malloc failed in contend_get\n");
+    pthread_mutex_init( &c->mu, NULL );
+    __atomic_store_n( &p->contend, c, __ATOMIC_RELEASE );
+  }
+  pthread_mutex_lock( &c->mu );
+  if( 2 * (c->n + 1) > c->cap )
+    contend_grow( c );
+  e = contend_slot( c->blks, c->cap, (uint64_t) CAST_INT b );
+  if( !e->b )
+  {
+    e->b = (uint64_t) CAST_INT b;
+    c->n++;
+  }
+  return e;
+}
+
+/*
+ * contend_aquire
+ *
+ * Counts a try by processor p at aquiring b. failed is set if the block
+ * was found held, got if p now holds it, and wait is the ticks spent
+ * waiting for it to be released.
+ */
+void contend_aquire( xpvm_proc *p, uint8_t *b, int failed, int got,
+                     uint64_t wait )
+{
+  xpvm_contend_blk *e = contend_get( p, b );
+
+  e->attempts++;
+  e->failures += !!failed;
+  e->wait_ticks += wait;
+  if( got )
+  {
+    e->acquires++;
+    e->held_since = prof_ticks();
+  }
+  pthread_mutex_unlock( &p->contend->mu );
+}
+
+/*
+ * contend_release
+ *
+ * Adds the time since processor p took b to its hold time. A release by
+ * some other processor than the one holding the block is not timed.
+ */
+void contend_release( xpvm_proc *p, uint8_t *b )
+{
+  xpvm_contend_blk *e = contend_get( p, b );
+
+  if( e->held_since )
+    e->hold_ticks += prof_ticks() - e->held_since;
+  e->held_since = 0;
+  pthread_mutex_unlock( &p->contend->mu );
+}
+
+/*
+ * contend_alloc
+ *
+ * Remembers that b was allocated by the instruction before CIO in reg.
+ */
+void contend_alloc( xpvm_proc *p, uint64_t *reg, uint8_t *b )
+{
+  xpvm_contend_blk *e = contend_get( p, b );
+
+  e->cib = reg ? CIB : 0;
+  e->cio = reg ? CIO - 4 : 0;
+  pthread_mutex_unlock( &p->contend->mu );
+}
+
+static int contend_blk_cmp( const void *x, const void *y )
+{
+  const xpvm_contend_blk *a = x, *b = y;
+  return (a->b > b->b) - (a->b < b->b);
+}
+
+static int contend_site_cmp( const void *x, const void *y )
+{
+  const xpvm_contend_blk *a = x, *b = y;
+
+  if( a->cib != b->cib )
+    return a->cib < b->cib ? -1 : 1;
+  return (a->cio > b->cio) - (a->cio < b->cio);
+}
+
+/* Most failures first, then most time waiting, then most time held */
+static int contend_worst_cmp( const void *x, const void *y )
+{
+  const xpvm_contend_blk *a = x, *b = y;
+
+  if( a->failures != b->failures )
+    return a->failures < b->failures ? 1 : -1;
+  if( a->wait_ticks != b->wait_ticks )
+    return a->wait_ticks < b->wait_ticks ? 1 : -1;
+  if( a->hold_ticks != b->hold_ticks )
+    return a->hold_ticks < b->hold_ticks ? 1 : -1;
+  return contend_blk_cmp( x, y );
+}
+
+/* Adds the counts of e to t */
+static void contend_add( xpvm_contend_blk *t, const xpvm_contend_blk *e )
+{
+  t->procs |= e->procs;
+  t->attempts += e->attempts;
+  t->failures += e->failures;
+  t->acquires += e->acquires;
+  t->wait_ticks += e->wait_ticks;
+  t->hold_ticks += e->hold_ticks;
+}
+
+/*
+ * Names the loaded block at b in out, or the instruction at b+cio if cio
+ * is not -1, or gives the address of a block the guest allocated.
+ */
+static const char *contend_name( char *out, size_t len, uint64_t b,
+                                 uint32_t cio )
+{
+  uint32_t blk = prof_find_block( (uint8_t*) CAST_INT b );
+  char buf[32];
+
+  if( blk >= block_cnt )
+    snprintf( out, len, "0x%" PRIx64, b );
+  else if( cio != (uint32_t) -1 )
+    snprintf( out, len, "%s+0x%x", prof_block_name( blk, buf, sizeof(buf) ),
+              cio );
+  else
+    snprintf( out, len, "%s", prof_block_name( blk, buf, sizeof(buf) ) );
+  return out;
+}
+
+/*
+ * contend_dump
+ *
+ * Adds up the blocks of all processors and writes the most contended
+ * ones, and the allocation sites of the most contended blocks, to the
+ * path given to contend_init, replacing what was there.
+ */
+void contend_dump( void )
+{
+  xpvm_contend_blk *all = NULL, *grown, tot;
+  xpvm_contend *c;
+  uint64_t dt, dns;
+  double ns_per_tick;
+  uint32_t i, j, k, n = 0, nsites;
+  char name[64], site[64];
+  FILE *fp;
+
+  if( !contend_on )
+    return;
+  pthread_mutex_lock( &contend_dump_mu );
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !(c = __atomic_load_n( &procs[i].contend, __ATOMIC_ACQUIRE )) )
+      continue;
+    pthread_mutex_lock( &c->mu );
+    if( c->n )
+    {
+      if( !(grown = realloc( all, (n + c->n) * sizeof(xpvm_contend_blk) )) )
+        EXIT_WITH_ERROR("Error: malloc failed in contend_dump\n");
+      all = grown;
+      for( j = 0; j < c->cap; j++ )
+      {
+        if( !c->blks[j].b )
+          continue;
+        all[n] = c->blks[j];
+        all[n++].procs = c->blks[j].attempts ? 1ull << i : 0;
+      }
+    }
+    pthread_mutex_unlock( &c->mu );
+  }
+
+  /* One line per block, keeping only those something tried to aquire */
+  memset( &tot, 0, sizeof(tot) );
+  if( n )
+  {
+    qsort( all, n, sizeof(xpvm_contend_blk), contend_blk_cmp );
+    for( i = 0, j = 0; i < n; i = k )
+    {
+      all[j] = all[i];
+      for( k = i + 1; k < n && all[k].b == all[i].b; k++ )
+      {
+        contend_add( &all[j], &all[k] );
+        if( !all[j].cib )
+        {
+          all[j].cib = all[k].cib;
+          all[j].cio = all[k].cio;
+        }
+      }
+      if( all[j].attempts )
+      {
+        contend_add( &tot, &all[j] );
+        j++;
+      }
+    }
+    n = j;
+    qsort( all, n, sizeof(xpvm_contend_blk), contend_worst_cmp );
+  }
+
+  dt = prof_ticks() - contend_tick0;
+  dns = contend_ns() - contend_ns0;
+  ns_per_tick = dt ? (double) dns / dt : 1.0;
+
+  if( !(fp = fopen( contend_path, "w" )) )
+  {
+    perror( contend_path );
+    goto out;
+  }
+  fprintf( fp, "acquire attempts %" PRIu64 ", failed %" PRIu64 ", acquired %"
+           PRIu64 ", %u blocks, waited %.3f ms, held %.3f ms\n\n",
+           tot.attempts, tot.failures, tot.acquires, n,
+           tot.wait_ticks * ns_per_tick / 1e6,
+           tot.hold_ticks * ns_per_tick / 1e6 );
+
+  fprintf( fp, "%12s %12s %12s %12s %12s %5s  %-20s %s\n", "attempts",
+           "failed", "acquired", "wait_us", "hold_us", "procs", "block",
+           "allocated at" );
+  for( i = 0; i < n && i < CONTEND_TOP; i++ )
+  {
+    fprintf( fp, "%12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12.1f %12.1f"
+             " %5d  ", all[i].attempts, all[i].failures, all[i].acquires,
+             all[i].wait_ticks * ns_per_tick / 1e3,
+             all[i].hold_ticks * ns_per_tick / 1e3,
+             __builtin_popcountll( all[i].procs ) );
+    fprintf( fp, "%-20s %s\n",
+             contend_name( name, sizeof(name), all[i].b, (uint32_t) -1 ),
+             all[i].cib ? contend_name( site, sizeof(site), all[i].cib,
+                                        all[i].cio ) : "-" );
+  }
+  if( n > CONTEND_TOP )
+    fprintf( fp, "... %u more blocks\n", n - CONTEND_TOP );
+
+  /* The same allocation site for many blocks is one line, b now counting
+     the blocks */
+  if( n )
+  {
+    qsort( all, n, sizeof(xpvm_contend_blk), contend_site_cmp );
+    for( i = 0, j = 0; i < n; i = k )
+    {
+      all[j] = all[i];
+      all[j].b = 1;
+      for( k = i + 1; k < n && !contend_site_cmp( &all[k], &all[i] ); k++ )
+      {
+        contend_add( &all[j], &all[k] );
+        all[j].b++;
+      }
+      j++;
+    }
+    nsites = j;
+    qsort( all, nsites, sizeof(xpvm_contend_blk), contend_worst_cmp );
+
+    fprintf( fp, "\n%12s %12s %12s %12s %12s %6s  %s\n", "attempts",
+             "failed", "acquired", "wait_us", "hold_us", "blocks",
+             "allocated at" );
+    for( i = 0; i < nsites && i < CONTEND_TOP; i++ )
+    {
+      fprintf( fp, "%12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12.1f %12.1f"
+               " %6" PRIu64 "  ", all[i].attempts, all[i].failures,
+               all[i].acquires, all[i].wait_ticks * ns_per_tick / 1e3,
+               all[i].hold_ticks * ns_per_tick / 1e3, all[i].b );
+      fprintf( fp, "%s\n", all[i].cib ? contend_name( site, sizeof(site),
+               all[i].cib, all[i].cio ) : "-" );
+    }
+    if( nsites > CONTEND_TOP )
+      fprintf( fp, "... %u more sites\n", nsites - CONTEND_TOP );
+  }
+  fclose( fp );
+  fprintf( stderr, "xpvm: contention of %u blocks written to %s\n", n,
+           contend_path );
+out:
+  free( all );
+  pthread_mutex_unlock( &contend_dump_mu );
+}
+
+/*
+ * contend_init
+ *
+ * Turns on the contention profile, to be written to path. Called by main
+ * before any processor starts. Returns 0, or -1 if the report cannot be
+ * added.
+ */
+int contend_init( const char *path )
+{
+  contend_path = path;
+  contend_tick0 = prof_ticks();
+  contend_ns0 = contend_ns();
+  if( report_add( contend_dump ) )
+    return -1;
+  contend_on = 1;
+  return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * metrics.c
+ *
+ * Live metrics for the XPVM, turned on with -M. The counters are the ones
+ * every processor already keeps for itself in its slot of procs, so taking
+ * the metrics never stops or locks an interpreter loop; they are read as
+ * they are and added up here. Written in the Prometheus text format on
+ * SIGUSR1, at exit and, with -i, every so many seconds, to a file which is
+ * replaced whole each time so a textfile collector never sees half of one,
+ * or to stderr if the path is "-".
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xpvm.h"
+
+static const char *metrics_path = NULL;
+static double metrics_interval = 0;
+static struct timespec metrics_start;
+static pthread_mutex_t metrics_mu = PTHREAD_MUTEX_INITIALIZER;
+
+/* The processors counters are kept for, in the order they are written */
+#define METRICS_PROC_COUNTERS 7
+
+static const struct
+{
+  const char    *name;
+  const char    *help;
+  size_t        offset;
+} metrics_proc[METRICS_PROC_COUNTERS] = {
+  { "xpvm_instructions_total", "Instructions retired.",
+    offsetof(xpvm_proc, insns) },
+  { "xpvm_calls_total", "Calls made with call.",
+    offsetof(xpvm_proc, calls) },
+  { "xpvm_native_calls_total", "Native functions called with calln.",
+    offsetof(xpvm_proc, natives) },
+  { "xpvm_exceptions_total", "Exceptions raised, caught or not.",
+    offsetof(xpvm_proc, exceptions) },
+  { "xpvm_allocs_total", "Blocks allocated.",
+    offsetof(xpvm_proc, allocs) },
+  { "xpvm_alloc_bytes_total", "Heap taken by allocated blocks, with headers.",
+    offsetof(xpvm_proc, alloc_bytes) },
+  { "xpvm_safepoints_total", "Safepoints taken.",
+    offsetof(xpvm_proc, safepoints) },
+};
+
+static void metrics_head( FILE *fp, const char *name, const char *help,
+                          const char *type )
+{
+  fprintf( fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type );
+}
+
+/*
+ * metrics_write
+ *
+ * Writes the metrics to fp. Counters of running processors may be a few
+ * instructions behind, but never go backwards.
+ */
+static void metrics_write( FILE *fp )
+{
+  uint64_t used, reserved = 0, v;
+  uint32_t i, j, state, alive = 0, started = 0;
+  struct timespec now;
+  int64_t d;
+  xpvm_proc *p;
+
+  for( j = 0; j < METRICS_PROC_COUNTERS; j++ )
+  {
+    metrics_head( fp, metrics_proc[j].name, metrics_proc[j].help,
+                  "counter" );
+    for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+    {
+      p = &procs[i];
+      if( PROC_FREE == __atomic_load_n( &p->state, __ATOMIC_RELAXED ) &&
+          !p->insns )
+        continue;
+      v = __atomic_load_n( (uint64_t*)((uint8_t*) p +
+                                       metrics_proc[j].offset),
+                           __ATOMIC_RELAXED );
+      fprintf( fp, "%s{proc=\"%u\"} %" PRIu64 "\n", metrics_proc[j].name,
+               i, v );
+    }
+  }
+
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    p = &procs[i];
+    state = __atomic_load_n( &p->state, __ATOMIC_RELAXED );
+    alive += PROC_RUNNING == state;
+    started += PROC_FREE != state || p->insns;
+    /* Torn while the processor refills its chunk, then left out */
+    if( (d = p->alloc_end - p->alloc_next) > 0 )
+      reserved += d;
+  }
+  metrics_head( fp, "xpvm_processors_alive", "Processors running.",
+                "gauge" );
+  fprintf( fp, "xpvm_processors_alive %u\n", alive );
+  metrics_head( fp, "xpvm_processors", "Processor slots used so far.",
+                "gauge" );
+  fprintf( fp, "xpvm_processors %u\n", started );
+
+  /* Blocks are never freed, so the heap only fills from the bottom */
+  used = next_block - allocd_memory;
+  reserved = reserved < used ? reserved : used;
+  metrics_head( fp, "xpvm_heap_size_bytes", "Size of the heap.", "gauge" );
+  fprintf( fp, "xpvm_heap_size_bytes %" PRIu64 "\n", xpvm_mem_amt );
+  metrics_head( fp, "xpvm_heap_used_bytes", "Heap holding blocks.",
+                "gauge" );
+  fprintf( fp, "xpvm_heap_used_bytes %" PRIu64 "\n", used - reserved );
+  metrics_head( fp, "xpvm_heap_reserved_bytes",
+                "Heap handed to processors and not yet allocated.",
+                "gauge" );
+  fprintf( fp, "xpvm_heap_reserved_bytes %" PRIu64 "\n", reserved );
+  metrics_head( fp, "xpvm_heap_free_bytes", "Heap left.", "gauge" );
+  fprintf( fp, "xpvm_heap_free_bytes %" PRIu64 "\n", xpvm_mem_amt - used );
+
+  metrics_head( fp, "xpvm_blocks", "Blocks, by where they came from.",
+                "gauge" );
+  fprintf( fp, "xpvm_blocks{from=\"object_file\"} %u\n", block_cnt );
+  fprintf( fp, "xpvm_blocks{from=\"alloc\"} %u\n",
+           __atomic_load_n( &num_blocks_allocd, __ATOMIC_RELAXED ) );
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  metrics_head( fp, "xpvm_uptime_seconds", "Time since the VM started.",
+                "gauge" );
+  fprintf( fp, "xpvm_uptime_seconds %.3f\n",
+           (now.tv_sec - metrics_start.tv_sec) +
+           (now.tv_nsec - metrics_start.tv_nsec) / 1e9 );
+}
+
+/*
+ * metrics_dump
+ *
+ * Writes the metrics to the path given to metrics_init, through a
+ * temporary file renamed over it.
+ */
+void metrics_dump( void )
+{
+  char tmp[4096];
+  FILE *fp;
+
+  if( !metrics_path )
+    return;
+  pthread_mutex_lock( &metrics_mu );
+  if( !strcmp( metrics_path, "-" ) )
+  {
+    metrics_write( stderr );
+    goto out;
+  }
+  snprintf( tmp, sizeof(tmp), "%s.tmp", metrics_path );
+  if( !(fp = fopen( tmp, "w" )) )
+  {
+    perror( tmp );
+    goto out;
+  }
+  metrics_write( fp );
+  if( fclose( fp ) || rename( tmp, metrics_path ) )
+    perror( metrics_path );
+out:
+  pthread_mutex_unlock( &metrics_mu );
+}
+
+/* Writes the metrics every metrics_interval seconds */
+static void *metrics_thread( void *v )
+{
+  struct timespec ts;
+
+  ts.tv_sec = (time_t) metrics_interval;
+  ts.tv_nsec = (long)((metrics_interval - ts.tv_sec) * 1e9);
+  while( 1 )
+  {
+    nanosleep( &ts, NULL );
+    metrics_dump();
+  }
+  return NULL;
+}
+
+/*
+ * metrics_init
+ *
+ * Turns on the metrics, written to path, or to stderr if path is "-",
+ * and every interval seconds if that is not 0. Called by main before any
+ * processor starts. Returns 0, or -1 if the report or the thread writing
+ * it cannot be started.
+ */
+int metrics_init( const char *path, double interval )
+{
+  pthread_t tid;
+
+  metrics_path = path;
+  metrics_interval = interval;
+  clock_gettime( CLOCK_MONOTONIC, &metrics_start );
+  if( report_add( metrics_dump ) )
+    return -1;
+  if( interval > 0 )
+  {
+    if( pthread_create( &tid, NULL, metrics_thread, NULL ) )
+      return -1;
+    pthread_detach( tid );
+  }
+  return 0;
+}
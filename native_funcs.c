@@ -43,3 +43,9 @@ int print_double( uint64_t x )
   printf("%lf\n", *(double*)&x );
   return 1;
 }
+
+/* Does nothing, for measuring the cost of calln */
+int xpvm_nop( void )
+{
+  return 0;
+}
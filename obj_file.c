@@ -7,6 +7,7 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "xpvm.h"
 
 /*
@@ -74,6 +75,9 @@ int32_t load_object_file( char *filename, int32_t *errorNumber, uint32_t* block_
   if (!(native_ref_patches = calloc(*block_cnt, sizeof *native_ref_patches )))
     EXIT_WITH_ERROR("Error: malloc failed in load_object_file");
 
+  if (!(block_names = calloc(*block_cnt, sizeof *block_names )))
+    EXIT_WITH_ERROR("Error: malloc failed in load_object_file");
+
   /* Read the blocks into memory */
   for( i = 0; i < *block_cnt; i++ )
   {
@@ -113,8 +117,8 @@ int read_block( FILE *fp, int block_num, uint64_t *block_ptr )
   uint32_t length_aux_data      = 0;
   uint64_t annots               = 0;
   uint64_t owner                = 0;
+  uint32_t offset               = 0;
   uint8_t  *b_data              = 0;
-  uint8_t  temp                 = 0;
 
   int i = 0, j = 0;
   /* Read name string from block */
@@ -127,6 +131,10 @@ int read_block( FILE *fp, int block_num, uint64_t *block_ptr )
   fprintf( stderr, "name: %s\n", name );
 #endif
 
+  /* Keep the name for the profilers */
+  if( !(block_names[block_num] = strdup( name )) )
+    EXIT_WITH_ERROR("Error: malloc failed in read_block");
+
   /* Read trait annotations */
   READ_INT64_LITTLE_ENDIAN( annots, fp );
 
@@ -199,7 +207,7 @@ int read_block( FILE *fp, int block_num, uint64_t *block_ptr )
   {
     /* Read until null */
     while( fgetc(fp) );
-    READ_INT32_LITTLE_ENDIAN( temp, fp );
+    READ_INT32_LITTLE_ENDIAN( offset, fp );
   }
 
   /* Read number of native function references */
@@ -217,8 +225,9 @@ int read_block( FILE *fp, int block_num, uint64_t *block_ptr )
     /* Name too long */
     if( MAX_NAME_LEN <= j )
       return 0;
-    READ_INT32_LITTLE_ENDIAN( temp, fp );
-    native_ref_patches[block_num][i].offset = temp;
+    offset = 0;
+    READ_INT32_LITTLE_ENDIAN( offset, fp );
+    native_ref_patches[block_num][i].offset = offset;
     native_ref_patches[block_num][i].patch = get_native_func_ind( name );
   }
 
@@ -246,8 +255,7 @@ int read_block( FILE *fp, int block_num, uint64_t *block_ptr )
   for( i = 0; i < length_aux_data; i++ )
   {
 #if DEBUG_XPVM
-    temp = fgetc( fp );
-    fprintf( stderr, "%02x\n", temp );
+    fprintf( stderr, "%02x\n", fgetc( fp ) );
 #else
     fgetc(fp);
 #endif
@@ -15,7 +15,7 @@
  *    as an int and a function pointer to the C 
  *    implementation of the opcode.
  */
-#define MAX_OPCODE_XPVM 150
+#define MAX_OPCODE_XPVM 171
 #define MIN_OPCODE_XPVM 2
 
 static struct opcode_info
@@ -108,18 +108,18 @@ opcodes[] =
 {"78",                    0, NULL},        /* 78 */
 {"79",                    0, NULL},        /* 79 */
 {"jmp",                   0, jmp_80}, /* 80 */
-{"jmp",                   0, NULL}, /* 81 */
+{"jmp",                   0, jmp_81}, /* 81 */
 {"btrue",                 0, btrue_82}, /* 82 */
 {"bfalse",                0, bfalse_83}, /* 83 */
-{"84",                    0, NULL},        /* 84 */
-{"85",                    0, NULL},        /* 85 */
-{"86",                    0, NULL},        /* 86 */
-{"87",                    0, NULL},        /* 87 */
-{"88",                    0, NULL},        /* 88 */
-{"89",                    0, NULL},        /* 89 */
-{"90",                    0, NULL},        /* 90 */
-{"91",                    0, NULL},        /* 91 */
-{"92",                    0, NULL},        /* 92 */
+{"faddb",                 0, faddb_84}, /* 84 */
+{"faddi",                 0, faddi_85}, /* 85 */
+{"faddl",                 0, faddl_86}, /* 86 */
+{"xchgb",                 0, xchgb_87}, /* 87 */
+{"xchgi",                 0, xchgi_88}, /* 88 */
+{"xchgl",                 0, xchgl_89}, /* 89 */
+{"casb",                  0, casb_90}, /* 90 */
+{"casi",                  0, casi_91}, /* 91 */
+{"casl",                  0, casl_92}, /* 92 */
 {"93",                    0, NULL},        /* 93 */
 {"94",                    0, NULL},        /* 94 */
 {"95",                    0, NULL},        /* 95 */
@@ -129,13 +129,13 @@ opcodes[] =
 {"release_blk",           0, release_blk_99}, /* 99 */
 {"dtraits",               0, NULL}, /* 100 */
 {"rannots",               0, NULL}, /* 101 */
-{"towner",                0, NULL}, /* 102 */
-{"lock",                  0, NULL}, /* 103 */
-{"unlock",                0, NULL}, /* 104 */
-{"wait",                  0, NULL}, /* 105 */
-{"sig",                   0, NULL}, /* 106 */
-{"sigall",                0, NULL}, /* 107 */
-{"108",                   0, NULL},        /* 108 */
+{"towner",                0, towner_102}, /* 102 */
+{"lock",                  0, lock_103}, /* 103 */
+{"unlock",                0, unlock_104}, /* 104 */
+{"wait",                  0, wait_105}, /* 105 */
+{"sig",                   0, sig_106}, /* 106 */
+{"sigall",                0, sigall_107}, /* 107 */
+{"aquire_blkw",           0, aquire_blkw_108}, /* 108 */
 {"109",                   0, NULL},        /* 109 */
 {"110",                   0, NULL},        /* 110 */
 {"111",                   0, NULL},        /* 111 */
@@ -144,37 +144,61 @@ opcodes[] =
 {"call",                  0, call_114},    /* 114 */
 {"calln",                 0, calln_115},        /* 115 */
 {"ret",                   0, ret_116},     /* 116 */
-{"117",                   0, NULL},        /* 117 */
-{"118",                   0, NULL},        /* 118 */
-{"119",                   0, NULL},        /* 119 */
-{"120",                   0, NULL},        /* 120 */
-{"121",                   0, NULL},        /* 121 */
-{"122",                   0, NULL},        /* 122 */
-{"123",                   0, NULL},        /* 123 */
-{"124",                   0, NULL},        /* 124 */
-{"125",                   0, NULL},        /* 125 */
-{"126",                   0, NULL},        /* 126 */
-{"127",                   0, NULL},        /* 127 */
+{"fmad",                  0, fmad_117}, /* 117 */
+{"sqrtd",                 0, sqrtd_118}, /* 118 */
+{"mind",                  0, mind_119}, /* 119 */
+{"maxd",                  0, maxd_120}, /* 120 */
+{"absd",                  0, absd_121}, /* 121 */
+{"floord",                0, floord_122}, /* 122 */
+{"ceild",                 0, ceild_123}, /* 123 */
+{"expd",                  0, expd_124}, /* 124 */
+{"logd",                  0, logd_125}, /* 125 */
+{"sind",                  0, sind_126}, /* 126 */
+{"cosd",                  0, cosd_127}, /* 127 */
 {"throw",                 0, NULL}, /* 128 */
 {"retrieve",              0, NULL}, /* 129 */
-{"130",                   0, NULL},        /* 130 */
-{"131",                   0, NULL},        /* 131 */
-{"132",                   0, NULL},        /* 132 */
-{"133",                   0, NULL},        /* 133 */
-{"134",                   0, NULL},        /* 134 */
-{"135",                   0, NULL},        /* 135 */
-{"136",                   0, NULL},        /* 136 */
-{"137",                   0, NULL},        /* 137 */
-{"138",                   0, NULL},        /* 138 */
-{"139",                   0, NULL},        /* 139 */
-{"140",                   0, NULL},        /* 140 */
-{"141",                   0, NULL},        /* 141 */
-{"142",                   0, NULL},        /* 142 */
+{"chan_create",           0, chan_create_130}, /* 130 */
+{"chan_send",             0, chan_send_131}, /* 131 */
+{"chan_recv",             0, chan_recv_132}, /* 132 */
+{"chan_tryrecv",          0, chan_tryrecv_133}, /* 133 */
+{"barrier_init",          0, barrier_init_134}, /* 134 */
+{"barrier",               0, barrier_135}, /* 135 */
+{"joinany",               0, joinany_136}, /* 136 */
+{"spawn",                 0, spawn_137}, /* 137 */
+{"spawnd",                0, spawnd_138}, /* 138 */
+{"yield",                 0, yield_139}, /* 139 */
+{"bcopy",                 0, bcopy_140}, /* 140 */
+{"bfill",                 0, bfill_141}, /* 141 */
+{"bcmp",                  0, bcmp_142}, /* 142 */
 {"143",                   0, NULL},        /* 143 */
 {"init_proc",             0, init_proc_144}, /* 144 */
 {"join",                  0, join_145}, /* 145 */
-{"join2",                 0, NULL}, /* 146 */
-{"whoami",                0, NULL}, /* 147 */
+{"join2",                 0, join2_146}, /* 146 */
+{"whoami",                0, whoami_147}, /* 147 */
+{"parfor",                0, parfor_148}, /* 148 */
+{"reduce",                0, reduce_149}, /* 149 */
+{"150",                   0, NULL},        /* 150 */
+{"151",                   0, NULL},        /* 151 */
+{"152",                   0, NULL},        /* 152 */
+{"153",                   0, NULL},        /* 153 */
+{"154",                   0, NULL},        /* 154 */
+{"155",                   0, NULL},        /* 155 */
+{"156",                   0, NULL},        /* 156 */
+{"157",                   0, NULL},        /* 157 */
+{"158",                   0, NULL},        /* 158 */
+{"159",                   0, NULL},        /* 159 */
+{"vaddd",                 0, vaddd_160}, /* 160 */
+{"vaddl",                 0, vaddl_161}, /* 161 */
+{"vmuld",                 0, vmuld_162}, /* 162 */
+{"vmull",                 0, vmull_163}, /* 163 */
+{"vfmad",                 0, vfmad_164}, /* 164 */
+{"vfmal",                 0, vfmal_165}, /* 165 */
+{"vscaled",               0, vscaled_166}, /* 166 */
+{"vscalel",               0, vscalel_167}, /* 167 */
+{"vdotd",                 0, vdotd_168}, /* 168 */
+{"vdotl",                 0, vdotl_169}, /* 169 */
+{"vsumd",                 0, vsumd_170}, /* 170 */
+{"vsuml",                 0, vsuml_171}, /* 171 */
 };
 
 #endif
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <dlfcn.h>
 
 #include "xpvm.h"
@@ -18,7 +20,7 @@ int ldb_2( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int8_t *)(b + reg[rk]);
+  reg[ri] = BLOCK_LOAD( int8_t, b, reg[rk] );
   return 1;
 }
 
@@ -27,7 +29,7 @@ int ldb_3( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int8_t *)(b + const8);
+  reg[ri] = BLOCK_LOAD( int8_t, b, const8 );
   return 1;
 }
 
@@ -36,7 +38,7 @@ int lds_4( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int16_t *)(b + reg[rk]);
+  reg[ri] = BLOCK_LOAD( int16_t, b, reg[rk] );
   return 1;
 }
 
@@ -45,7 +47,7 @@ int lds_5( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int16_t *)(b + const8);
+  reg[ri] = BLOCK_LOAD( int16_t, b, const8 );
   return 1;
 }
 
@@ -54,7 +56,7 @@ int ldi_6( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int32_t *)(b + const8);
+  reg[ri] = BLOCK_LOAD( int32_t, b, const8 );
   return 1;
 }
 
@@ -63,7 +65,7 @@ int ldi_7( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = (int64_t) *(int32_t *)(b + reg[rk]);
+  reg[ri] = (int64_t) BLOCK_LOAD( int32_t, b, reg[rk] );
   return 1;
 }
 
@@ -72,7 +74,7 @@ int ldl_8( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int64_t *)(b + reg[rk]);
+  reg[ri] = BLOCK_LOAD( int64_t, b, reg[rk] );
 
   return 1;
 }
@@ -82,7 +84,7 @@ int ldl_9( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(int64_t*)(b + const8);
+  reg[ri] = BLOCK_LOAD( int64_t, b, const8 );
 
   return 1;
 }
@@ -92,7 +94,7 @@ int ldf_10( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(uint64_t*)(float*)(b + reg[rk]);
+  reg[ri] = BLOCK_LOAD( uint64_t, b, reg[rk] );
   return 1;
 }
 
@@ -101,7 +103,7 @@ int ldf_11( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(uint64_t*)(float*)(b + const8);
+  reg[ri] = BLOCK_LOAD( uint64_t, b, const8 );
   return 1;
 }
 
@@ -110,7 +112,7 @@ int ldd_12( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(uint64_t*)(double*)(b + reg[rk]);
+  reg[ri] = BLOCK_LOAD( uint64_t, b, reg[rk] );
   //block *b = (block*) CAST_INT reg[rj];
   //reg[ri] = *(int64_t *)(b->data + const8);
   return 1;
@@ -121,7 +123,7 @@ int ldd_13( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
   CHECK_READ_ANNOTS( proc_id, b );
-  reg[ri] = *(uint64_t*)(double*)(b + const8);
+  reg[ri] = BLOCK_LOAD( uint64_t, b, const8 );
   //block *b = (block*) CAST_INT reg[rj];
   //reg[ri] = *(int64_t *)(b->data + const8);
   return 1;
@@ -132,16 +134,8 @@ int ldimm_14( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint16_t const16  = TWO_8_TO_16( c3, c4 );
 
-#if TRACK_EXEC
-  fprintf( stderr, "ldimm_14: const16: %d\n", const16 );
-#endif
-
   reg[ri] = (uint64_t)*(int16_t*)&const16;
 
-#if TRACK_EXEC
-  fprintf( stderr, "ldimm_14: reg[ri]: %lld\n", reg[ri] );
-#endif
-
   return 1;
 }
 
@@ -151,9 +145,6 @@ int ldimm2_15( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   uint16_t const16  = TWO_8_TO_16( c3, c4 );
   reg[ri] <<= 16;
   reg[ri] = reg[ri] | (uint64_t)const16;
-#if TRACK_EXEC
-  fprintf( stderr, "ldimm_14: reg[ri]: %lld\n", reg[ri] );
-#endif
   return 1;
 }
 
@@ -165,7 +156,7 @@ int stb_16( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in stb_17!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(uint8_t *)(b + reg[rk]) = reg[ri];
+  BLOCK_STORE( uint8_t, b, reg[rk], reg[ri] );
   return 1;
 }
 
@@ -177,7 +168,7 @@ int stb_17( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in stb_17!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(uint8_t *)(b + const8) = reg[ri];
+  BLOCK_STORE( uint8_t, b, const8, reg[ri] );
   return 1;
 }
 
@@ -189,7 +180,7 @@ int sts_18( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in sts_18!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(int8_t *)(b + reg[rk]) = reg[ri];
+  BLOCK_STORE( int8_t, b, reg[rk], reg[ri] );
   return 1;
 }
 
@@ -201,7 +192,7 @@ int sts_19( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in sts_18!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(int8_t *)(b + const8) = reg[ri];
+  BLOCK_STORE( int8_t, b, const8, reg[ri] );
   return 1;
 }
 
@@ -213,7 +204,7 @@ int sti_20( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in sti_21!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(int32_t *)(b + reg[rk]) = reg[ri];
+  BLOCK_STORE( int32_t, b, reg[rk], reg[ri] );
   return 1;
 }
 
@@ -225,7 +216,7 @@ int sti_21( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in sti_21!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(int32_t *)(b + const8) = reg[ri];
+  BLOCK_STORE( int32_t, b, const8, reg[ri] );
 
   return 1;
 }
@@ -238,7 +229,7 @@ int stl_22( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in stl_22!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(int64_t *)(b + reg[rk]) = reg[ri];
+  BLOCK_STORE( int64_t, b, reg[rk], reg[ri] );
 
   return 1;
 }
@@ -251,7 +242,7 @@ int stl_23( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in stl_23!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(int64_t *)(b + const8) = reg[ri];
+  BLOCK_STORE( int64_t, b, const8, reg[ri] );
 
   return 1;
 }
@@ -264,7 +255,7 @@ int stf_24( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in stf_24!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(uint32_t *)(b + reg[rk]) = *(uint32_t*) (float*) &reg[ri];
+  BLOCK_STORE( uint32_t, b, reg[rk], *(uint32_t*) (float*) &reg[ri] );
 
   return 1;
 }
@@ -277,7 +268,7 @@ int stf_25( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in stf_25!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(uint32_t *)(b + const8) = *(uint32_t*) (float*) &reg[ri];
+  BLOCK_STORE( uint32_t, b, const8, *(uint32_t*) (float*) &reg[ri] );
 
   return 1;
 }
@@ -290,7 +281,7 @@ int std_26( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in std_26!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(uint64_t *)(b + reg[rk]) = *(uint64_t*) (double*) &reg[ri];
+  BLOCK_STORE( uint64_t, b, reg[rk], *(uint64_t*) (double*) &reg[ri] );
 
   return 1;
 }
@@ -303,7 +294,7 @@ int std_27( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     EXIT_WITH_ERROR("Error: Bad memory access in std_27!\n"
                     "This should actually throw an exception!\n");
   CHECK_WRITE_ANNOTS( proc_id, b );
-  *(uint64_t *)(b + const8) = *(uint64_t*) (double*) &reg[ri];
+  BLOCK_STORE( uint64_t, b, const8, *(uint64_t*) (double*) &reg[ri] );
 
   return 1;
 }
@@ -312,15 +303,9 @@ int ldblkid_28( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
                 uint8_t opcode, uint8_t ri, uint8_t c3, uint8_t c4 )
 {
   uint16_t const16 = TWO_8_TO_16( c3, c4 );
-#if TRACK_EXEC
-  fprintf( stderr, "\tldblkid: ri = %d, const16 = %d\n", ri, const16 );
-#endif
   /*FIXME: Check index against f_block count */
   uint8_t *b = (uint8_t*) CAST_INT 
                ((uint64_t*) CAST_INT reg[BLOCK_REG])[const16];
-#if TRACK_EXEC
-  fprintf( stderr, "\tldblkid: b: %p\n", b );
-#endif
   reg[ri] = (uint64_t) CAST_INT b;
   return 1;
 }
@@ -332,9 +317,6 @@ int ldnative_29( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   /*FIXME: Check index against f_block count */
   /*uint8_t *b = (uint8_t*) CAST_INT 
                ((uint64_t*) CAST_INT reg[BLOCK_REG])[const16];*/
-#if TRACK_EXEC
-  fprintf( stderr, "\tldnative: b: %p\n", b );
-#endif
 
 #if CHECKS
   if (const16 >= num_native_funcs)
@@ -356,9 +338,6 @@ int addl_33( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
               uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
 {
   reg[ri] = (long)reg[rj] + (long)const8;
-#if TRACK_EXEC
-  fprintf( stderr, "reg[ri]: %d\n", (int)reg[ri] );
-#endif
   return 1;
 }
 
@@ -412,9 +391,6 @@ int reml_40( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
 {
   reg[ri] = (long)reg[rj] % (long)reg[rk];
-#if TRACK_EXEC
-  fprintf( stderr, "::\t%ld, %ld, %ld\n", reg[ri], (long)reg[rj], (long)reg[rk]);
-#endif
   return 1;
 }
 
@@ -422,9 +398,6 @@ int reml_41( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
 {
   reg[ri] = (long)reg[rj] % (long)const8;
-#if TRACK_EXEC
-  fprintf( stderr, "::\t%ld, %ld, %ld\n", reg[ri], (long)reg[rj], (long)const8);
-#endif
   return 1;
 }
 
@@ -444,17 +417,8 @@ int addd_43( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   addend = *(double*) &reg[rk];
   sum = augend + addend;
 
-#if TRACK_EXEC
-  fprintf( stderr, "augend: %f\naddend: %f\nsum: %f\n",
-                   augend, addend, sum );
-#endif
-
   reg[ri] = *(uint64_t*) &sum;
 
-#if TRACK_EXEC
-  fprintf( stderr, "reg[ri]: %f\n", *(double*) &reg[ri]);
-#endif
-
   return 1;
 }
 
@@ -478,14 +442,7 @@ int muld_45( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   n = *(double*) &reg[rk];
   r = m * n;
 
-#if TRACK_EXEC
-  fprintf( stderr, "m: %f\nn: %f\nr: %f\n",
-                   m, n, r );
-#endif
   reg[ri] = *(uint64_t*) &r;
-#if TRACK_EXEC
-  fprintf( stderr, "reg[ri]: %f\n", *(double*) &reg[ri] );
-#endif
 
   return 1;
 }
@@ -502,15 +459,8 @@ int divd_46( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     return process_exception( proc_id, reg, stack, DIVIDE_BY_ZERO, 0);
 
   quotient = dividend / divisor;
-#if TRACK_EXEC
-  fprintf( stderr, "dividend: %f\ndivisor: %f\nquotient: %f\n",
-                   dividend, divisor, quotient );
-#endif
 
   reg[ri] = *(uint64_t*) &quotient;
-#if TRACK_EXEC
-  fprintf( stderr, "reg[ri]: %f\n", *(double*) &reg[ri] );
-#endif
 
   return 1;
 }
@@ -530,10 +480,6 @@ int cvtld_48( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   double d;
   d = (double) *(int64_t*)&reg[rj];
   reg[ri] =  *(uint64_t*)&d;
-#if TRACK_EXEC
-  fprintf( stderr, "cvtld: reg[rj]: %d\n", *(int64_t*)&reg[rj]);
-  fprintf( stderr, "cvtld: reg[ri]: %f\n", *(double*)&reg[ri]);
-#endif
   return 1;
 }
 
@@ -543,10 +489,6 @@ int cvtdl_49( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   long l;
   l = (long)*(double*)&reg[rj];
   reg[ri] = *(uint64_t*)&l;
-#if TRACK_EXEC
-  fprintf( stderr, "cvtdl: reg[rj]: %f\n", *(double*)&reg[rj]);
-  fprintf( stderr, "cvtdl: reg[ri]: %d\n", reg[ri]);
-#endif
   return 1;
 }
 
@@ -782,13 +724,19 @@ int jmp_80( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   int16_t const16 = *(int16_t*) &uconst16;
   /* FIXME */
   CIO += const16 * 4;
+  if( const16 < 0 )
+    return SAFEPOINT_POLL();
   return 1;
 }
 
 int jmp_81( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
 {
+  uint64_t old_cio = CIO;
+
   CIO = CIO + reg[rj] + (reg[rk] * 4);
+  if( CIO <= old_cio )
+    return SAFEPOINT_POLL();
   return 1;
 }
 
@@ -803,6 +751,8 @@ int btrue_82( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     const16 = *(int16_t*) &uconst16;
     /* FIXME */
     CIO += const16 * 4;
+    if( const16 < 0 )
+      return SAFEPOINT_POLL();
   }
   return 1;
 }
@@ -818,6 +768,8 @@ int bfalse_83( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
     const16 = *(int16_t*) &uconst16;
     /* FIXME */
     CIO += const16 * 4;
+    if( const16 < 0 )
+      return SAFEPOINT_POLL();
   }
 
   return 1;
@@ -831,24 +783,150 @@ int valid_bid( uint64_t id )
   return find_blk( blocks, id );
 }
 
+/*
+ * Atomic read-modify-write opcodes. All take the word at offset rk in
+ * block rj, of 8, 32 or 64 bits, and are sequentially consistent.
+ *
+ * fadd  ri, rj, rk   adds ri to the word and puts the old value in ri
+ * xchg  ri, rj, rk   swaps ri with the word
+ * cas   ri, rj, rk   if the word equals ri replaces it with ri+1. The
+ *                    old value is put in ri and ri+1 is set to 1 if
+ *                    the swap was made and 0 if not.
+ */
+
+int faddb_84( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int8_t *p = (int8_t *)(b + reg[rk]);
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 1 );
+  reg[ri] = __atomic_fetch_add( p, (int8_t) reg[ri], __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+int faddi_85( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int32_t *p = (int32_t *)(b + reg[rk]);
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 4 );
+  reg[ri] = __atomic_fetch_add( p, (int32_t) reg[ri], __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+int faddl_86( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int64_t *p = (int64_t *)(b + reg[rk]);
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 8 );
+  reg[ri] = __atomic_fetch_add( p, (int64_t) reg[ri], __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+int xchgb_87( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int8_t *p = (int8_t *)(b + reg[rk]);
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 1 );
+  reg[ri] = __atomic_exchange_n( p, (int8_t) reg[ri], __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+int xchgi_88( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int32_t *p = (int32_t *)(b + reg[rk]);
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 4 );
+  reg[ri] = __atomic_exchange_n( p, (int32_t) reg[ri], __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+int xchgl_89( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int64_t *p = (int64_t *)(b + reg[rk]);
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 8 );
+  reg[ri] = __atomic_exchange_n( p, (int64_t) reg[ri], __ATOMIC_SEQ_CST );
+  return 1;
+}
+
+int casb_90( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int8_t *p = (int8_t *)(b + reg[rk]);
+  int8_t old = (int8_t) reg[ri];
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 1 );
+  if( ri >= MAX_REGS - 1 )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  reg[ri+1] = __atomic_compare_exchange_n( p, &old, (int8_t) reg[ri+1], 0,
+                                           __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST );
+  reg[ri] = old;
+  return 1;
+}
+
+int casi_91( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int32_t *p = (int32_t *)(b + reg[rk]);
+  int32_t old = (int32_t) reg[ri];
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 4 );
+  if( ri >= MAX_REGS - 1 )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  reg[ri+1] = __atomic_compare_exchange_n( p, &old, (int32_t) reg[ri+1], 0,
+                                           __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST );
+  reg[ri] = old;
+  return 1;
+}
+
+int casl_92( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint8_t *b = (uint8_t*) CAST_INT reg[rj];
+  int64_t *p = (int64_t *)(b + reg[rk]);
+  int64_t old = (int64_t) reg[ri];
+
+  CHECK_ATOMIC_ANNOTS( proc_id, b, reg[rk], 8 );
+  if( ri >= MAX_REGS - 1 )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  reg[ri+1] = __atomic_compare_exchange_n( p, &old, (int64_t) reg[ri+1], 0,
+                                           __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST );
+  reg[ri] = old;
+  return 1;
+}
+
 int alloc_blk_96( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
 {
   uint8_t *b;
 
-  pthread_mutex_lock( &malloc_xpvm_mu );
-
-  b = (uint8_t*)malloc_xpvm( reg[rj] );
+  ALLOC_PROF( cur_proc, reg, reg[rj], ALLOC_SHARED );
+  b = (uint8_t*)malloc_xpvm_proc( cur_proc, reg[rj] );
+  CONTEND_ALLOC( cur_proc, reg, b );
   BLOCK_LENGTH( b ) = reg[rj];
   if( ! reg[rk] )
     SET_BLOCK_OWNED( b );
   else
     SET_BLOCK_CHAINED( b, reg[rk] );
-  BLOCK_OWNER( b ) = proc_id;
+  BLOCK_OWNER( b ) = OWNER_TAG( proc_id );
   reg[ri] = (uint64_t)(uint64_t*) b;
 
-  pthread_mutex_unlock( &malloc_xpvm_mu );
-
   return 1;
 }
 
@@ -857,18 +935,15 @@ int alloc_private_blk_97( unsigned int proc_id, uint64_t *reg, stack_frame **sta
 {
   uint8_t *b;
 
-  pthread_mutex_lock( &malloc_xpvm_mu );
-
-  b = (uint8_t*)malloc_xpvm( reg[rj] );
+  ALLOC_PROF( cur_proc, reg, reg[rj], ALLOC_PRIVATE );
+  b = (uint8_t*)malloc_xpvm_proc( cur_proc, reg[rj] );
 
   BLOCK_LENGTH( b ) = reg[rj];
   SET_BLOCK_OWNED( b );
   SET_BLOCK_PRIVATE( b );
-  BLOCK_OWNER( b ) = proc_id;
+  BLOCK_OWNER( b ) = OWNER_TAG( proc_id );
   reg[ri] = (uint64_t)(uint64_t*) b;
 
-  pthread_mutex_unlock( &malloc_xpvm_mu );
-
   return 1;
 }
 
@@ -877,14 +952,15 @@ int aquire_blk_98( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 {
   uint8_t *b = (uint8_t*) reg[rj];
   CHECK_AQUIRE_ANNOTS( proc_id, b );
-  if( CHECK_OWNED(b) )
+  if( !CMPXCHG( &(BLOCK_OWNER(b)), 0, OWNER_TAG( proc_id ) ) )
   {
+    CONTEND_AQUIRE( cur_proc, b, 1, 0, 0 );
     reg[rk] = 0;
     return 1;
   }
-  /* reg[rk] is set in this macro */
   SET_BLOCK_OWNED(b);
-  CMPXCHG( &(BLOCK_OWNER(b)), NULL, proc_id );
+  CONTEND_AQUIRE( cur_proc, b, 0, 1, 0 );
+  reg[rk] = 1;
   return 1;
 }
 
@@ -894,8 +970,9 @@ int release_blk_99( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   uint8_t *b = (uint8_t*) reg[rj];
 
   CHECK_RELEASE_ANNOTS( proc_id, b );
+  CONTEND_RELEASE( cur_proc, b );
   SET_BLOCK_FREE(b);
-  BLOCK_OWNER(b) = 0;
+  block_release_wake(b);
   return 1;
 }
 
@@ -911,39 +988,136 @@ int rannots_101( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   return 1;
 }
 
+/*
+ * towner_102
+ *
+ * Transfers ownership of block rj, which this processor must own, to
+ * the processor or task whose id is in ri. The block itself stays where
+ * it is, so this is how a whole block is handed over without copying.
+ * The store is a release so the new owner sees everything written to
+ * the block before it, once it learns of the handover.
+ */
 int towner_102( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
 {
+  uint8_t *b = (uint8_t*) reg[rj];
+
+  if( reg[ri] >= XPVM_MAX_PROCESSORS + XPVM_MAX_TASKS )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  CHECK_RELEASE_ANNOTS( proc_id, b );
+  SET_BLOCK_OWNED(b);
+  __atomic_store_n( &BLOCK_OWNER( b ), OWNER_TAG( reg[ri] ),
+                    __ATOMIC_RELEASE );
   return 1;
 }
 
+/*
+ * lock_103
+ *
+ * Enters the monitor of block rj, sleeping until it is available.
+ */
 int lock_103( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+            uint8_t opcode, uint8_t rj, uint8_t c3, uint8_t c4 )
 {
+  uint8_t *b = (uint8_t*) reg[rj];
+
+  CHECK_LOCK_ANNOTS( proc_id, b );
+  if( cur_task )
+  {
+    /* Tasks must not put their carrier to sleep, park instead */
+    if( task_lock( b, proc_id ) )
+      return 1;
+    return TASK_BLOCK();
+  }
+  monitor_lock( b, proc_id );
   return 1;
 }
 
 int unlock_104( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+            uint8_t opcode, uint8_t rj, uint8_t c3, uint8_t c4 )
 {
+  uint8_t *b = (uint8_t*) reg[rj];
+
+  CHECK_MONITOR_ANNOTS( proc_id, b );
+  monitor_unlock( b );
   return 1;
 }
 
+/*
+ * wait_105
+ *
+ * Releases the monitor of block rj and waits to be signalled. The
+ * monitor is held again when this returns.
+ */
 int wait_105( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+            uint8_t opcode, uint8_t rj, uint8_t c3, uint8_t c4 )
 {
+  uint8_t *b = (uint8_t*) reg[rj];
+
+  if( cur_task )
+  {
+    /* Only check on the first try, the monitor is released after it */
+    if( cur_task->wait_blk != b )
+      CHECK_MONITOR_ANNOTS( proc_id, b );
+    if( task_wait( cur_task, b, proc_id ) )
+      return 1;
+    return TASK_BLOCK();
+  }
+  CHECK_MONITOR_ANNOTS( proc_id, b );
+  monitor_wait( b, proc_id );
   return 1;
 }
 
 int sig_106( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+            uint8_t opcode, uint8_t rj, uint8_t c3, uint8_t c4 )
 {
+  uint8_t *b = (uint8_t*) reg[rj];
+
+  CHECK_MONITOR_ANNOTS( proc_id, b );
+  monitor_signal( b );
   return 1;
 }
 
 int sigall_107( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+            uint8_t opcode, uint8_t rj, uint8_t c3, uint8_t c4 )
+{
+  uint8_t *b = (uint8_t*) reg[rj];
+
+  CHECK_MONITOR_ANNOTS( proc_id, b );
+  monitor_broadcast( b );
+  return 1;
+}
+
+/*
+ * aquire_blkw_108
+ *
+ * Blocking version of aquire_blk. Spins briefly if the block is owned
+ * and then sleeps until release_blk hands it over, so reg[rk] is
+ * always set to 1.
+ */
+int aquire_blkw_108( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
 {
+  uint8_t *b = (uint8_t*) reg[rj];
+  uint64_t t0;
+  CHECK_AQUIRE_ANNOTS( proc_id, b );
+  if( !CMPXCHG( &(BLOCK_OWNER(b)), 0, OWNER_TAG( proc_id ) ) )
+  {
+    if( cur_task )
+    {
+      CONTEND_AQUIRE( cur_proc, b, 1, 0, 0 );
+      return TASK_BLOCK();
+    }
+    t0 = contend_on ? prof_ticks() : 0;
+    TIMELINE( cur_proc, TIMELINE_WAIT_BEGIN, (uint64_t) CAST_INT b );
+    block_aquire_wait( b, proc_id );
+    TIMELINE( cur_proc, TIMELINE_WAIT_END, 0 );
+    CONTEND_AQUIRE( cur_proc, b, 1, 1, prof_ticks() - t0 );
+  }
+  else
+    CONTEND_AQUIRE( cur_proc, b, 0, 1, 0 );
+  SET_BLOCK_OWNED(b);
+  reg[rk] = 1;
   return 1;
 }
 
@@ -954,9 +1128,6 @@ int ldfunc_112( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   /*FIXME: Check index against f_block count */
   uint8_t *b = (uint8_t*) CAST_INT 
                ((uint64_t*) CAST_INT reg[BLOCK_REG])[const16];
-#if TRACK_EXEC
-  fprintf( stderr, "\tldfunc: b: %p\n", b );
-#endif
   reg[ri] = (uint64_t) CAST_INT b;
   return 1;
 }
@@ -971,37 +1142,16 @@ int call_114( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
 {
   uint8_t *b = (uint8_t*) CAST_INT reg[rj];
-#if TRACK_EXEC
-  fprintf( stderr, "\tcall: b: %p\n", b );
-  fprintf( stderr, "\tblock annots: %x\n", BLOCK_ANNOTS(b) );
-  fprintf( stderr, "INST_MASK: %lld\n", (uint64_t) INST_MASK );
-#endif
   CHECK_EXEC_ANNOTS( proc_id, b );
-  stack_frame *f = calloc( 1, sizeof(stack_frame) );
-  /* FIXME: Throw OutOfMemory Exception */
-  if( !f )
-    EXIT_WITH_ERROR("Error: malloc failed in call_114\n");
+  uint32_t frame_size = BLOCK_FRAME_SIZE( b );
+  stack_frame *f = frame_alloc( cur_proc, frame_size );
   f->pc = reg[PC_REG];
   f->cio = CIO;
   f->cib = CIB;
   f->reg255 = reg[255];
   f->ret_reg = ri;
+  cur_proc->calls++;
 
-  uint32_t frame_size = BLOCK_FRAME_SIZE( b );
-#if TRACK_EXEC
-  fprintf( stderr, "\tcall_114: frame_size: %d\n", frame_size );
-#endif
-  if( frame_size )
-  {
-    f->block = calloc( frame_size + BLOCK_HEADER_LENGTH, sizeof(uint8_t) );
-    /* FIXME: Throw OutOfMemory Exception */
-    if( !f->block )
-      EXIT_WITH_ERROR("Error: malloc failed in call_114\n");
-
-    f->block = f->block + BLOCK_HEADER_LENGTH;
-    BLOCK_LENGTH( f->block ) = frame_size;
-
-  }
   f->prev = *stack;
   *stack = f;
   reg[STACK_FRAME_REG] = (uint64_t) CAST_INT f->block;
@@ -1009,7 +1159,7 @@ int call_114( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   CIB = (uint64_t) CAST_INT b;
   CIO = 0;
 
-  return 1;
+  return SAFEPOINT_POLL();
 }
 
 /*
@@ -1026,16 +1176,13 @@ int calln_115( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   /*int (*fp)( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
                      uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 );*/
   int (*fp)( void );
-#if TRACK_EXEC
-  //fprintf( stderr, "name: %s\n", name );
-  fprintf( stderr, "num args: %d\n", const8 );
-#endif
 
   /*fp = (int (*)(void)) dlsym( __lh, name );
   if( (error = dlerror()) != NULL )
     EXIT_WITH_ERROR("Error: dlsym failed in calln_115\n");*/
   //fp = native_funcs[reg[rj]].fp;
   fp = (int (*)(void)) reg[rj];
+  cur_proc->natives++;
   #if 1
   for( i = 0; i < const8 && i < 10; i++ )
   {
@@ -1115,10 +1262,6 @@ int calln_115( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 int ret_116( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t rj, uint8_t c3, uint8_t c4 )
 {
-#if TRACK_EXEC > 1
-  fprintf( stderr, "\treg: %p\n", reg );
-  fprintf( stderr, "\tstack: %p\n", *stack );
-#endif
   if ( !(*stack)->prev ) /* we are main */
     (*stack)->ret_reg = rj;
   reg[(*stack)->ret_reg] = reg[rj];
@@ -1127,18 +1270,12 @@ int ret_116( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   CIO = (*stack)->cio;
   CIB = (*stack)->cib;
   /* pop frame */
-#if TRACK_EXEC
-  fprintf( stderr, "\tret_reg: %lld\n", (*stack)->ret_reg );
-  fprintf( stderr, "\treg[ret_reg]: %lld\n", reg[(*stack)->ret_reg] );
-#endif
   /* popped last stack, halt */
   if( !(*stack)->prev )
     return 0;
   stack_frame *old_frame = *stack;
   *stack = (*stack)->prev;
-  if( old_frame->block )
-    free( old_frame->block - BLOCK_HEADER_LENGTH );
-  free( old_frame );
+  frame_free( cur_proc, old_frame );
 
   return 1;
 }
@@ -1155,37 +1292,761 @@ int retrieve_129( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   return 1;
 }
 
-int init_proc_144( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+/*
+ * chan_create_130
+ *
+ * Puts the handle of a new channel holding up to rj values in ri.
+ */
+int chan_create_130( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  int64_t h = chan_create( reg[rj] );
+
+  if( h < 0 )
+    return process_exception( proc_id, reg, stack, OUT_OF_MEMORY, 0 );
+  reg[ri] = h;
+  return 1;
+}
+
+/*
+ * chan_send_131
+ *
+ * Sends rj on channel ri, blocking while the channel is full. If const8
+ * is nonzero rj is a block owned by the sender, and ownership of it
+ * passes to whichever processor receives it. A task yields and retries
+ * instead of blocking.
+ */
+int chan_send_131( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
 {
-  int i = 0;
-  uint64_t *args = calloc( const8+1, sizeof(uint64_t) );
-  if( !args )
-    EXIT_WITH_ERROR("Error: malloc failed in init_proc_144\n");
+  xpvm_chan *c = chan_lookup( reg[ri] );
+  uint8_t *b = (uint8_t*) reg[rj];
 
-  for( i = 0; i <= const8; i++  )
-    args[i] = reg[i];
+  if( !c )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  if( const8 )
+  {
+    CHECK_RELEASE_ANNOTS( proc_id, b );
+    /* Nobody can aquire the block while it is in the channel, the
+     * receiver takes it over from here. */
+    __atomic_store_n( &BLOCK_OWNER( b ), OWNER_IN_CHANNEL, __ATOMIC_RELAXED );
+  }
+  if( cur_task )
+  {
+    if( chan_task_send( c, reg[rj], const8 != 0 ) )
+      return 1;
+    /* Still ours until it is in the channel, so the retry can check it */
+    if( const8 )
+      __atomic_store_n( &BLOCK_OWNER( b ), OWNER_TAG( proc_id ),
+                        __ATOMIC_RELAXED );
+    return TASK_BLOCK();
+  }
+  chan_send( c, reg[rj], const8 != 0 );
+  return 1;
+}
 
-  do_init_proc( &reg[ri], reg[rj], const8, args );
+/*
+ * chan_recv_132
+ *
+ * Receives a value from channel ri into rj, blocking while the channel
+ * is empty. A block sent with ownership is now owned by this processor.
+ * A task yields and retries instead of blocking.
+ */
+int chan_recv_132( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  xpvm_chan *c = chan_lookup( reg[ri] );
+  uint64_t val, is_blk;
+
+  if( !c )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  if( cur_task )
+  {
+    if( !chan_try_recv( c, &val, &is_blk ) )
+      return TASK_BLOCK();
+    reg[rj] = val;
+  }
+  else
+    reg[rj] = chan_recv( c, &is_blk );
+  if( is_blk )
+    __atomic_store_n( &BLOCK_OWNER( (uint8_t*) reg[rj] ), OWNER_TAG( proc_id ),
+                      __ATOMIC_RELAXED );
   return 1;
 }
 
-int join_145( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+/*
+ * chan_tryrecv_133
+ *
+ * As chan_recv but never blocks, sets rk to 1 if a value was received
+ * into rj and to 0 if the channel was empty.
+ */
+int chan_tryrecv_133( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  xpvm_chan *c = chan_lookup( reg[ri] );
+  uint64_t val, is_blk;
+
+  if( !c )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  reg[rk] = chan_try_recv( c, &val, &is_blk );
+  if( !reg[rk] )
+    return 1;
+  reg[rj] = val;
+  if( is_blk )
+    __atomic_store_n( &BLOCK_OWNER( (uint8_t*) val ), OWNER_TAG( proc_id ),
+                      __ATOMIC_RELAXED );
+  return 1;
+}
+
+/*
+ * barrier_init_134
+ *
+ * Puts the handle of a new barrier for rj processors in ri.
+ */
+int barrier_init_134( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
 {
-  do_proc_join( reg[ri], &reg[rj] );
+  int64_t h;
+
+  if( !reg[rj] || reg[rj] > XPVM_MAX_PROCESSORS )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  h = barrier_create( reg[rj] );
+  if( h < 0 )
+    return process_exception( proc_id, reg, stack, OUT_OF_MEMORY, 0 );
+  reg[ri] = h;
   return 1;
 }
 
-int join2_146( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+/*
+ * barrier_135
+ *
+ * Waits at barrier ri. rj is set to 1 in the last processor to arrive
+ * and 0 in the others. A task arrives once and then yields until the
+ * barrier is released.
+ */
+int barrier_135( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
             uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
 {
-  do_join2( reg[ri], &reg[rj] );
+  xpvm_barrier *b = barrier_lookup( reg[ri] );
+
+  if( !b )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  if( cur_task )
+  {
+    if( cur_task->wait_bar != b )
+    {
+      if( barrier_arrive( b, &cur_task->wait_gen ) )
+      {
+        reg[rj] = 1;
+        return 1;
+      }
+      cur_task->wait_bar = b;
+    }
+    if( !barrier_passed( b, cur_task->wait_gen ) )
+      return TASK_BLOCK();
+    cur_task->wait_bar = NULL;
+    reg[rj] = 0;
+    return 1;
+  }
+  reg[rj] = barrier_wait( b );
   return 1;
 }
 
-int whoami_147( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
-            uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+/*
+ * joinany_136
+ *
+ * Joins whichever of the ri processors whose ids are in rj and the
+ * registers after it finishes first and puts its return value in rk.
+ * Its id is swapped to the end of the list and ri decremented, so a
+ * program can loop until ri reaches 0 to join them all. A task polls
+ * them and yields until one has finished.
+ */
+int joinany_136( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri];
+  uint64_t ret_val, id;
+  uint32_t i;
+
+  if( !n || n > XPVM_MAX_PROCESSORS || rj + n > MAX_REGS )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+
+  if( cur_task )
+  {
+    for( i = 0; i < n; i++ )
+      if( do_join2( reg[rj+i], &ret_val ) )
+        break;
+    if( i == n )
+      return TASK_BLOCK();
+  }
+  else
+    i = do_join_any( &reg[rj], n, &ret_val );
+  id = reg[rj+i];
+  reg[rj+i] = reg[rj+n-1];
+  reg[rj+n-1] = id;
+  reg[ri] = n - 1;
+  reg[rk] = ret_val;
+  return 1;
+}
+
+/*
+ * spawn_137
+ *
+ * Starts a task running function block rj with the first const8
+ * registers from 1 on as arguments, and puts its id in ri. Tasks are
+ * joined with join like processors.
+ */
+int spawn_137( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
+{
+  reg[ri] = task_spawn( reg[rj], const8, reg, 0 );
+  return 1;
+}
+
+/*
+ * spawnd_138
+ *
+ * As spawn, but the task is detached and can not be joined.
+ */
+int spawnd_138( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
 {
-  return proc_id;
+  reg[ri] = task_spawn( reg[rj], const8, reg, 1 );
+  return 1;
+}
+
+/*
+ * yield_139
+ *
+ * Lets another task run, or gives up the CPU if run by a processor.
+ */
+int yield_139( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t c2, uint8_t c3, uint8_t c4 )
+{
+  return XPVM_YIELD;
+}
+
+/*
+ * Bulk opcodes. Like the vector opcodes a range is a block and an offset
+ * in a pair of registers, here counted in bytes. Each range is checked
+ * once and then handed to the C library. On volatile blocks the bytes
+ * are not accessed atomically.
+ */
+
+/*
+ * bcopy_140
+ *
+ * Copies reg[ri+2] bytes from the range at rj to the range at ri. The
+ * ranges may overlap.
+ */
+int bcopy_140( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  uint64_t n = reg[ri+2];
+  uint8_t *d = (uint8_t*) CAST_INT reg[ri];
+  uint8_t *a = (uint8_t*) CAST_INT reg[rj];
+
+  if( ri > MAX_REGS - 3 || rj > MAX_REGS - 2 )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  CHECK_RANGE_ANNOTS( proc_id, d, reg[ri+1], n, 1, CHECK_WRITE_ANNOTS );
+  CHECK_RANGE_ANNOTS( proc_id, a, reg[rj+1], n, 1, CHECK_READ_ANNOTS );
+  memmove( d + reg[ri+1], a + reg[rj+1], n );
+  return 1;
+}
+
+/*
+ * bfill_141
+ *
+ * Sets reg[ri+2] bytes of the range at ri to the low byte of rj.
+ */
+int bfill_141( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  uint64_t n = reg[ri+2];
+  uint8_t *d = (uint8_t*) CAST_INT reg[ri];
+
+  if( ri > MAX_REGS - 3 )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  CHECK_RANGE_ANNOTS( proc_id, d, reg[ri+1], n, 1, CHECK_WRITE_ANNOTS );
+  memset( d + reg[ri+1], (uint8_t) reg[rj], n );
+  return 1;
+}
+
+/*
+ * bcmp_142
+ *
+ * Compares reg[ri] bytes of the ranges at rj and rk, putting -1, 0 or 1
+ * in ri as the first is less than, equal to or greater than the second.
+ */
+int bcmp_142( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri];
+  uint8_t *a = (uint8_t*) CAST_INT reg[rj];
+  uint8_t *b = (uint8_t*) CAST_INT reg[rk];
+  int r;
+
+  if( rj > MAX_REGS - 2 || rk > MAX_REGS - 2 )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+  CHECK_RANGE_ANNOTS( proc_id, a, reg[rj+1], n, 1, CHECK_READ_ANNOTS );
+  CHECK_RANGE_ANNOTS( proc_id, b, reg[rk+1], n, 1, CHECK_READ_ANNOTS );
+  r = memcmp( a + reg[rj+1], b + reg[rk+1], n );
+  reg[ri] = (int64_t)( (r > 0) - (r < 0) );
+  return 1;
+}
+
+int init_proc_144( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
+{
+  int i = 0;
+  uint64_t *args = calloc( const8+1, sizeof(uint64_t) );
+  if( !args )
+    EXIT_WITH_ERROR("Error: malloc failed in init_proc_144\n");
+
+  for( i = 0; i <= const8; i++  )
+    args[i] = reg[i];
+
+  do_init_proc( &reg[ri], reg[rj], const8, args );
+  return 1;
+}
+
+int join_145( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  if( cur_task )
+  {
+    /* A task parks on a task it joins rather than blocking its carrier,
+     * and polls a processor */
+    if( IS_TASK_ID( reg[ri] ) )
+      task_park_prepare( cur_task, reg[ri] );
+    if( do_join2( reg[ri], &reg[rj] ) )
+    {
+      task_park_cancel( cur_task );
+      return 1;
+    }
+    return TASK_BLOCK();
+  }
+  TIMELINE( cur_proc, TIMELINE_JOIN_BEGIN, reg[ri] );
+  do_proc_join( reg[ri], &reg[rj] );
+  TIMELINE( cur_proc, TIMELINE_JOIN_END, 0 );
+  return 1;
+}
+
+/*
+ * join2_146
+ *
+ * Polls processor ri. If it has finished it is joined, its return value
+ * put in rj and rk set to 1, otherwise rk is set to 0.
+ */
+int join2_146( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  reg[rk] = do_join2( reg[ri], &reg[rj] );
+  return 1;
+}
+
+/*
+ * whoami_147
+ *
+ * Puts the id of the executing processor in ri.
+ */
+int whoami_147( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t c3, uint8_t c4 )
+{
+  reg[ri] = proc_id;
+  return 1;
+}
+
+/*
+ * parfor_148
+ *
+ * Runs the function block in rj over the range [ri, ri+1) on ri+2
+ * processors, splitting it statically if ri+3 is 0 and otherwise
+ * handing out ri+3 iterations at a time. The first const8 registers
+ * from 1 on, at most XPVM_PARFOR_MAX_ARGS, are passed to every call
+ * after the range bounds. Sets ri to the number of processors used.
+ * Waiting for them would block the carrier of a task, so in a task it
+ * raises ILLEGAL_INSTRUCTION.
+ */
+int parfor_148( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
+{
+  if( cur_task || ri > MAX_REGS - 4 || const8 > XPVM_PARFOR_MAX_ARGS )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+
+  reg[ri] = do_parfor( cur_proc, reg[ri], reg[ri+1], reg[ri+2],
+                       reg[ri+3], reg[rj], const8, &reg[1] );
+  return 1;
+}
+
+/*
+ * reduce_149
+ *
+ * Joins the ri processors whose ids are in rj and the registers after
+ * it, combining their return values with operator const8 as they
+ * finish. The result replaces the count in ri. As with parfor it raises
+ * ILLEGAL_INSTRUCTION in a task.
+ */
+int reduce_149( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t const8 )
+{
+  if( cur_task || !reg[ri] || reg[ri] > XPVM_MAX_PROCESSORS ||
+      rj + reg[ri] > MAX_REGS || const8 > REDUCE_MAXD )
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 );
+
+  do_reduce( &reg[rj], reg[ri], const8, &reg[ri] );
+  return 1;
+}
+
+/*
+ * Math opcodes. These go straight to libm, which uses the hardware
+ * instruction where there is one, saving programs a calln for each.
+ */
+
+/*
+ * fmad_117
+ *
+ * ri <-- rj * rk + ri as doubles, rounded once.
+ */
+int fmad_117( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = fma( *(double*) &reg[rj], *(double*) &reg[rk], *(double*) &reg[ri] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int sqrtd_118( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = sqrt( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+/*
+ * mind_119 and maxd_120
+ *
+ * If one operand is a NaN the other is returned.
+ */
+int mind_119( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = fmin( *(double*) &reg[rj], *(double*) &reg[rk] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int maxd_120( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = fmax( *(double*) &reg[rj], *(double*) &reg[rk] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int absd_121( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = fabs( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int floord_122( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = floor( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int ceild_123( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = ceil( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int expd_124( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = exp( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int logd_125( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = log( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int sind_126( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = sin( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+int cosd_127( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  double r;
+
+  r = cos( *(double*) &reg[rj] );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+/*
+ * Vector opcodes. A vector operand is a pair of registers, the first
+ * holding a block and the second the index of the element to start at.
+ * Element-wise opcodes write the range at ri/ri+1 and take the element
+ * count from ri+2; dot and sum take the count from ri and leave their
+ * result there. Each range is checked once and the work is done by the
+ * kernels in vec.c.
+ */
+#define VEC_ELEM( r, type ) ((type*) CAST_INT reg[r] + reg[(r)+1])
+
+#define CHECK_VEC_DST( r, n ) do {                                       \
+  if( (r) > MAX_REGS - 3 )                                             \
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 ); \
+  CHECK_RANGE_ANNOTS( proc_id, (uint8_t*) CAST_INT reg[r], reg[(r)+1], \
+                      n, 8, CHECK_WRITE_ANNOTS );                      \
+} while(0)
+
+#define CHECK_VEC_SRC( r, n ) do {                                       \
+  if( (r) > MAX_REGS - 2 )                                             \
+    return process_exception( proc_id, reg, stack, ILLEGAL_INSTRUCTION, 0 ); \
+  CHECK_RANGE_ANNOTS( proc_id, (uint8_t*) CAST_INT reg[r], reg[(r)+1], \
+                      n, 8, CHECK_READ_ANNOTS );                       \
+} while(0)
+
+/*
+ * vaddd_160
+ *
+ * D[i] = a[i] + b[i] over doubles, with d at ri, a at rj and b at rk.
+ */
+int vaddd_160( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  vec_ops->addd( VEC_ELEM( ri, double ), VEC_ELEM( rj, double ), VEC_ELEM( rk, double ), n );
+  return 1;
+}
+
+/*
+ * vaddl_161
+ *
+ * D[i] = a[i] + b[i] over longs, with d at ri, a at rj and b at rk.
+ */
+int vaddl_161( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  vec_ops->addl( VEC_ELEM( ri, int64_t ), VEC_ELEM( rj, int64_t ), VEC_ELEM( rk, int64_t ), n );
+  return 1;
+}
+
+/*
+ * vmuld_162
+ *
+ * D[i] = a[i] * b[i] over doubles, with d at ri, a at rj and b at rk.
+ */
+int vmuld_162( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  vec_ops->muld( VEC_ELEM( ri, double ), VEC_ELEM( rj, double ), VEC_ELEM( rk, double ), n );
+  return 1;
+}
+
+/*
+ * vmull_163
+ *
+ * D[i] = a[i] * b[i] over longs, with d at ri, a at rj and b at rk.
+ */
+int vmull_163( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  vec_ops->mull( VEC_ELEM( ri, int64_t ), VEC_ELEM( rj, int64_t ), VEC_ELEM( rk, int64_t ), n );
+  return 1;
+}
+
+/*
+ * vfmad_164
+ *
+ * D[i] += a[i] * b[i] over doubles, with d at ri, a at rj and b at rk.
+ */
+int vfmad_164( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  vec_ops->fmad( VEC_ELEM( ri, double ), VEC_ELEM( rj, double ), VEC_ELEM( rk, double ), n );
+  return 1;
+}
+
+/*
+ * vfmal_165
+ *
+ * D[i] += a[i] * b[i] over longs, with d at ri, a at rj and b at rk.
+ */
+int vfmal_165( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  vec_ops->fmal( VEC_ELEM( ri, int64_t ), VEC_ELEM( rj, int64_t ), VEC_ELEM( rk, int64_t ), n );
+  return 1;
+}
+
+/*
+ * vscaled_166
+ *
+ * d[i] = a[i] * s over doubles, with d at ri, a at rj and s in rk.
+ */
+int vscaled_166( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  vec_ops->scaled( VEC_ELEM( ri, double ), VEC_ELEM( rj, double ), *(double*) &reg[rk], n );
+  return 1;
+}
+
+/*
+ * vscalel_167
+ *
+ * d[i] = a[i] * s over longs, with d at ri, a at rj and s in rk.
+ */
+int vscalel_167( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri+2];
+
+  CHECK_VEC_DST( ri, n );
+  CHECK_VEC_SRC( rj, n );
+  vec_ops->scalel( VEC_ELEM( ri, int64_t ), VEC_ELEM( rj, int64_t ), *(int64_t*) &reg[rk], n );
+  return 1;
+}
+
+/*
+ * vdotd_168
+ *
+ * Dot product of the reg[ri] doubles at rj and rk, put in ri.
+ */
+int vdotd_168( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri];
+  double r;
+
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  r = vec_ops->dotd( VEC_ELEM( rj, double ), VEC_ELEM( rk, double ), n );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+/*
+ * vdotl_169
+ *
+ * Dot product of the reg[ri] longs at rj and rk, put in ri.
+ */
+int vdotl_169( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t rk )
+{
+  uint64_t n = reg[ri];
+  int64_t r;
+
+  CHECK_VEC_SRC( rj, n );
+  CHECK_VEC_SRC( rk, n );
+  r = vec_ops->dotl( VEC_ELEM( rj, int64_t ), VEC_ELEM( rk, int64_t ), n );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+/*
+ * vsumd_170
+ *
+ * Sum of the reg[ri] doubles at rj, put in ri.
+ */
+int vsumd_170( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  uint64_t n = reg[ri];
+  double r;
+
+  CHECK_VEC_SRC( rj, n );
+  r = vec_ops->sumd( VEC_ELEM( rj, double ), n );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
+}
+
+/*
+ * vsuml_171
+ *
+ * Sum of the reg[ri] longs at rj, put in ri.
+ */
+int vsuml_171( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
+            uint8_t opcode, uint8_t ri, uint8_t rj, uint8_t c4 )
+{
+  uint64_t n = reg[ri];
+  int64_t r;
+
+  CHECK_VEC_SRC( rj, n );
+  r = vec_ops->suml( VEC_ELEM( rj, int64_t ), n );
+  reg[ri] = *(uint64_t*) &r;
+  return 1;
 }
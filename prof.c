@@ -0,0 +1,320 @@
+/*
+ * prof.c
+ *
+ * Execution profile for the XPVM, compiled in with PROFILE_XPVM (make
+ * BUILD=profile). Each processor counts the instructions it runs by
+ * opcode, by pair of consecutive opcodes and by function block, and times
+ * about one instruction in XPVM_PROF_SAMPLE with the cycle counter,
+ * charging the time scaled up by the sampling interval to its opcode and
+ * block. The counters belong to the processor so nothing is shared while
+ * the program runs; they are added up when it finishes and written out as
+ * JSON and CSV, costliest first.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "xpvm.h"
+
+/* Loaded blocks sorted by address, for finding a block from its CIB */
+struct prof_blk
+{
+  uint8_t   *b;
+  uint32_t  idx;
+};
+
+static struct prof_blk *prof_sorted = NULL;
+static uint32_t prof_nblocks = 0;
+
+static int prof_blk_cmp( const void *x, const void *y )
+{
+  const struct prof_blk *a = x, *b = y;
+  return (a->b > b->b) - (a->b < b->b);
+}
+
+/*
+ * prof_init
+ *
+ * Builds the block lookup table. Called by main once the object file is
+ * loaded.
+ */
+void prof_init( void )
+{
+  uint32_t i;
+
+  prof_nblocks = block_cnt;
+  prof_sorted = calloc( block_cnt + 1, sizeof(struct prof_blk) );
+  if( !prof_sorted )
+    EXIT_WITH_ERROR("Error: malloc failed in prof_init\n");
+  for( i = 0; i < block_cnt; i++ )
+  {
+    prof_sorted[i].b = (uint8_t*) CAST_INT block_ptr[i];
+    prof_sorted[i].idx = i;
+  }
+  qsort( prof_sorted, block_cnt, sizeof(struct prof_blk), prof_blk_cmp );
+}
+
+/*
+ * prof_get
+ *
+ * Returns the counters of processor p, allocating them the first time.
+ */
+xpvm_prof *prof_get( xpvm_proc *p )
+{
+  xpvm_prof *pr = p->prof;
+
+  if( pr )
+    return pr;
+  pr = calloc( 1, sizeof(xpvm_prof) );
+  if( pr )
+  {
+    pr->blk_count = calloc( prof_nblocks + 1, sizeof(uint64_t) );
+    pr->blk_cycles = calloc( prof_nblocks + 1, sizeof(uint64_t) );
+  }
+  if( !pr || !pr->blk_count || !pr->blk_cycles )
+    EXIT_WITH_ERROR("Error: malloc failed in prof_get\n");
+  pr->last_blk = prof_nblocks;
+  pr->rng = 2463534242u + p->id;
+  pr->interval = pr->countdown = PROF_NEXT_INTERVAL( pr );
+  p->prof = pr;
+  return pr;
+}
+
+/*
+ * prof_find_block
+ *
+ * Returns the index of the loaded block at cib, or block_cnt if it is not
+ * one of them.
+ */
+uint32_t prof_find_block( uint8_t *cib )
+{
+  uint32_t lo = 0, hi = prof_nblocks, mid;
+
+  while( lo < hi )
+  {
+    mid = lo + (hi - lo) / 2;
+    if( prof_sorted[mid].b == cib )
+      return prof_sorted[mid].idx;
+    if( prof_sorted[mid].b < cib )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return prof_nblocks;
+}
+
+/*
+ * prof_block_slow
+ *
+ * Looks up the block at cib and remembers it for the next instruction.
+ */
+uint32_t prof_block_slow( xpvm_prof *pr, uint8_t *cib )
+{
+  pr->last_cib = cib;
+  return pr->last_blk = prof_find_block( cib );
+}
+
+/*
+ * prof_block_name
+ *
+ * Returns the name of block blk from the object file, or one made up
+ * from its index in buf when it has none.
+ */
+const char *prof_block_name( uint32_t blk, char *buf, size_t len )
+{
+  if( blk >= block_cnt )
+    return "?";
+  if( block_names && block_names[blk] && block_names[blk][0] )
+    return block_names[blk];
+  snprintf( buf, len, "block_%u", blk );
+  return buf;
+}
+
+/* Writes s as a JSON string */
+static void prof_json_str( FILE *fp, const char *s )
+{
+  fputc( '"', fp );
+  for( ; *s; s++ )
+  {
+    if( '"' == *s || '\\' == *s )
+      fprintf( fp, "\\%c", *s );
+    else if( (unsigned char) *s < 0x20 )
+      fprintf( fp, "\\u%04x", *s );
+    else
+      fputc( *s, fp );
+  }
+  fputc( '"', fp );
+}
+
+/* Writes s as a CSV field, quoted if it needs to be */
+static void prof_csv_str( FILE *fp, const char *s )
+{
+  if( !strpbrk( s, ",\"\r\n" ) )
+  {
+    fputs( s, fp );
+    return;
+  }
+  fputc( '"', fp );
+  for( ; *s; s++ )
+  {
+    if( '"' == *s )
+      fputc( '"', fp );
+    fputc( *s, fp );
+  }
+  fputc( '"', fp );
+}
+
+/* One line of the output */
+struct prof_row
+{
+  uint32_t  id;
+  uint64_t  count;
+  uint64_t  cycles;
+};
+
+static int prof_row_cmp( const void *x, const void *y )
+{
+  const struct prof_row *a = x, *b = y;
+
+  if( a->cycles != b->cycles )
+    return a->cycles < b->cycles ? 1 : -1;
+  if( a->count != b->count )
+    return a->count < b->count ? 1 : -1;
+  return (a->id > b->id) - (a->id < b->id);
+}
+
+/* Number of opcode pairs written out */
+#define PROF_MAX_PAIRS 50
+
+/*
+ * prof_dump
+ *
+ * Adds up the counters of all processors and writes prefix.json and
+ * prefix.csv. Processors still running when this is called are read as
+ * they are, so their last few counts may be missed.
+ */
+void prof_dump( const char *prefix )
+{
+  struct prof_row ops[256], *blks, *pairs;
+  uint64_t insns = 0, cycles = 0;
+  uint32_t i, j, nops = 0, nblks = 0, npairs = 0;
+  char path[PATH_MAX], buf[32];
+  const char *name;
+  FILE *js, *csv;
+  xpvm_prof *pr;
+
+  blks = calloc( prof_nblocks + 1, sizeof(struct prof_row) );
+  pairs = calloc( 256 * 256, sizeof(struct prof_row) );
+  if( !blks || !pairs )
+    EXIT_WITH_ERROR("Error: malloc failed in prof_dump\n");
+  for( i = 0; i < 256; i++ )
+    ops[i].id = i, ops[i].count = ops[i].cycles = 0;
+  for( i = 0; i <= prof_nblocks; i++ )
+    blks[i].id = i;
+  for( i = 0; i < 256 * 256; i++ )
+    pairs[i].id = i;
+
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !(pr = procs[i].prof) )
+      continue;
+    for( j = 0; j < 256; j++ )
+    {
+      ops[j].count += pr->op_count[j];
+      ops[j].cycles += pr->op_cycles[j];
+    }
+    for( j = 0; j <= prof_nblocks; j++ )
+    {
+      blks[j].count += pr->blk_count[j];
+      blks[j].cycles += pr->blk_cycles[j];
+    }
+    for( j = 0; j < 256 * 256; j++ )
+      pairs[j].count += pr->pair_count[j];
+  }
+
+  /* Drop the empty rows and sort the rest */
+  for( i = 0; i < 256; i++ )
+    if( ops[i].count )
+    {
+      insns += ops[i].count;
+      cycles += ops[i].cycles;
+      ops[nops++] = ops[i];
+    }
+  for( i = 0; i <= prof_nblocks; i++ )
+    if( blks[i].count )
+      blks[nblks++] = blks[i];
+  for( i = 0; i < 256 * 256; i++ )
+    if( pairs[i].count )
+      pairs[npairs++] = pairs[i];
+  qsort( ops, nops, sizeof(struct prof_row), prof_row_cmp );
+  qsort( blks, nblks, sizeof(struct prof_row), prof_row_cmp );
+  qsort( pairs, npairs, sizeof(struct prof_row), prof_row_cmp );
+  if( npairs > PROF_MAX_PAIRS )
+    npairs = PROF_MAX_PAIRS;
+
+  snprintf( path, sizeof(path), "%s.json", prefix );
+  if( !(js = fopen( path, "w" )) )
+  {
+    perror( path );
+    goto out;
+  }
+  snprintf( path, sizeof(path), "%s.csv", prefix );
+  if( !(csv = fopen( path, "w" )) )
+  {
+    perror( path );
+    fclose( js );
+    goto out;
+  }
+
+  fprintf( js, "{\n  \"instructions\": %" PRIu64 ",\n"
+               "  \"cycles\": %" PRIu64 ",\n"
+               "  \"sample_interval\": %d,\n", insns, cycles,
+               XPVM_PROF_SAMPLE );
+  fprintf( csv, "kind,id,name,count,cycles\n" );
+
+  fprintf( js, "  \"opcodes\": [" );
+  for( i = 0; i < nops; i++ )
+  {
+    fprintf( js, "%s\n    {\"opcode\": %u, \"name\": \"%s\", "
+                 "\"count\": %" PRIu64 ", \"cycles\": %" PRIu64 "}",
+             i ? "," : "", ops[i].id, opcode_name( ops[i].id ),
+             ops[i].count, ops[i].cycles );
+    fprintf( csv, "opcode,%u,%s,%" PRIu64 ",%" PRIu64 "\n", ops[i].id,
+             opcode_name( ops[i].id ), ops[i].count, ops[i].cycles );
+  }
+  fprintf( js, "\n  ],\n  \"blocks\": [" );
+  for( i = 0; i < nblks; i++ )
+  {
+    name = prof_block_name( blks[i].id, buf, sizeof(buf) );
+    fprintf( js, "%s\n    {\"block\": %u, \"name\": ", i ? "," : "",
+             blks[i].id );
+    prof_json_str( js, name );
+    fprintf( js, ", \"count\": %" PRIu64 ", \"cycles\": %" PRIu64 "}",
+             blks[i].count, blks[i].cycles );
+    fprintf( csv, "block,%u,", blks[i].id );
+    prof_csv_str( csv, name );
+    fprintf( csv, ",%" PRIu64 ",%" PRIu64 "\n", blks[i].count,
+             blks[i].cycles );
+  }
+  /* Pairs are only counted, so they are sorted by count */
+  fprintf( js, "\n  ],\n  \"pairs\": [" );
+  for( i = 0; i < npairs; i++ )
+  {
+    fprintf( js, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", "
+                 "\"count\": %" PRIu64 "}", i ? "," : "",
+             opcode_name( pairs[i].id >> 8 ),
+             opcode_name( pairs[i].id & 0xff ), pairs[i].count );
+    fprintf( csv, "pair,%u,%s+%s,%" PRIu64 ",\n", pairs[i].id,
+             opcode_name( pairs[i].id >> 8 ),
+             opcode_name( pairs[i].id & 0xff ), pairs[i].count );
+  }
+  fprintf( js, "\n  ]\n}\n" );
+  fclose( js );
+  fclose( csv );
+out:
+  free( blks );
+  free( pairs );
+}
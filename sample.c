@@ -0,0 +1,265 @@
+/*
+ * sample.c
+ *
+ * Sampling profiler for the XPVM, turned on with -s. Every thread running
+ * a processor gets a timer on its own CPU time which sends it SIGPROF
+ * XPVM_SAMPLE_HZ times a second. The signal handler only marks the
+ * processor and asks it to stop at a safepoint, where a safepoint hook
+ * walks the stack_frame chain and records the guest call stack, so the
+ * interpreter is never looked at half way through an instruction. Stacks
+ * are kept per processor, merged as the buffer fills, and written out at
+ * exit in the collapsed format flamegraph.pl and similar tools read.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "xpvm.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* Samples a processor buffers before merging the same stacks */
+#define SAMPLE_BUF_MIN 1024
+
+static const char *sample_path = NULL;
+static int sample_offsets = 0;
+
+/*
+ * sample_signal
+ *
+ * SIGPROF handler. Runs on the thread whose timer fired.
+ */
+static void sample_signal( int sig )
+{
+  xpvm_proc *p = cur_proc;
+
+  if( !p )
+    return;
+  p->sample_pending = 1;
+  safepoint_request( p );
+}
+
+static int sample_cmp( const void *x, const void *y )
+{
+  const xpvm_sample *a = x, *b = y;
+  int r;
+
+  if( a->depth != b->depth )
+    return a->depth < b->depth ? -1 : 1;
+  if( (r = memcmp( a->blk, b->blk, a->depth * sizeof(uint32_t) )) )
+    return r;
+  return memcmp( a->off, b->off, a->depth * sizeof(uint32_t) );
+}
+
+/*
+ * sample_merge
+ *
+ * Sorts n samples and folds the ones with the same stack together.
+ * Returns how many are left.
+ */
+static uint32_t sample_merge( xpvm_sample *s, uint32_t n )
+{
+  uint32_t i, j = 0;
+
+  if( !n )
+    return 0;
+  qsort( s, n, sizeof(xpvm_sample), sample_cmp );
+  for( i = 1; i < n; i++ )
+  {
+    if( !sample_cmp( &s[j], &s[i] ) )
+      s[j].count += s[i].count;
+    else
+      s[++j] = s[i];
+  }
+  return j + 1;
+}
+
+/*
+ * sample_hook
+ *
+ * Safepoint hook recording the call stack of a processor with a sample
+ * pending. Called on the processor's own thread.
+ */
+static void sample_hook( xpvm_proc *p, unsigned int pid, uint64_t *reg,
+                         stack_frame *stack )
+{
+  xpvm_samples *ss = p->samples;
+  xpvm_sample *s, *grown;
+  stack_frame *f;
+  uint32_t d = 0;
+
+  if( !p->sample_pending )
+    return;
+  p->sample_pending = 0;
+
+  if( !ss )
+  {
+    if( !(ss = calloc( 1, sizeof(xpvm_samples) )) )
+      EXIT_WITH_ERROR("Error: malloc failed in sample_hook\n");
+    pthread_mutex_init( &ss->mu, NULL );
+    __atomic_store_n( &p->samples, ss, __ATOMIC_RELEASE );
+  }
+  pthread_mutex_lock( &ss->mu );
+  if( ss->n == ss->cap )
+  {
+    ss->n = sample_merge( ss->s, ss->n );
+    if( ss->n >= ss->cap / 2 )
+    {
+      ss->cap = ss->cap ? ss->cap * 2 : SAMPLE_BUF_MIN;
+      if( !(grown = realloc( ss->s, ss->cap * sizeof(xpvm_sample) )) )
+        EXIT_WITH_ERROR("Error: malloc failed in sample_hook\n");
+      ss->s = grown;
+    }
+  }
+  s = &ss->s[ss->n++];
+
+  /* The running block, then the caller saved in each frame but the last */
+  s->count = 1;
+  s->blk[d] = prof_find_block( (uint8_t*) CAST_INT CIB );
+  s->off[d++] = sample_offsets ? CIO : 0;
+  for( f = stack; f && f->prev && d < XPVM_SAMPLE_DEPTH; f = f->prev )
+  {
+    s->blk[d] = prof_find_block( (uint8_t*) CAST_INT f->cib );
+    s->off[d++] = sample_offsets ? f->cio : 0;
+  }
+  s->depth = d;
+  pthread_mutex_unlock( &ss->mu );
+}
+
+/*
+ * sample_init
+ *
+ * Turns on the sampling profiler, to write its stacks to path at exit.
+ * With offsets each frame is named after the block and the offset in it
+ * rather than just the block. Called by main before any processor
+ * starts. Returns 0, or -1 if the signal or the hook cannot be set up.
+ */
+int sample_init( const char *path, int offsets )
+{
+  struct sigaction sa;
+
+  memset( &sa, 0, sizeof(sa) );
+  sa.sa_handler = sample_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset( &sa.sa_mask );
+  if( sigaction( SIGPROF, &sa, NULL ) || safepoint_add_hook( sample_hook ) )
+    return -1;
+  sample_path = path;
+  sample_offsets = offsets;
+  return 0;
+}
+
+/*
+ * sample_thread_start
+ *
+ * Starts the sampling timer of the calling thread, which runs processor
+ * p. Does nothing unless the profiler is on.
+ */
+void sample_thread_start( xpvm_proc *p )
+{
+  struct sigevent ev;
+  struct itimerspec its;
+
+  p->sample_pending = 0;
+  if( !sample_path )
+    return;
+  memset( &ev, 0, sizeof(ev) );
+  ev.sigev_notify = SIGEV_THREAD_ID;
+  ev.sigev_signo = SIGPROF;
+  ev.sigev_notify_thread_id = syscall( SYS_gettid );
+  if( timer_create( CLOCK_THREAD_CPUTIME_ID, &ev, &p->sample_timer ) )
+  {
+    perror( "timer_create" );
+    return;
+  }
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = 1000000000 / XPVM_SAMPLE_HZ;
+  its.it_value = its.it_interval;
+  timer_settime( p->sample_timer, 0, &its, NULL );
+}
+
+/*
+ * sample_thread_stop
+ *
+ * Deletes the timer of the calling thread before it gives up p.
+ */
+void sample_thread_stop( xpvm_proc *p )
+{
+  if( sample_path )
+    timer_delete( p->sample_timer );
+}
+
+/* Writes a frame name with the separators of the format taken out */
+static void sample_frame( FILE *fp, uint32_t blk, uint32_t off )
+{
+  char buf[32];
+  const char *s = prof_block_name( blk, buf, sizeof(buf) );
+
+  for( ; *s; s++ )
+    fputc( ';' == *s || ' ' == *s || '\n' == *s ? '_' : *s, fp );
+  if( sample_offsets )
+    fprintf( fp, "+0x%x", off );
+}
+
+/*
+ * sample_dump
+ *
+ * Adds up the stacks of all processors and writes them to the path given
+ * to sample_init, one line per stack from the outermost frame in, ending
+ * with the number of samples.
+ */
+void sample_dump( void )
+{
+  xpvm_sample *all = NULL, *grown;
+  xpvm_samples *ss;
+  uint32_t i, n = 0, total = 0;
+  int d;
+  FILE *fp;
+
+  if( !sample_path )
+    return;
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !(ss = __atomic_load_n( &procs[i].samples, __ATOMIC_ACQUIRE )) )
+      continue;
+    pthread_mutex_lock( &ss->mu );
+    if( ss->n )
+    {
+      if( !(grown = realloc( all, (n + ss->n) * sizeof(xpvm_sample) )) )
+        EXIT_WITH_ERROR("Error: malloc failed in sample_dump\n");
+      all = grown;
+      memcpy( all + n, ss->s, ss->n * sizeof(xpvm_sample) );
+      n += ss->n;
+    }
+    pthread_mutex_unlock( &ss->mu );
+  }
+  n = sample_merge( all, n );
+
+  if( !(fp = fopen( sample_path, "w" )) )
+  {
+    perror( sample_path );
+    free( all );
+    return;
+  }
+  for( i = 0; i < n; i++ )
+  {
+    for( d = all[i].depth - 1; d >= 0; d-- )
+    {
+      sample_frame( fp, all[i].blk[d], all[i].off[d] );
+      fputc( d ? ';' : ' ', fp );
+    }
+    fprintf( fp, "%u\n", all[i].count );
+    total += all[i].count;
+  }
+  fclose( fp );
+  fprintf( stderr, "xpvm: %u samples in %u stacks written to %s\n",
+           total, n, sample_path );
+  free( all );
+}
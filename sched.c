@@ -0,0 +1,513 @@
+/*
+ * sched.c
+ *
+ * Tasks for the XPVM. Tasks are lightweight processors multiplexed onto
+ * a small pool of carrier processors, one per online CPU up to
+ * XPVM_MAX_CARRIERS. All the state of a running program is in its
+ * register bank and frame stack, so a task is switched out simply by
+ * returning from interp_run between two instructions and resumed by
+ * calling it again with the same registers.
+ *
+ * Author: Jeffrey Picard
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xpvm.h"
+
+__thread xpvm_task *cur_task = NULL;
+
+/*
+ * Task slots. Slots are allocated once and recycled through the free
+ * list, so spawning a task does not normally go to malloc.
+ */
+static xpvm_task *task_table[XPVM_MAX_TASKS];
+static xpvm_task *task_free_list = NULL;
+static uint32_t task_next_idx = 0;
+static pthread_mutex_t task_mu = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Run queue shared by all carriers. Carriers with nothing to do sleep
+ * on the condition variable, which is only signalled when one is idle.
+ * Tasks that blocked without parking wait on the blocked queue, which is
+ * put behind the run queue once a pass over the tasks in it is done, so
+ * they retry after everything that was runnable.
+ */
+static xpvm_task *rq_head = NULL;
+static xpvm_task *rq_tail = NULL;
+static xpvm_task *bq_head = NULL;
+static xpvm_task *bq_tail = NULL;
+static uint32_t rq_len = 0;
+static uint32_t rq_pass = 0;
+static uint32_t bq_len = 0;
+static uint32_t rq_idle = 0;
+static pthread_mutex_t rq_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rq_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t carriers_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Parking. A task that can not take a monitor, has not been signalled or
+ * is joining a task that has not finished parks under a key, the monitor
+ * block, the block plus one or the id of the task, and is only run again
+ * once the key is unparked. Keys hash to buckets. A task counts itself in
+ * the bucket's waiters before it checks whatever it is waiting for, and
+ * the waker checks the count after changing it, the same handshake as the
+ * futex waiters counts in sync.c. Every unpark bumps the bucket sequence
+ * number, so a task that was unparked before it got into the bucket goes
+ * straight back on the run queue.
+ */
+#define PARK_BUCKETS      256
+#define PARK_HASH( key )  (((key) * 0x9e3779b97f4a7c15ull) >> 56)
+
+struct _park_bucket
+{
+  pthread_mutex_t mu;
+  uint32_t      waiters;
+  uint32_t      seq;
+  xpvm_task     *head;
+} typedef park_bucket;
+
+static park_bucket park_table[PARK_BUCKETS] = {
+  [0 ... PARK_BUCKETS - 1] = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL }
+};
+
+static xpvm_task *task_alloc( void )
+{
+  xpvm_task *t;
+
+  pthread_mutex_lock( &task_mu );
+  if( (t = task_free_list) )
+    task_free_list = t->next;
+  else if( task_next_idx < XPVM_MAX_TASKS )
+  {
+    t = malloc( sizeof(xpvm_task) );
+    if( !t )
+      EXIT_WITH_ERROR("Error: malloc failed in task_alloc\n");
+    t->id = TASK_ID( task_next_idx );
+    task_table[task_next_idx++] = t;
+  }
+  pthread_mutex_unlock( &task_mu );
+  if( !t )
+    EXIT_WITH_ERROR("Error: more than %d tasks in task_alloc\n",
+                    XPVM_MAX_TASKS );
+  return t;
+}
+
+static void task_free( xpvm_task *t )
+{
+  pthread_mutex_lock( &task_mu );
+  t->state = PROC_FREE;
+  t->next = task_free_list;
+  task_free_list = t;
+  pthread_mutex_unlock( &task_mu );
+}
+
+static xpvm_task *task_lookup( uint64_t id )
+{
+  xpvm_task *t;
+
+  if( !IS_TASK_ID( id ) || TASK_IDX( id ) >= XPVM_MAX_TASKS )
+    return NULL;
+  t = task_table[TASK_IDX( id )];
+  if( !t || PROC_FREE == __atomic_load_n( &t->state, __ATOMIC_ACQUIRE ) ||
+      t->detached )
+    return NULL;
+  return t;
+}
+
+static void rq_push( xpvm_task *t )
+{
+  t->next = NULL;
+  pthread_mutex_lock( &rq_mu );
+  if( rq_tail )
+    rq_tail->next = t;
+  else
+    rq_head = t;
+  rq_tail = t;
+  rq_len++;
+  if( rq_idle )
+    pthread_cond_signal( &rq_cond );
+  pthread_mutex_unlock( &rq_mu );
+}
+
+static void bq_push( xpvm_task *t )
+{
+  t->next = NULL;
+  pthread_mutex_lock( &rq_mu );
+  if( bq_tail )
+    bq_tail->next = t;
+  else
+    bq_head = t;
+  bq_tail = t;
+  bq_len++;
+  if( rq_idle )
+    pthread_cond_signal( &rq_cond );
+  pthread_mutex_unlock( &rq_mu );
+}
+
+static xpvm_task *rq_pop( void )
+{
+  xpvm_task *t;
+
+  pthread_mutex_lock( &rq_mu );
+  while( 1 )
+  {
+    if( bq_head && (!rq_pass || !rq_head) )
+    {
+      if( rq_tail )
+        rq_tail->next = bq_head;
+      else
+        rq_head = bq_head;
+      rq_tail = bq_tail;
+      rq_len += bq_len;
+      bq_head = bq_tail = NULL;
+      bq_len = 0;
+      rq_pass = rq_len;
+    }
+    if( rq_head )
+      break;
+    rq_idle++;
+    pthread_cond_wait( &rq_cond, &rq_mu );
+    rq_idle--;
+  }
+  t = rq_head;
+  if( !(rq_head = t->next) )
+    rq_tail = NULL;
+  rq_len--;
+  if( rq_pass )
+    rq_pass--;
+  pthread_mutex_unlock( &rq_mu );
+  return t;
+}
+
+/*
+ * task_park_prepare
+ *
+ * Counts task t as waiting on key. Called before checking whatever it is
+ * waiting for; if it then has to block it parks when it yields, otherwise
+ * task_park_cancel undoes this.
+ */
+void task_park_prepare( xpvm_task *t, uint64_t key )
+{
+  park_bucket *pb = &park_table[PARK_HASH( key )];
+
+  __atomic_add_fetch( &pb->waiters, 1, __ATOMIC_SEQ_CST );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  t->park_seq = __atomic_load_n( &pb->seq, __ATOMIC_RELAXED );
+  t->park_key = key;
+}
+
+void task_park_cancel( xpvm_task *t )
+{
+  if( !t->park_key )
+    return;
+  __atomic_sub_fetch( &park_table[PARK_HASH( t->park_key )].waiters, 1,
+                      __ATOMIC_RELAXED );
+  t->park_key = 0;
+}
+
+/*
+ * task_park
+ *
+ * Puts t, which blocked after task_park_prepare, at the end of its bucket,
+ * or back on the run queue if its key has been unparked since.
+ */
+static void task_park( xpvm_task *t )
+{
+  park_bucket *pb = &park_table[PARK_HASH( t->park_key )];
+  xpvm_task **pp;
+
+  t->blocked = 0;
+  pthread_mutex_lock( &pb->mu );
+  if( pb->seq != t->park_seq )
+  {
+    pthread_mutex_unlock( &pb->mu );
+    task_park_cancel( t );
+    rq_push( t );
+    return;
+  }
+  t->next = NULL;
+  for( pp = &pb->head; *pp; pp = &(*pp)->next )
+    ;
+  *pp = t;
+  pthread_mutex_unlock( &pb->mu );
+}
+
+/*
+ * task_unpark
+ *
+ * Puts the first task parked on key, or all of them, back on the run
+ * queue. Called after changing whatever they wait for.
+ */
+void task_unpark( uint64_t key, int all )
+{
+  park_bucket *pb = &park_table[PARK_HASH( key )];
+  xpvm_task **pp, *t, *wake = NULL;
+
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if( !__atomic_load_n( &pb->waiters, __ATOMIC_RELAXED ) )
+    return;
+  pthread_mutex_lock( &pb->mu );
+  __atomic_store_n( &pb->seq, pb->seq + 1, __ATOMIC_RELAXED );
+  for( pp = &pb->head; (t = *pp); )
+  {
+    if( t->park_key != key )
+    {
+      pp = &t->next;
+      continue;
+    }
+    *pp = t->next;
+    t->next = wake;
+    wake = t;
+    if( !all )
+      break;
+  }
+  pthread_mutex_unlock( &pb->mu );
+  while( (t = wake) )
+  {
+    wake = t->next;
+    task_park_cancel( t );
+    rq_push( t );
+  }
+}
+
+/*
+ * task_requeue
+ *
+ * Puts a task that yielded back where it belongs: in its bucket if it is
+ * parking, on the blocked queue if it blocked without parking and
+ * otherwise on the run queue.
+ */
+static void task_requeue( xpvm_task *t )
+{
+  if( t->park_key )
+    task_park( t );
+  else if( t->blocked )
+  {
+    t->blocked = 0;
+    bq_push( t );
+  }
+  else
+    rq_push( t );
+}
+
+/*
+ * task_exit
+ *
+ * Records the result of a finished task. Detached tasks go straight back
+ * on the free list, the rest wait for a join.
+ */
+static void task_exit( xpvm_task *t, int status )
+{
+  t->result.status = status;
+  if( t->detached )
+  {
+    task_free( t );
+    return;
+  }
+  __atomic_store_n( &t->state, PROC_DONE, __ATOMIC_SEQ_CST );
+  if( __atomic_load_n( &t->join_waiters, __ATOMIC_SEQ_CST ) )
+    futex_wake( &t->state, INT_MAX );
+  task_unpark( t->id, 1 );
+}
+
+/*
+ * carrier_loop
+ *
+ * Thread start routine of a carrier. Runs one slice of the task at the
+ * head of the run queue at a time, putting it back at the tail if it is
+ * not finished.
+ */
+static void *carrier_loop( void *v )
+{
+  xpvm_proc *p = (xpvm_proc*)v;
+  xpvm_task *t;
+  stack_frame *f;
+  int status;
+
+  cur_proc = p;
+  affinity_apply( p );
+  sample_thread_start( p );
+  TIMELINE( p, TIMELINE_RUN_BEGIN, 0 );
+  while( 1 )
+  {
+    t = rq_pop();
+    cur_task = t;
+    if( !t->stack )
+      t->stack = interp_enter( p, t->reg, t->work );
+    status = interp_run( p, t->id, t->reg, &t->stack, XPVM_TASK_SLICE,
+                         &t->result.ret_val );
+    cur_task = NULL;
+    if( XPVM_YIELD == status )
+    {
+      task_requeue( t );
+      continue;
+    }
+    /* Frames left behind go back to this carrier */
+    while( (f = t->stack) )
+    {
+      t->stack = f->prev;
+      frame_free( p, f );
+    }
+    task_exit( t, status );
+  }
+  return NULL;
+}
+
+/*
+ * start_carriers
+ *
+ * Starts one carrier per online CPU the first time a task is spawned, at
+ * most XPVM_MAX_CARRIERS and fewer if there are not enough free processor
+ * ids.
+ */
+static void start_carriers( void )
+{
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+  xpvm_proc *p;
+  long i;
+
+  if( n < 1 )
+    n = 1;
+  if( n > XPVM_MAX_CARRIERS )
+    n = XPVM_MAX_CARRIERS;
+  for( i = 0; i < n; i++ )
+  {
+    if( !(p = proc_try_alloc()) )
+      break;
+    if (pthread_create(&p->thread, NULL, carrier_loop, (void *) p) != 0)
+    {
+      perror("error in thread create");
+      exit(-1);
+    }
+  }
+  if( !i )
+    EXIT_WITH_ERROR("Error: no free processor to carry tasks\n");
+}
+
+/*
+ * task_spawn
+ *
+ * Creates a task running function block work with up to 10 arguments
+ * from args[1] on and returns its id. A detached task can not be joined
+ * and its slot is reused as soon as it finishes.
+ */
+uint64_t task_spawn( uint64_t work, int argc, uint64_t *args, int detached )
+{
+  xpvm_task *t;
+  int i;
+
+  pthread_once( &carriers_once, start_carriers );
+
+  t = task_alloc();
+  t->state = PROC_RUNNING;
+  t->detached = detached;
+  t->join_waiters = 0;
+  t->wait_blk = NULL;
+  t->wait_bar = NULL;
+  t->blocked = 0;
+  t->park_key = 0;
+  t->reg[0] = 0;
+  for( i = 1; i <= argc && i < 11; i++ )
+    t->reg[i] = args[i];
+  t->work = (uint8_t*) CAST_INT work;
+  t->stack = NULL;
+  rq_push( t );
+  return t->id;
+}
+
+/*
+ * task_join
+ *
+ * Joins a task, putting its return value in *ret_val and returning 1. If
+ * the task has not finished and block is 0 returns 0 instead, otherwise
+ * sleeps until it does. A task joined twice is an error.
+ */
+int task_join( uint64_t id, uint64_t *ret_val, int block )
+{
+  xpvm_task *t = task_lookup( id );
+
+  uint32_t s = PROC_DONE;
+
+  if( !t )
+    EXIT_WITH_ERROR("Error: join of unknown task %" PRIu64 "\n", id );
+  if( PROC_RUNNING == __atomic_load_n( &t->state, __ATOMIC_ACQUIRE ) )
+  {
+    if( !block )
+      return 0;
+    __atomic_add_fetch( &t->join_waiters, 1, __ATOMIC_SEQ_CST );
+    while( PROC_RUNNING == __atomic_load_n( &t->state, __ATOMIC_SEQ_CST ) )
+      futex_wait( &t->state, PROC_RUNNING );
+    __atomic_sub_fetch( &t->join_waiters, 1, __ATOMIC_RELAXED );
+  }
+  /* Only one of several joiners may free the task, the others lost it */
+  if( !__atomic_compare_exchange_n( &t->state, &s, TASK_REAPED, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+    EXIT_WITH_ERROR("Error: join of unknown task %" PRIu64 "\n", id );
+  *ret_val = t->result.ret_val;
+  task_free( t );
+  return 1;
+}
+
+static int task_try_lock( uint8_t *b, uint32_t pid )
+{
+  uint32_t c = 0;
+
+  if( !__atomic_compare_exchange_n( &BLOCK_MON_LOCK( b ), &c, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+    return 0;
+  __atomic_store_n( &BLOCK_MON_HOLDER( b ), OWNER_TAG( pid ),
+                    __ATOMIC_RELAXED );
+  return 1;
+}
+
+/*
+ * task_lock
+ *
+ * The lock opcode for a task. Takes the monitor if it is free and
+ * returns 1, otherwise returns 0 with the task parking on the monitor
+ * rather than putting its carrier to sleep, to be unparked by the next
+ * unlock.
+ */
+int task_lock( uint8_t *b, uint32_t pid )
+{
+  if( task_try_lock( b, pid ) )
+    return 1;
+  task_park_prepare( cur_task, (uint64_t) CAST_INT b );
+  if( !task_try_lock( b, pid ) )
+    return 0;
+  task_park_cancel( cur_task );
+  return 1;
+}
+
+/*
+ * task_wait
+ *
+ * The wait opcode for a task. The first time through it releases the
+ * monitor and notes its sequence number. Until the monitor has been
+ * signalled the task parks on the block plus one, which sig and sigall
+ * unpark, and then on the monitor itself until it can be relocked. Only
+ * then does it return 1.
+ */
+int task_wait( xpvm_task *t, uint8_t *b, uint32_t pid )
+{
+  if( t->wait_blk != b )
+  {
+    t->wait_seq = __atomic_load_n( &BLOCK_MON_SEQ( b ), __ATOMIC_RELAXED );
+    t->wait_blk = b;
+    monitor_unlock( b );
+  }
+  task_park_prepare( t, (uint64_t) CAST_INT b + 1 );
+  if( __atomic_load_n( &BLOCK_MON_SEQ( b ), __ATOMIC_ACQUIRE ) == t->wait_seq )
+    return 0;
+  task_park_cancel( t );
+  if( !task_lock( b, pid ) )
+    return 0;
+  t->wait_blk = NULL;
+  return 1;
+}
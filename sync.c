@@ -0,0 +1,551 @@
+/*
+ * sync.c
+ *
+ * Futex based synchronization for the XPVM. Implements the monitors
+ * used by the lock, unlock, wait, sig and sigall opcodes. The state of
+ * a monitor lives in the header of the block it protects.
+ *
+ * Author: Jeffrey Picard
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "xpvm.h"
+
+/*
+ * futex_wait
+ *
+ * Sleeps as long as *addr still holds val. May return spuriously.
+ */
+int futex_wait( uint32_t *addr, uint32_t val )
+{
+  return syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
+
+/*
+ * futex_wake
+ *
+ * Wakes up to n processors sleeping on addr.
+ */
+int futex_wake( uint32_t *addr, int n )
+{
+  return syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+}
+
+/*
+ * cpu_relax
+ *
+ * Spin loop hint. On x86 pause keeps a spinning processor from flooding
+ * the pipeline and its sibling hyperthread, elsewhere it is a no-op.
+ */
+static inline void cpu_relax( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__( "" ::: "memory" );
+#endif
+}
+
+/*
+ * monitor_lock
+ *
+ * The lock word is 0 when the monitor is free, 1 when it is held and
+ * 2 when it is held and there may be processors sleeping on it. The
+ * uncontended case is a single cmpxchg, contended processors park on
+ * the lock word until unlock hands it over.
+ */
+void monitor_lock( uint8_t *b, uint32_t pid )
+{
+  uint32_t *lock = &BLOCK_MON_LOCK( b );
+  uint32_t c = 0;
+
+  if( !__atomic_compare_exchange_n( lock, &c, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+  {
+    if( c != 2 )
+      c = __atomic_exchange_n( lock, 2, __ATOMIC_ACQUIRE );
+    while( c != 0 )
+    {
+      futex_wait( lock, 2 );
+      c = __atomic_exchange_n( lock, 2, __ATOMIC_ACQUIRE );
+    }
+  }
+  __atomic_store_n( &BLOCK_MON_HOLDER( b ), OWNER_TAG( pid ),
+                    __ATOMIC_RELAXED );
+}
+
+/*
+ * monitor_unlock
+ *
+ * Releases the monitor, only entering the kernel if someone is waiting.
+ */
+void monitor_unlock( uint8_t *b )
+{
+  uint32_t *lock = &BLOCK_MON_LOCK( b );
+
+  __atomic_store_n( &BLOCK_MON_HOLDER( b ), 0, __ATOMIC_RELAXED );
+  if( 2 == __atomic_exchange_n( lock, 0, __ATOMIC_RELEASE ) )
+    futex_wake( lock, 1 );
+  task_unpark( (uint64_t) CAST_INT b, 0 );
+}
+
+/*
+ * monitor_wait
+ *
+ * Atomically releases the monitor and sleeps until it is signalled, then
+ * reacquires it before returning. As with any condition variable the
+ * wakeup may be spurious, so the guest must recheck its condition.
+ */
+void monitor_wait( uint8_t *b, uint32_t pid )
+{
+  uint32_t *lock = &BLOCK_MON_LOCK( b );
+  uint32_t *seq  = &BLOCK_MON_SEQ( b );
+  uint32_t s     = __atomic_load_n( seq, __ATOMIC_RELAXED );
+
+  monitor_unlock( b );
+  futex_wait( seq, s );
+
+  /* Always relock in the contended state. sigall may have requeued other
+   * waiters onto the lock word and they have to be woken on unlock. */
+  while( 0 != __atomic_exchange_n( lock, 2, __ATOMIC_ACQUIRE ) )
+    futex_wait( lock, 2 );
+  __atomic_store_n( &BLOCK_MON_HOLDER( b ), OWNER_TAG( pid ),
+                    __ATOMIC_RELAXED );
+}
+
+/*
+ * monitor_signal
+ *
+ * Wakes one processor waiting on the monitor.
+ */
+void monitor_signal( uint8_t *b )
+{
+  uint32_t *seq = &BLOCK_MON_SEQ( b );
+
+  __atomic_add_fetch( seq, 1, __ATOMIC_RELEASE );
+  futex_wake( seq, 1 );
+  task_unpark( (uint64_t) CAST_INT b + 1, 1 );
+}
+
+/*
+ * monitor_broadcast
+ *
+ * Wakes every processor waiting on the monitor. Only one of them is
+ * actually woken, the rest are requeued onto the lock word since they
+ * could not run before the caller unlocks anyway.
+ */
+void monitor_broadcast( uint8_t *b )
+{
+  uint32_t *lock = &BLOCK_MON_LOCK( b );
+  uint32_t *seq  = &BLOCK_MON_SEQ( b );
+  uint32_t s     = __atomic_add_fetch( seq, 1, __ATOMIC_RELEASE );
+
+  /* The caller holds the monitor, mark it contended so unlock wakes the
+   * requeued processors. */
+  __atomic_store_n( lock, 2, __ATOMIC_RELAXED );
+  if( 0 > syscall( SYS_futex, seq, FUTEX_CMP_REQUEUE_PRIVATE, 1,
+                   (void *) INT_MAX, lock, s ) )
+    futex_wake( seq, INT_MAX );
+  task_unpark( (uint64_t) CAST_INT b + 1, 1 );
+}
+
+/*
+ * Processors blocked in aquire_blkw park in a small hashed table rather
+ * than on the block itself, so the owner word can stay 64 bits and the
+ * block header does not grow. Each bucket has a sequence number to
+ * sleep on, a count of parked processors so release_blk only enters
+ * the kernel when needed, and an adaptive spin limit.
+ */
+#define PARK_BUCKETS    256
+#define PARK_SPIN_MAX   1000
+
+struct park_bucket
+{
+  uint32_t seq;
+  uint32_t waiters;
+  uint32_t spin;
+} __attribute__((aligned(64))) typedef park_bucket;
+
+static park_bucket park_table[PARK_BUCKETS];
+
+static park_bucket *park_lookup( uint8_t *b )
+{
+  uint64_t a = (uint64_t) CAST_INT b;
+  return &park_table[((a >> 3) ^ (a >> 11)) % PARK_BUCKETS];
+}
+
+/*
+ * block_aquire_wait
+ *
+ * Slow path of aquire_blkw, called once the first cmpxchg has failed.
+ * Spins on the owner word with pause for up to the bucket's current
+ * spin limit, then parks until the block is released. The spin limit
+ * moves towards the number of spins that were actually needed.
+ */
+void block_aquire_wait( uint8_t *b, uint32_t pid )
+{
+  park_bucket *pb = park_lookup( b );
+  uint64_t *owner = &BLOCK_OWNER( b );
+  uint32_t limit = __atomic_load_n( &pb->spin, __ATOMIC_RELAXED ) * 2 + 10;
+  uint32_t i;
+  uint32_t s;
+
+  if( limit > PARK_SPIN_MAX )
+    limit = PARK_SPIN_MAX;
+  for( i = 0; i < limit; i++ )
+  {
+    cpu_relax();
+    if( !__atomic_load_n( owner, __ATOMIC_RELAXED ) &&
+        CMPXCHG( owner, 0, OWNER_TAG( pid ) ) )
+    {
+      __atomic_store_n( &pb->spin, pb->spin + ((int)i - (int)pb->spin) / 8,
+                        __ATOMIC_RELAXED );
+      return;
+    }
+  }
+  __atomic_store_n( &pb->spin, pb->spin + ((int)limit - (int)pb->spin) / 8,
+                    __ATOMIC_RELAXED );
+
+  /* Registering as a waiter before the last cmpxchg pairs with the store
+   * and waiter check in block_release_wake, so a release can not slip
+   * between the two unnoticed. That needs both sides to be sequentially
+   * consistent rather than just acquire/release. */
+  __atomic_add_fetch( &pb->waiters, 1, __ATOMIC_SEQ_CST );
+  while( 1 )
+  {
+    uint64_t nil = 0;
+    s = __atomic_load_n( &pb->seq, __ATOMIC_SEQ_CST );
+    if( __atomic_compare_exchange_n( owner, &nil, OWNER_TAG( pid ), 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) )
+      break;
+    futex_wait( &pb->seq, s );
+  }
+  __atomic_sub_fetch( &pb->waiters, 1, __ATOMIC_RELAXED );
+}
+
+/*
+ * block_release_wake
+ *
+ * Clears the owner of a block and wakes anyone parked on it. Clearing
+ * the owner is the release that publishes the owner's writes to the
+ * next processor to acquire the block. It is made sequentially
+ * consistent so it is also ordered before the check for parked
+ * processors, on x86 this is the same single xchg either way.
+ */
+void block_release_wake( uint8_t *b )
+{
+  park_bucket *pb = park_lookup( b );
+
+  __atomic_store_n( &BLOCK_OWNER( b ), 0, __ATOMIC_SEQ_CST );
+  if( __atomic_load_n( &pb->waiters, __ATOMIC_SEQ_CST ) )
+  {
+    __atomic_add_fetch( &pb->seq, 1, __ATOMIC_SEQ_CST );
+    futex_wake( &pb->seq, INT_MAX );
+  }
+}
+
+/*
+ * Channels. Each one is a bounded multi producer, multi consumer ring in
+ * which every cell carries a sequence number saying whether it is ready
+ * to be sent to or received from on the current lap, so senders and
+ * receivers only contend on the head or tail counter with a cmpxchg and
+ * never take a lock. A processor that finds the channel full or empty
+ * spins briefly and then sleeps on a futex sequence which the other
+ * side bumps only when someone is registered as waiting.
+ */
+#define CHAN_SPIN 100
+
+static xpvm_chan chans[XPVM_MAX_CHANNELS];
+static uint32_t num_chans = 0;
+
+/*
+ * chan_create
+ *
+ * Makes a channel holding up to cap values, rounded up to a power of 2,
+ * and returns its handle or -1 if the table is full.
+ */
+int64_t chan_create( uint64_t cap )
+{
+  uint32_t h = __atomic_fetch_add( &num_chans, 1, __ATOMIC_RELAXED );
+  xpvm_chan *c;
+  chan_cell *buf;
+  uint64_t size = 2;
+  uint64_t i;
+
+  if( h >= XPVM_MAX_CHANNELS )
+    return -1;
+  if( !cap )
+    cap = XPVM_CHAN_DEFAULT_CAP;
+  if( cap > XPVM_CHAN_MAX_CAP )
+    cap = XPVM_CHAN_MAX_CAP;
+  while( size < cap )
+    size <<= 1;
+
+  c = &chans[h];
+  buf = calloc( size, sizeof(chan_cell) );
+  if( !buf )
+    EXIT_WITH_ERROR("Error: malloc failed in chan_create\n");
+  for( i = 0; i < size; i++ )
+    buf[i].seq = i;
+  c->mask = size - 1;
+
+  /* Publish the channel to processors which are handed the handle */
+  __atomic_store_n( &c->buf, buf, __ATOMIC_RELEASE );
+  return h;
+}
+
+xpvm_chan *chan_lookup( uint64_t handle )
+{
+  if( handle >= XPVM_MAX_CHANNELS || 
+      !__atomic_load_n( &chans[handle].buf, __ATOMIC_ACQUIRE ) )
+    return NULL;
+  return &chans[handle];
+}
+
+static int chan_try_send( xpvm_chan *c, uint64_t val, uint64_t is_blk )
+{
+  uint64_t pos = __atomic_load_n( &c->head, __ATOMIC_RELAXED );
+  chan_cell *cell;
+  int64_t diff;
+
+  while( 1 )
+  {
+    cell = &c->buf[pos & c->mask];
+    diff = (int64_t) __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) -
+           (int64_t) pos;
+    if( !diff )
+    {
+      if( __atomic_compare_exchange_n( &c->head, &pos, pos + 1, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    }
+    else if( diff < 0 )
+      return 0;
+    else
+      pos = __atomic_load_n( &c->head, __ATOMIC_RELAXED );
+  }
+  cell->val = val;
+  cell->is_blk = is_blk;
+  __atomic_store_n( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+  return 1;
+}
+
+int chan_try_recv( xpvm_chan *c, uint64_t *val, uint64_t *is_blk )
+{
+  uint64_t pos = __atomic_load_n( &c->tail, __ATOMIC_RELAXED );
+  chan_cell *cell;
+  int64_t diff;
+
+  while( 1 )
+  {
+    cell = &c->buf[pos & c->mask];
+    diff = (int64_t) __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) -
+           (int64_t) (pos + 1);
+    if( !diff )
+    {
+      if( __atomic_compare_exchange_n( &c->tail, &pos, pos + 1, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    }
+    else if( diff < 0 )
+      return 0;
+    else
+      pos = __atomic_load_n( &c->tail, __ATOMIC_RELAXED );
+  }
+  *val = cell->val;
+  *is_blk = cell->is_blk;
+  __atomic_store_n( &cell->seq, pos + c->mask + 1, __ATOMIC_RELEASE );
+
+  /* Same handshake as block_release_wake, the fence orders the freed
+   * cell before the check for blocked senders. */
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if( __atomic_load_n( &c->send_waiters, __ATOMIC_RELAXED ) )
+  {
+    __atomic_add_fetch( &c->received, 1, __ATOMIC_RELAXED );
+    futex_wake( &c->received, 1 );
+  }
+  return 1;
+}
+
+/* Wakes a receiver blocked on c after a send */
+static void chan_sent_wake( xpvm_chan *c )
+{
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if( __atomic_load_n( &c->recv_waiters, __ATOMIC_RELAXED ) )
+  {
+    __atomic_add_fetch( &c->sent, 1, __ATOMIC_RELAXED );
+    futex_wake( &c->sent, 1 );
+  }
+}
+
+/*
+ * chan_task_send
+ *
+ * The send opcode for a task. Sends the value and returns 1 if the
+ * channel has room, otherwise returns 0 so the task can yield and retry.
+ */
+int chan_task_send( xpvm_chan *c, uint64_t val, uint64_t is_blk )
+{
+  if( !chan_try_send( c, val, is_blk ) )
+    return 0;
+  chan_sent_wake( c );
+  return 1;
+}
+
+/*
+ * chan_send
+ *
+ * Sends a value, blocking while the channel is full.
+ */
+void chan_send( xpvm_chan *c, uint64_t val, uint64_t is_blk )
+{
+  uint32_t s;
+  int i;
+
+  for( i = 0; i < CHAN_SPIN; i++ )
+  {
+    if( chan_try_send( c, val, is_blk ) )
+      goto sent;
+    cpu_relax();
+  }
+
+  __atomic_add_fetch( &c->send_waiters, 1, __ATOMIC_SEQ_CST );
+  while( 1 )
+  {
+    s = __atomic_load_n( &c->received, __ATOMIC_SEQ_CST );
+    if( chan_try_send( c, val, is_blk ) )
+      break;
+    futex_wait( &c->received, s );
+  }
+  __atomic_sub_fetch( &c->send_waiters, 1, __ATOMIC_RELAXED );
+
+sent:
+  chan_sent_wake( c );
+}
+
+/*
+ * chan_recv
+ *
+ * Receives a value, blocking while the channel is empty.
+ */
+uint64_t chan_recv( xpvm_chan *c, uint64_t *is_blk )
+{
+  uint64_t val;
+  uint32_t s;
+  int i;
+
+  for( i = 0; i < CHAN_SPIN; i++ )
+  {
+    if( chan_try_recv( c, &val, is_blk ) )
+      return val;
+    cpu_relax();
+  }
+
+  __atomic_add_fetch( &c->recv_waiters, 1, __ATOMIC_SEQ_CST );
+  while( 1 )
+  {
+    s = __atomic_load_n( &c->sent, __ATOMIC_SEQ_CST );
+    if( chan_try_recv( c, &val, is_blk ) )
+      break;
+    futex_wait( &c->sent, s );
+  }
+  __atomic_sub_fetch( &c->recv_waiters, 1, __ATOMIC_RELAXED );
+  return val;
+}
+
+/*
+ * Barriers. The last processor to arrive resets the count and bumps the
+ * generation, which releases everyone sleeping on it. Resetting before
+ * the bump is safe since nobody can arrive for the next round until the
+ * generation has moved on.
+ */
+#define BARRIER_SPIN 100
+
+static xpvm_barrier barriers[XPVM_MAX_BARRIERS];
+static uint32_t num_barriers = 0;
+
+/*
+ * barrier_create
+ *
+ * Makes a barrier for count processors and returns its handle, or -1
+ * if the table is full.
+ */
+int64_t barrier_create( uint32_t count )
+{
+  uint32_t h = __atomic_fetch_add( &num_barriers, 1, __ATOMIC_RELAXED );
+
+  if( h >= XPVM_MAX_BARRIERS )
+    return -1;
+  __atomic_store_n( &barriers[h].count, count, __ATOMIC_RELEASE );
+  return h;
+}
+
+xpvm_barrier *barrier_lookup( uint64_t handle )
+{
+  if( handle >= XPVM_MAX_BARRIERS ||
+      !__atomic_load_n( &barriers[handle].count, __ATOMIC_ACQUIRE ) )
+    return NULL;
+  return &barriers[handle];
+}
+
+/*
+ * barrier_arrive
+ *
+ * Arrives at the barrier without waiting. Returns 1 in the last one to
+ * arrive, which releases the rest, and otherwise 0 with the generation to
+ * wait out in *gen.
+ */
+int barrier_arrive( xpvm_barrier *b, uint32_t *gen )
+{
+  *gen = __atomic_load_n( &b->gen, __ATOMIC_ACQUIRE );
+  if( __atomic_add_fetch( &b->arrived, 1, __ATOMIC_ACQ_REL ) == b->count )
+  {
+    __atomic_store_n( &b->arrived, 0, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &b->gen, 1, __ATOMIC_RELEASE );
+    futex_wake( &b->gen, INT_MAX );
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * barrier_passed
+ *
+ * Returns nonzero once generation gen of the barrier has been released.
+ */
+int barrier_passed( xpvm_barrier *b, uint32_t gen )
+{
+  return __atomic_load_n( &b->gen, __ATOMIC_ACQUIRE ) != gen;
+}
+
+/*
+ * barrier_wait
+ *
+ * Blocks until count processors have arrived. Returns 1 in the last one
+ * to arrive and 0 in the rest. Everything written before the barrier by
+ * any of them is visible to all of them after it.
+ */
+int barrier_wait( xpvm_barrier *b )
+{
+  uint32_t g;
+  int i;
+
+  if( barrier_arrive( b, &g ) )
+    return 1;
+
+  for( i = 0; i < BARRIER_SPIN; i++ )
+  {
+    if( __atomic_load_n( &b->gen, __ATOMIC_ACQUIRE ) != g )
+      return 0;
+    cpu_relax();
+  }
+  while( __atomic_load_n( &b->gen, __ATOMIC_ACQUIRE ) == g )
+    futex_wait( &b->gen, g );
+  return 0;
+}
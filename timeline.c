@@ -0,0 +1,254 @@
+/*
+ * timeline.c
+ *
+ * Timeline of the processors of the XPVM, turned on with -T, written as
+ * Chrome trace event JSON for chrome://tracing or Perfetto. Each processor
+ * is a thread of the trace, with a slice for every time it ran, and inside
+ * it slices for the time spent in join waiting for another processor and
+ * in aquire_blkw waiting for a block. init_proc marks where it started a
+ * processor, with an arrow to the start of the new one's run. Events are
+ * kept by the processor recording them and written at exit and on
+ * SIGUSR1.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xpvm.h"
+
+int timeline_on = 0;
+static const char *timeline_path = NULL;
+static pthread_mutex_t timeline_dump_mu = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t timeline_tick0, timeline_ns0;
+static uint32_t timeline_flows = 0;
+
+static uint64_t timeline_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static xpvm_timeline *timeline_get( xpvm_proc *p )
+{
+  xpvm_timeline *tl = p->timeline;
+
+  if( !tl )
+  {
+    if( !(tl = calloc( 1, sizeof(xpvm_timeline) )) )
+      EXIT_WITH_ERROR("Error: malloc failed in timeline_get\n");
+    pthread_mutex_init( &tl->mu, NULL );
+    __atomic_store_n( &p->timeline, tl, __ATOMIC_RELEASE );
+  }
+  return tl;
+}
+
+/* Appends an event to tl, which is locked */
+static void timeline_add( xpvm_timeline *tl, uint32_t kind, uint64_t arg,
+                          uint32_t flow )
+{
+  xpvm_timeline_ev *ev;
+  uint32_t cap;
+
+  if( tl->n == tl->cap )
+  {
+    if( tl->cap >= XPVM_TIMELINE_MAX )
+    {
+      tl->dropped++;
+      return;
+    }
+    cap = tl->cap ? tl->cap * 2 : 256;
+    if( !(ev = realloc( tl->ev, cap * sizeof(xpvm_timeline_ev) )) )
+      EXIT_WITH_ERROR("Error: malloc failed in timeline_add\n");
+    tl->ev = ev;
+    tl->cap = cap;
+  }
+  ev = &tl->ev[tl->n++];
+  ev->ts = prof_ticks();
+  ev->kind = kind;
+  ev->arg = arg;
+  ev->flow = flow;
+}
+
+/*
+ * timeline_record
+ *
+ * Records an event of the given kind for processor p, which must be the
+ * one calling. The start of a run carries the flow of whatever created it.
+ */
+void timeline_record( xpvm_proc *p, uint32_t kind, uint64_t arg )
+{
+  xpvm_timeline *tl = timeline_get( p );
+
+  pthread_mutex_lock( &tl->mu );
+  timeline_add( tl, kind, arg,
+                TIMELINE_RUN_BEGIN == kind ? tl->flow : 0 );
+  if( TIMELINE_RUN_BEGIN == kind )
+    tl->flow = 0;
+  pthread_mutex_unlock( &tl->mu );
+}
+
+/*
+ * timeline_spawn
+ *
+ * Records that parent is creating processor child, whose thread has not
+ * been started yet, and links it to the start of child's run. parent is
+ * NULL for the main processor, which nothing created.
+ */
+void timeline_spawn( xpvm_proc *parent, xpvm_proc *child )
+{
+  xpvm_timeline *tl;
+  uint32_t flow;
+
+  if( !parent )
+    return;
+  flow = __atomic_add_fetch( &timeline_flows, 1, __ATOMIC_RELAXED );
+  tl = timeline_get( child );
+  pthread_mutex_lock( &tl->mu );
+  tl->flow = flow;
+  pthread_mutex_unlock( &tl->mu );
+
+  tl = timeline_get( parent );
+  pthread_mutex_lock( &tl->mu );
+  timeline_add( tl, TIMELINE_CREATE, child->id, flow );
+  pthread_mutex_unlock( &tl->mu );
+}
+
+/* Writes a block name as the rest of a JSON string */
+static void timeline_block( FILE *fp, uint64_t b )
+{
+  uint32_t blk = prof_find_block( (uint8_t*) CAST_INT b );
+  const char *s;
+  char buf[32];
+
+  if( blk >= block_cnt )
+  {
+    fprintf( fp, "0x%" PRIx64, b );
+    return;
+  }
+  for( s = prof_block_name( blk, buf, sizeof(buf) ); *s; s++ )
+  {
+    if( '"' == *s || '\\' == *s )
+      fprintf( fp, "\\%c", *s );
+    else if( (unsigned char) *s >= 0x20 )
+      fputc( *s, fp );
+  }
+}
+
+/* Writes one event of processor pid, with the time in microseconds */
+static void timeline_event( FILE *fp, uint32_t pid, xpvm_timeline_ev *ev,
+                            double ns_per_tick )
+{
+  double us = (int64_t)(ev->ts - timeline_tick0) * ns_per_tick / 1e3;
+
+  switch( ev->kind )
+  {
+    case TIMELINE_RUN_BEGIN:
+      fprintf( fp, ",\n{\"name\":\"run " );
+      timeline_block( fp, ev->arg );
+      fprintf( fp, "\",\"cat\":\"proc\",\"ph\":\"B\",\"pid\":0,\"tid\":%u,"
+               "\"ts\":%.3f}", pid, us );
+      if( ev->flow )
+        fprintf( fp, ",\n{\"name\":\"init_proc\",\"cat\":\"proc\","
+                 "\"ph\":\"f\",\"bp\":\"e\",\"id\":%u,\"pid\":0,"
+                 "\"tid\":%u,\"ts\":%.3f}", ev->flow, pid, us );
+      break;
+    case TIMELINE_CREATE:
+      fprintf( fp, ",\n{\"name\":\"init_proc %" PRIu64 "\",\"cat\":\"proc\","
+               "\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+               ev->arg, pid, us );
+      fprintf( fp, ",\n{\"name\":\"init_proc\",\"cat\":\"proc\","
+               "\"ph\":\"s\",\"id\":%u,\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+               ev->flow, pid, us );
+      break;
+    case TIMELINE_JOIN_BEGIN:
+      fprintf( fp, ",\n{\"name\":\"join %" PRIu64 "\",\"cat\":\"join\","
+               "\"ph\":\"B\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}", ev->arg,
+               pid, us );
+      break;
+    case TIMELINE_WAIT_BEGIN:
+      fprintf( fp, ",\n{\"name\":\"aquire " );
+      timeline_block( fp, ev->arg );
+      fprintf( fp, "\",\"cat\":\"aquire\",\"ph\":\"B\",\"pid\":0,"
+               "\"tid\":%u,\"ts\":%.3f}", pid, us );
+      break;
+    default:
+      fprintf( fp, ",\n{\"ph\":\"E\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+               pid, us );
+      break;
+  }
+}
+
+/*
+ * timeline_dump
+ *
+ * Writes the events of all processors to the path given to timeline_init,
+ * replacing what was there. Slices still open are left for the viewer to
+ * close at the end of the trace.
+ */
+void timeline_dump( void )
+{
+  xpvm_timeline *tl;
+  uint64_t dt, dns, n = 0, dropped = 0;
+  double ns_per_tick;
+  uint32_t i, j;
+  FILE *fp;
+
+  if( !timeline_on )
+    return;
+  pthread_mutex_lock( &timeline_dump_mu );
+  if( !(fp = fopen( timeline_path, "w" )) )
+  {
+    perror( timeline_path );
+    goto out;
+  }
+  dt = prof_ticks() - timeline_tick0;
+  dns = timeline_ns() - timeline_ns0;
+  ns_per_tick = dt ? (double) dns / dt : 1.0;
+
+  fprintf( fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+               "\"args\":{\"name\":\"xpvm\"}}" );
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !(tl = __atomic_load_n( &procs[i].timeline, __ATOMIC_ACQUIRE )) )
+      continue;
+    fprintf( fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+             "\"tid\":%u,\"args\":{\"name\":\"processor %u\"}}", i, i );
+    pthread_mutex_lock( &tl->mu );
+    for( j = 0; j < tl->n; j++ )
+      timeline_event( fp, i, &tl->ev[j], ns_per_tick );
+    n += tl->n;
+    dropped += tl->dropped;
+    pthread_mutex_unlock( &tl->mu );
+  }
+  fprintf( fp, "\n]}\n" );
+  fclose( fp );
+  fprintf( stderr, "xpvm: timeline of %" PRIu64 " events written to %s",
+           n, timeline_path );
+  if( dropped )
+    fprintf( stderr, ", %" PRIu64 " dropped", dropped );
+  fprintf( stderr, "\n" );
+out:
+  pthread_mutex_unlock( &timeline_dump_mu );
+}
+
+/*
+ * timeline_init
+ *
+ * Turns on the timeline, to be written to path. Called by main before any
+ * processor starts. Returns 0, or -1 if the report cannot be added.
+ */
+int timeline_init( const char *path )
+{
+  timeline_path = path;
+  timeline_tick0 = prof_ticks();
+  timeline_ns0 = timeline_ns();
+  if( report_add( timeline_dump ) )
+    return -1;
+  timeline_on = 1;
+  return 0;
+}
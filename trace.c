@@ -0,0 +1,217 @@
+/*
+ * trace.c
+ *
+ * Execution trace for the XPVM, turned on with -t. Every processor writes
+ * a fixed size record for each instruction it runs into a ring buffer of
+ * its own, so tracing takes no locks and never touches stdio. The rings
+ * keep the last XPVM_TRACE_RECORDS instructions of each processor and are
+ * written to the trace file at exit, on SIGUSR2, or when the VM crashes.
+ * The file is read with xpvm_trace.
+ *
+ * Writing the file only uses open, write and close so that it can be done
+ * from a signal handler. Processors keep running while it is written, so
+ * the newest records of a ring may be torn; each record carries its
+ * position in the ring's stream and the decoder drops any that do not
+ * match.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "xpvm.h"
+
+static const char *trace_path = NULL;
+static uint64_t trace_tick0, trace_ns0;
+
+/* Signals the rings are written on before the VM dies of them */
+static const int trace_crash_sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE,
+                                        SIGABRT };
+
+static uint64_t trace_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * trace_get
+ *
+ * Returns the ring of processor p, allocating it the first time, or NULL
+ * if tracing is off.
+ */
+xpvm_trace *trace_get( xpvm_proc *p )
+{
+  xpvm_trace *t = p->trace;
+
+  if( t || !trace_path )
+    return t;
+  t = calloc( 1, sizeof(xpvm_trace) );
+  if( t )
+    t->rec = malloc( XPVM_TRACE_RECORDS * sizeof(xpvm_trace_rec) );
+  if( !t || !t->rec )
+    EXIT_WITH_ERROR("Error: malloc failed in trace_get\n");
+  /* No slot holds a valid record until it is written */
+  memset( t->rec, 0xff, XPVM_TRACE_RECORDS * sizeof(xpvm_trace_rec) );
+  t->proc = p->id;
+  __atomic_store_n( &p->trace, t, __ATOMIC_RELEASE );
+  return t;
+}
+
+/* write() all of len bytes, giving up on an error */
+static int trace_put( int fd, const void *buf, size_t len )
+{
+  const char *s = buf;
+  ssize_t r;
+
+  while( len )
+  {
+    if( (r = write( fd, s, len )) <= 0 )
+      return -1;
+    s += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int trace_put_str( int fd, const char *s )
+{
+  uint16_t len = s ? strlen( s ) : 0;
+
+  if( trace_put( fd, &len, sizeof(len) ) )
+    return -1;
+  return trace_put( fd, s, len );
+}
+
+/*
+ * trace_write
+ *
+ * Writes every ring to the trace file. The file starts with a
+ * trace_header, then the name of each opcode and the address and name of
+ * each loaded block so it can be decoded on its own, then each ring as a
+ * trace_ring_header followed by its records from the oldest. The slot
+ * after the newest record is included as well, since it holds the
+ * instruction in progress if the VM crashed in the middle of one.
+ */
+static void trace_write( void )
+{
+  trace_header h;
+  trace_ring_header rh;
+  xpvm_trace *t;
+  uint64_t first, n;
+  uint32_t i;
+  int fd;
+
+  if( !trace_path )
+    return;
+  if( (fd = open( trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 )) < 0 )
+    return;
+
+  memset( &h, 0, sizeof(h) );
+  memcpy( h.magic, XPVM_TRACE_MAGIC, sizeof(h.magic) );
+  h.version = XPVM_TRACE_VERSION;
+  h.rec_size = sizeof(xpvm_trace_rec);
+  h.nops = 256;
+  h.nblocks = block_cnt;
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+    if( __atomic_load_n( &procs[i].trace, __ATOMIC_ACQUIRE ) )
+      h.nrings++;
+  h.tick0 = trace_tick0;
+  h.ns0 = trace_ns0;
+  h.tick1 = prof_ticks();
+  h.ns1 = trace_ns();
+  if( trace_put( fd, &h, sizeof(h) ) )
+    goto out;
+
+  for( i = 0; i < 256; i++ )
+    if( trace_put_str( fd, opcode_name( i ) ) )
+      goto out;
+  for( i = 0; i < block_cnt; i++ )
+    if( trace_put( fd, &block_ptr[i], sizeof(uint64_t) ) ||
+        trace_put_str( fd, block_names ? block_names[i] : NULL ) )
+      goto out;
+
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !(t = __atomic_load_n( &procs[i].trace, __ATOMIC_ACQUIRE )) )
+      continue;
+    rh.proc = t->proc;
+    rh.head = __atomic_load_n( &t->head, __ATOMIC_ACQUIRE );
+    n = rh.head < XPVM_TRACE_RECORDS ? rh.head + 1 : XPVM_TRACE_RECORDS;
+    first = rh.head + 1 - n;
+    rh.count = n;
+    if( trace_put( fd, &rh, sizeof(rh) ) )
+      goto out;
+    /* The oldest record is at first, possibly wrapping to the start */
+    first &= XPVM_TRACE_RECORDS - 1;
+    if( first + n > XPVM_TRACE_RECORDS )
+    {
+      if( trace_put( fd, &t->rec[first],
+                     (XPVM_TRACE_RECORDS - first) * sizeof(xpvm_trace_rec) ) )
+        goto out;
+      n -= XPVM_TRACE_RECORDS - first;
+      first = 0;
+    }
+    if( trace_put( fd, &t->rec[first], n * sizeof(xpvm_trace_rec) ) )
+      goto out;
+  }
+out:
+  close( fd );
+}
+
+static void trace_atexit( void )
+{
+  trace_write();
+}
+
+static void trace_signal( int sig )
+{
+  int saved = errno;
+
+  trace_write();
+  errno = saved;
+}
+
+/* Writes the rings and lets the signal kill the VM as it would have */
+static void trace_crash( int sig )
+{
+  trace_write();
+  raise( sig );
+}
+
+/*
+ * trace_init
+ *
+ * Turns on tracing, to be written to path. Called by main before any
+ * processor starts. Returns 0, or -1 if the signal handlers cannot be
+ * installed.
+ */
+int trace_init( const char *path )
+{
+  struct sigaction sa;
+  uint32_t i;
+
+  trace_path = path;
+  trace_tick0 = prof_ticks();
+  trace_ns0 = trace_ns();
+  atexit( trace_atexit );
+
+  memset( &sa, 0, sizeof(sa) );
+  sigemptyset( &sa.sa_mask );
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  if( sigaction( SIGUSR2, &sa, NULL ) )
+    return -1;
+  sa.sa_handler = trace_crash;
+  sa.sa_flags = SA_RESETHAND;
+  for( i = 0; i < sizeof(trace_crash_sigs) / sizeof(int); i++ )
+    if( sigaction( trace_crash_sigs[i], &sa, NULL ) )
+      return -1;
+  return 0;
+}
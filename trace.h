@@ -0,0 +1,69 @@
+/*
+ * trace.h
+ *
+ * Layout of the execution trace written by trace.c and read by
+ * xpvm_trace. All fields are in the byte order of the machine the VM ran
+ * on.
+ *
+ * Author: Jeffrey Picard
+ */
+#ifndef __XPVM_TRACE_H
+#define __XPVM_TRACE_H
+
+#include <inttypes.h>
+
+#define XPVM_TRACE_MAGIC   "XPVMTRC1"
+#define XPVM_TRACE_VERSION 1
+
+/* seq of a slot which does not hold a finished record */
+#define XPVM_TRACE_NO_SEQ  UINT64_MAX
+
+/*
+ * One instruction. seq is the position of the record in its ring's
+ * stream and is written last. vj and vk are the registers named by the
+ * second and third bytes of the instruction before it ran, vi the one
+ * named by the first after it ran.
+ */
+struct _xpvm_trace_rec
+{
+  uint64_t      seq;
+  uint64_t      ts;
+  uint64_t      cib;
+  uint32_t      cio;
+  uint32_t      pid;
+  uint8_t       insn[4];
+  uint32_t      pad;
+  uint64_t      vi;
+  uint64_t      vj;
+  uint64_t      vk;
+} typedef xpvm_trace_rec;
+
+/*
+ * Start of the file. ts values convert to nanoseconds by the line through
+ * (tick0, ns0) and (tick1, ns1).
+ */
+struct _trace_header
+{
+  char          magic[8];
+  uint32_t      version;
+  uint32_t      rec_size;
+  uint32_t      nops;
+  uint32_t      nblocks;
+  uint32_t      nrings;
+  uint32_t      pad;
+  uint64_t      tick0;
+  uint64_t      ns0;
+  uint64_t      tick1;
+  uint64_t      ns1;
+} typedef trace_header;
+
+/* Start of each ring, followed by count records, the last head */
+struct _trace_ring_header
+{
+  uint32_t      proc;
+  uint32_t      pad;
+  uint64_t      head;
+  uint64_t      count;
+} typedef trace_ring_header;
+
+#endif
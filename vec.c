@@ -0,0 +1,357 @@
+/*
+ * vec.c
+ *
+ * Kernels for the vector opcodes of the XPVM. Each operation has a plain
+ * C version and, on x86, SSE2 and AVX2 versions; vec_init picks the best
+ * set the CPU supports once at startup and the opcodes call through
+ * vec_ops. Setting XPVM_VEC to scalar, sse2 or avx2 caps the choice,
+ * which is mostly useful for testing the fallbacks. The multiply adds
+ * of fmad and dotd round once in every set, as fmad does, so that their
+ * results do not depend on the CPU.
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "xpvm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XPVM_VEC_X86 1
+#include <immintrin.h>
+#else
+#define XPVM_VEC_X86 0
+#endif
+
+/************************** Scalar kernels ***************************/
+
+static void addd_scalar( double *d, const double *a, const double *b,
+                         uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = a[i] + b[i];
+}
+
+static void muld_scalar( double *d, const double *a, const double *b,
+                         uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = a[i] * b[i];
+}
+
+static void fmad_scalar( double *d, const double *a, const double *b,
+                         uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = fma( a[i], b[i], d[i] );
+}
+
+static void scaled_scalar( double *d, const double *a, double s, uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = a[i] * s;
+}
+
+static double dotd_scalar( const double *a, const double *b, uint64_t n )
+{
+  double r = 0;
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    r = fma( a[i], b[i], r );
+  return r;
+}
+
+static double sumd_scalar( const double *a, uint64_t n )
+{
+  double r = 0;
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    r += a[i];
+  return r;
+}
+
+static void addl_scalar( int64_t *d, const int64_t *a, const int64_t *b,
+                         uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = a[i] + b[i];
+}
+
+static void mull_scalar( int64_t *d, const int64_t *a, const int64_t *b,
+                         uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = a[i] * b[i];
+}
+
+static void fmal_scalar( int64_t *d, const int64_t *a, const int64_t *b,
+                         uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] += a[i] * b[i];
+}
+
+static void scalel_scalar( int64_t *d, const int64_t *a, int64_t s,
+                           uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    d[i] = a[i] * s;
+}
+
+static int64_t dotl_scalar( const int64_t *a, const int64_t *b, uint64_t n )
+{
+  int64_t r = 0;
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    r += a[i] * b[i];
+  return r;
+}
+
+static int64_t suml_scalar( const int64_t *a, uint64_t n )
+{
+  int64_t r = 0;
+  uint64_t i;
+  for( i = 0; i < n; i++ )
+    r += a[i];
+  return r;
+}
+
+#if XPVM_VEC_X86
+
+/*************************** SSE2 kernels ****************************/
+
+/*
+ * Neither SSE2 nor AVX2 has a 64 bit integer multiply, so the long
+ * multiply, fma, scale and dot kernels stay scalar in both sets. SSE2 has
+ * no fused multiply add either, so its fmad and dotd are the scalar ones.
+ */
+
+__attribute__((target("sse2")))
+static void addd_sse2( double *d, const double *a, const double *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 2 <= n; i += 2 )
+    _mm_storeu_pd( d + i, _mm_add_pd( _mm_loadu_pd( a + i ),
+                                      _mm_loadu_pd( b + i ) ) );
+  addd_scalar( d + i, a + i, b + i, n - i );
+}
+
+__attribute__((target("sse2")))
+static void muld_sse2( double *d, const double *a, const double *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 2 <= n; i += 2 )
+    _mm_storeu_pd( d + i, _mm_mul_pd( _mm_loadu_pd( a + i ),
+                                      _mm_loadu_pd( b + i ) ) );
+  muld_scalar( d + i, a + i, b + i, n - i );
+}
+
+__attribute__((target("sse2")))
+static void scaled_sse2( double *d, const double *a, double s, uint64_t n )
+{
+  __m128d vs = _mm_set1_pd( s );
+  uint64_t i;
+  for( i = 0; i + 2 <= n; i += 2 )
+    _mm_storeu_pd( d + i, _mm_mul_pd( _mm_loadu_pd( a + i ), vs ) );
+  scaled_scalar( d + i, a + i, s, n - i );
+}
+
+__attribute__((target("sse2")))
+static double sumd_sse2( const double *a, uint64_t n )
+{
+  __m128d acc = _mm_setzero_pd();
+  double t[2];
+  uint64_t i;
+  for( i = 0; i + 2 <= n; i += 2 )
+    acc = _mm_add_pd( acc, _mm_loadu_pd( a + i ) );
+  _mm_storeu_pd( t, acc );
+  return t[0] + t[1] + sumd_scalar( a + i, n - i );
+}
+
+__attribute__((target("sse2")))
+static void addl_sse2( int64_t *d, const int64_t *a, const int64_t *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 2 <= n; i += 2 )
+    _mm_storeu_si128( (__m128i*)(d + i),
+                      _mm_add_epi64( _mm_loadu_si128( (__m128i*)(a + i) ),
+                                     _mm_loadu_si128( (__m128i*)(b + i) ) ) );
+  addl_scalar( d + i, a + i, b + i, n - i );
+}
+
+__attribute__((target("sse2")))
+static int64_t suml_sse2( const int64_t *a, uint64_t n )
+{
+  __m128i acc = _mm_setzero_si128();
+  int64_t t[2];
+  uint64_t i;
+  for( i = 0; i + 2 <= n; i += 2 )
+    acc = _mm_add_epi64( acc, _mm_loadu_si128( (__m128i*)(a + i) ) );
+  _mm_storeu_si128( (__m128i*) t, acc );
+  return t[0] + t[1] + suml_scalar( a + i, n - i );
+}
+
+/*************************** AVX2 kernels ****************************/
+
+__attribute__((target("avx2")))
+static void addd_avx2( double *d, const double *a, const double *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    _mm256_storeu_pd( d + i, _mm256_add_pd( _mm256_loadu_pd( a + i ),
+                                            _mm256_loadu_pd( b + i ) ) );
+  addd_scalar( d + i, a + i, b + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static void muld_avx2( double *d, const double *a, const double *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    _mm256_storeu_pd( d + i, _mm256_mul_pd( _mm256_loadu_pd( a + i ),
+                                            _mm256_loadu_pd( b + i ) ) );
+  muld_scalar( d + i, a + i, b + i, n - i );
+}
+
+/* Every AVX2 part so far also has FMA3, but vec_init checks for both */
+__attribute__((target("avx2,fma")))
+static void fmad_avx2( double *d, const double *a, const double *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    _mm256_storeu_pd( d + i, _mm256_fmadd_pd( _mm256_loadu_pd( a + i ),
+                                              _mm256_loadu_pd( b + i ),
+                                              _mm256_loadu_pd( d + i ) ) );
+  fmad_scalar( d + i, a + i, b + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static void scaled_avx2( double *d, const double *a, double s, uint64_t n )
+{
+  __m256d vs = _mm256_set1_pd( s );
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    _mm256_storeu_pd( d + i, _mm256_mul_pd( _mm256_loadu_pd( a + i ), vs ) );
+  scaled_scalar( d + i, a + i, s, n - i );
+}
+
+__attribute__((target("avx2,fma")))
+static double dotd_avx2( const double *a, const double *b, uint64_t n )
+{
+  __m256d acc = _mm256_setzero_pd();
+  double t[4];
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    acc = _mm256_fmadd_pd( _mm256_loadu_pd( a + i ),
+                           _mm256_loadu_pd( b + i ), acc );
+  _mm256_storeu_pd( t, acc );
+  return (t[0] + t[1]) + (t[2] + t[3]) + dotd_scalar( a + i, b + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static double sumd_avx2( const double *a, uint64_t n )
+{
+  __m256d acc = _mm256_setzero_pd();
+  double t[4];
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    acc = _mm256_add_pd( acc, _mm256_loadu_pd( a + i ) );
+  _mm256_storeu_pd( t, acc );
+  return (t[0] + t[1]) + (t[2] + t[3]) + sumd_scalar( a + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static void addl_avx2( int64_t *d, const int64_t *a, const int64_t *b,
+                       uint64_t n )
+{
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    _mm256_storeu_si256( (__m256i*)(d + i),
+                         _mm256_add_epi64(
+                           _mm256_loadu_si256( (__m256i*)(a + i) ),
+                           _mm256_loadu_si256( (__m256i*)(b + i) ) ) );
+  addl_scalar( d + i, a + i, b + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static int64_t suml_avx2( const int64_t *a, uint64_t n )
+{
+  __m256i acc = _mm256_setzero_si256();
+  int64_t t[4];
+  uint64_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    acc = _mm256_add_epi64( acc, _mm256_loadu_si256( (__m256i*)(a + i) ) );
+  _mm256_storeu_si256( (__m256i*) t, acc );
+  return t[0] + t[1] + t[2] + t[3] + suml_scalar( a + i, n - i );
+}
+
+#endif /* XPVM_VEC_X86 */
+
+static const vec_kernels vec_scalar =
+{
+  "scalar",
+  addd_scalar, muld_scalar, fmad_scalar, scaled_scalar,
+  dotd_scalar, sumd_scalar,
+  addl_scalar, mull_scalar, fmal_scalar, scalel_scalar,
+  dotl_scalar, suml_scalar,
+};
+
+#if XPVM_VEC_X86
+static const vec_kernels vec_sse2 =
+{
+  "sse2",
+  addd_sse2, muld_sse2, fmad_scalar, scaled_sse2,
+  dotd_scalar, sumd_sse2,
+  addl_sse2, mull_scalar, fmal_scalar, scalel_scalar,
+  dotl_scalar, suml_sse2,
+};
+
+static const vec_kernels vec_avx2 =
+{
+  "avx2",
+  addd_avx2, muld_avx2, fmad_avx2, scaled_avx2,
+  dotd_avx2, sumd_avx2,
+  addl_avx2, mull_scalar, fmal_scalar, scalel_scalar,
+  dotl_scalar, suml_avx2,
+};
+#endif
+
+const vec_kernels *vec_ops = &vec_scalar;
+
+/*
+ * vec_init
+ *
+ * Picks the vector kernels for this CPU. Called once from main before
+ * any processor starts.
+ */
+void vec_init( void )
+{
+#if XPVM_VEC_X86
+  char *cap = getenv( "XPVM_VEC" );
+
+  __builtin_cpu_init();
+  if( cap && !strcmp( cap, "scalar" ) )
+    return;
+  if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) &&
+      !(cap && !strcmp( cap, "sse2" )) )
+    vec_ops = &vec_avx2;
+  else if( __builtin_cpu_supports( "sse2" ) )
+    vec_ops = &vec_sse2;
+#endif
+}
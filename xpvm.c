@@ -11,22 +11,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <dlfcn.h>
+#include <signal.h>
 #include <assert.h>
+#include <sys/resource.h>
 
 #include "xpvm.h"
 #include "opcode_table.h"
 
 /* forward references */
 static void *fetch_execute(void *v);
+static int interp( xpvm_proc *p, uint64_t *reg, uint8_t *b, int64_t *ret_val );
 void test_block_macros( uint64_t ptr_as_int );
 
 uint64_t regs[NUM_REGS];
 uint32_t block_cnt = 0;
 uint64_t *block_ptr = 0;
+char **block_names = NULL;
+
+xpvm_proc procs[XPVM_MAX_PROCESSORS];
+__thread xpvm_proc *cur_proc = NULL;
+uint32_t proc_exit_seq = 0;
+static pthread_mutex_t procs_mu = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * cleanup
@@ -58,14 +69,23 @@ void cleanup( void )
   dlclose( __lh );
 }
 
+/*
+ * add_blk
+ *
+ * Pushes a block onto the list with a cmpxchg so processors allocating
+ * from their own caches need no lock. Nothing is ever removed from the
+ * list so readers can walk it at any time.
+ */
 int add_blk( blk_list **root, uint64_t id )
 {
   blk_list *new = calloc( 1, sizeof(blk_list) );
   if( !new )
     return 1;
   new->id = id;
-  new->next = *root;
-  *root = new;
+  new->next = __atomic_load_n( root, __ATOMIC_RELAXED );
+  while( !__atomic_compare_exchange_n( root, &new->next, new, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+    ;
   return 0;
 }
 
@@ -84,7 +104,7 @@ int find_blk( blk_list *root, uint64_t id )
 uint8_t *blk_2_ptr( uint8_t *b, int offset, uint64_t checks )
 {
 #if CHECKS
-  unsigned int pid = pthread_self();
+  unsigned int pid = CUR_PID;
   if( offset > BLOCK_LENGTH(b) )
     EXIT_WITH_ERROR("Error: Out of bounds in blk_2_ptr. "
                     "This should be an exception!\n");
@@ -132,7 +152,7 @@ void patch_native_refs( native_ref_patch **native_ref_patches,
       fprintf( stderr, "OFFSET: %d\n", (int)native_ref_patches[i][j].offset );
 #endif
       uint8_t *data = (uint8_t *) block_ptr[i];
-      uint8_t p1 = native_ref_patches[i][j].patch << 8;
+      uint8_t p1 = native_ref_patches[i][j].patch >> 8;
       uint8_t p2 = (uint8_t)(native_ref_patches[i][j].patch & 0xFF);
       data[native_ref_patches[i][j].offset] = p1;
       data[native_ref_patches[i][j].offset+1] = p2;
@@ -232,6 +252,8 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   uint32_t start_offset = 0;
   uint32_t end_offset   = 0;
   uint32_t code_offset  = 0;
+
+  cur_proc->exceptions++;
   while(1)
   {
     handlers = (uint32_t*) BLOCK_EXCEPT_HANDLERS( CIB );
@@ -275,9 +297,7 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
       //EXIT_WITH_ERROR("Error: Unhandled Exception\n");
     stack_frame *old_frame = *stack;
     *stack = (*stack)->prev;
-    if( old_frame->block )
-      free( old_frame->block - BLOCK_HEADER_LENGTH );
-    free( old_frame );
+    frame_free( cur_proc, old_frame );
     /* Set the CIO to the call that resulted in the exception */
     CIO = CIO - 4;
   }
@@ -287,6 +307,129 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   return 0;
 }
 
+/*
+ * frame_alloc
+ *
+ * Gets a stack frame for a call, with a zeroed locals block of
+ * frame_size bytes if frame_size is nonzero. Frames come off the
+ * processor's free list when possible so calls do not go to malloc.
+ */
+stack_frame *frame_alloc( xpvm_proc *p, uint32_t frame_size )
+{
+  stack_frame *f = p->free_frames;
+  uint8_t *mem;
+  uint32_t cap;
+
+  if( f )
+    p->free_frames = f->prev;
+  else
+  {
+    f = calloc( 1, sizeof(stack_frame) );
+    /* FIXME: Throw OutOfMemory Exception */
+    if( !f )
+      EXIT_WITH_ERROR("Error: malloc failed in frame_alloc\n");
+  }
+  mem = f->block_mem;
+  cap = f->block_cap;
+  memset( f, 0, sizeof(stack_frame) );
+  f->block_mem = mem;
+  f->block_cap = cap;
+  if( frame_size )
+  {
+    if( f->block_cap < frame_size )
+    {
+      free( f->block_mem );
+      f->block_mem = malloc( frame_size + BLOCK_HEADER_LENGTH );
+      /* FIXME: Throw OutOfMemory Exception */
+      if( !f->block_mem )
+        EXIT_WITH_ERROR("Error: malloc failed in frame_alloc\n");
+      f->block_cap = frame_size;
+    }
+    memset( f->block_mem, 0, frame_size + BLOCK_HEADER_LENGTH );
+    f->block = f->block_mem + BLOCK_HEADER_LENGTH;
+    BLOCK_LENGTH( f->block ) = frame_size;
+  }
+  return f;
+}
+
+/*
+ * frame_free
+ *
+ * Returns a popped frame to the processor's free list.
+ */
+void frame_free( xpvm_proc *p, stack_frame *f )
+{
+  f->prev = p->free_frames;
+  p->free_frames = f;
+}
+
+/*
+ * proc_try_alloc
+ *
+ * Hands out the lowest free processor id, or NULL if all are in use.
+ */
+xpvm_proc *proc_try_alloc( void )
+{
+  int i;
+  xpvm_proc *p = NULL;
+
+  pthread_mutex_lock( &procs_mu );
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( PROC_FREE == procs[i].state )
+    {
+      p = &procs[i];
+      p->id = i;
+      p->state = PROC_RUNNING;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &procs_mu );
+  return p;
+}
+
+static xpvm_proc *proc_alloc( void )
+{
+  xpvm_proc *p = proc_try_alloc();
+  if( !p )
+    EXIT_WITH_ERROR("Error: more than %d processors in proc_alloc\n",
+                    XPVM_MAX_PROCESSORS );
+  return p;
+}
+
+static void proc_free( xpvm_proc *p )
+{
+  pthread_mutex_lock( &procs_mu );
+  p->state = PROC_FREE;
+  pthread_mutex_unlock( &procs_mu );
+}
+
+/*
+ * proc_lookup
+ *
+ * Maps a processor id from a register to its state, or NULL if there
+ * is no such processor.
+ */
+static xpvm_proc *proc_lookup( uint64_t proc_id )
+{
+  if( proc_id >= XPVM_MAX_PROCESSORS || PROC_FREE == procs[proc_id].state )
+    return NULL;
+  return &procs[proc_id];
+}
+
+/*
+ * proc_exit
+ *
+ * Marks a processor as finished, after its result has been stored, and
+ * wakes anything waiting for processors to finish.
+ */
+static void proc_exit( xpvm_proc *p )
+{
+  __atomic_store_n( &p->state, PROC_DONE, __ATOMIC_RELEASE );
+  __atomic_add_fetch( &proc_exit_seq, 1, __ATOMIC_SEQ_CST );
+  futex_wake( &proc_exit_seq, INT_MAX );
+}
+
 /*********************************************************************
  * implementation of the public interface to the VM
  */
@@ -301,57 +444,237 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 int do_init_proc( uint64_t *proc_id, uint64_t work, int argc, 
                  uint64_t *reg_bank )
 {
-  pthread_t *pt = calloc( 1, sizeof(pthread_t) );
+  xpvm_proc *p = proc_alloc();
 
 #if DEBUG_XPVM
-  fprintf( stderr, "Starting processors.\n");
+  fprintf( stderr, "Starting processor %d.\n", p->id );
 #endif
 
   fe_args *ar3 = calloc( 1, sizeof(fe_args) );
   if( !ar3 )
     EXIT_WITH_ERROR("Error: malloc failed in do_init_proc\n");
+  ar3->proc = p;
   ar3->reg_bank = reg_bank;
   ar3->work = work;
   ar3->argc = argc;
 
-  if (pthread_create(pt, NULL, fetch_execute, (void *) ar3) != 0)
+  TIMELINE_SPAWN( cur_proc, p );
+  if (pthread_create(&p->thread, NULL, fetch_execute, (void *) ar3) != 0)
   {
     perror("error in thread create");
     exit(-1);
   }
 
-  *proc_id = (uint64_t) CAST_INT pt;
+  *proc_id = p->id;
 
   return 0;
 }
 
-int do_proc_join( uint64_t proc_id, uint64_t *ret_val )
+/*
+ * proc_reap
+ *
+ * Joins the thread of a processor known to be finished, hands back its
+ * return value and frees its id.
+ */
+static void proc_reap( xpvm_proc *p, uint64_t *ret_val )
 {
-  pthread_t *pt = (pthread_t*) CAST_INT proc_id;
-  void *ret;
-  if (pthread_join(*pt, &ret) != 0)
+  if (pthread_join(p->thread, NULL) != 0)
   {
     perror("error in thread join");
     exit(-1);
   }
-  /**ret_val = (uint64_t) CAST_INT ret;*/
-  *ret_val =  ((ret_struct*)ret)->ret_val;
-  free( pt );
+  *ret_val = p->result.ret_val;
+  proc_free( p );
+}
+
+static int proc_done( xpvm_proc *p )
+{
+  return PROC_DONE == __atomic_load_n( &p->state, __ATOMIC_ACQUIRE );
+}
+
+int do_proc_join( uint64_t proc_id, uint64_t *ret_val )
+{
+  xpvm_proc *p = proc_lookup( proc_id );
+  if( IS_TASK_ID( proc_id ) )
+    return task_join( proc_id, ret_val, 1 );
+  if( !p )
+    EXIT_WITH_ERROR("Error: join of unknown processor %" PRIu64 "\n",
+                    proc_id );
+  proc_reap( p, ret_val );
 
   return 0;
 }
 
+/*
+ * do_join2
+ *
+ * Non-blocking join. Returns 1 and joins the processor if it has
+ * finished, otherwise returns 0 and leaves it running.
+ */
 int do_join2( uint64_t proc_id, uint64_t *ret_val )
 {
-  pthread_t *pt = (pthread_t*) CAST_INT proc_id;
-  void *ret;
-  if (pthread_tryjoin_np(*pt, &ret) != 0)
+  xpvm_proc *p = proc_lookup( proc_id );
+  if( IS_TASK_ID( proc_id ) )
+    return task_join( proc_id, ret_val, 0 );
+  if( !p )
+    EXIT_WITH_ERROR("Error: join of unknown processor %" PRIu64 "\n",
+                    proc_id );
+  if( !proc_done( p ) )
+    return 0;
+  proc_reap( p, ret_val );
+
+  return 1;
+}
+
+/*
+ * do_join_any
+ *
+ * Joins whichever of the n processors in proc_ids finishes first,
+ * sleeping on the processor exit futex until one does. Returns its
+ * index in proc_ids.
+ */
+uint32_t do_join_any( uint64_t *proc_ids, uint32_t n, uint64_t *ret_val )
+{
+  xpvm_proc *p[XPVM_MAX_PROCESSORS];
+  uint32_t i;
+  uint32_t s;
+
+  for( i = 0; i < n; i++ )
+    if( !(p[i] = proc_lookup( proc_ids[i] )) )
+      EXIT_WITH_ERROR("Error: join of unknown processor %" PRIu64 "\n",
+                      proc_ids[i] );
+
+  while( 1 )
   {
-    perror("error in thread join");
-    exit(-1);
+    s = __atomic_load_n( &proc_exit_seq, __ATOMIC_ACQUIRE );
+    for( i = 0; i < n; i++ )
+    {
+      if( proc_done( p[i] ) )
+      {
+        proc_reap( p[i], ret_val );
+        return i;
+      }
+    }
+    futex_wait( &proc_exit_seq, s );
+  }
+}
+
+/*
+ * Partial results of a reduce, one row per level of the tree. Leaf i
+ * is combined with leaf i^1, their result with that of the neighbouring
+ * pair and so on, whatever order the processors finish in, so the
+ * result of a floating point reduction does not depend on timing.
+ */
+struct _reduce_tree
+{
+  uint64_t val[8][XPVM_MAX_PROCESSORS];
+  uint8_t  have[8][XPVM_MAX_PROCESSORS];
+} typedef reduce_tree;
+
+static uint64_t reduce_combine( uint8_t op, uint64_t a, uint64_t b )
+{
+  int64_t la = (int64_t) a, lb = (int64_t) b;
+  double da = *(double*) &a, db = *(double*) &b, d;
+
+  switch( op )
+  {
+    case REDUCE_SUML:
+      return la + lb;
+    case REDUCE_MINL:
+      return la < lb ? a : b;
+    case REDUCE_MAXL:
+      return la > lb ? a : b;
+    case REDUCE_SUMD:
+      d = da + db;
+      return *(uint64_t*) &d;
+    case REDUCE_MIND:
+      return da < db ? a : b;
+    case REDUCE_MAXD:
+      return da > db ? a : b;
+  }
+  return 0;
+}
+
+/*
+ * reduce_insert
+ *
+ * Adds the value of leaf i to the tree, combining upwards for as long as
+ * the sibling at each level is already there. Returns 1 and sets *root
+ * once the last leaf completes the tree.
+ */
+static int reduce_insert( reduce_tree *t, uint32_t n, uint8_t op,
+                          uint32_t i, uint64_t v, uint64_t *root )
+{
+  uint32_t l = 0;
+  uint32_t cnt = n;
+
+  while( cnt > 1 )
+  {
+    uint32_t sib = i ^ 1;
+    if( sib < cnt )
+    {
+      if( !t->have[l][sib] )
+      {
+        t->val[l][i] = v;
+        t->have[l][i] = 1;
+        return 0;
+      }
+      v = (i & 1) ? reduce_combine( op, t->val[l][sib], v ) :
+                    reduce_combine( op, v, t->val[l][sib] );
+    }
+    i >>= 1;
+    l++;
+    cnt = (cnt + 1) / 2;
+  }
+  *root = v;
+  return 1;
+}
+
+/*
+ * do_reduce
+ *
+ * C function implementation of the reduce opcode. Joins the n processors
+ * in proc_ids, folding each return value into the tree as soon as that
+ * processor finishes rather than joining them in order, and puts the
+ * combined value in *ret_val.
+ */
+int do_reduce( uint64_t *proc_ids, uint32_t n, uint8_t op,
+               uint64_t *ret_val )
+{
+  reduce_tree t;
+  xpvm_proc *p[XPVM_MAX_PROCESSORS];
+  uint32_t left = n;
+  uint32_t i, j;
+  uint32_t s;
+  uint64_t v;
+
+  memset( t.have, 0, sizeof(t.have) );
+  for( i = 0; i < n; i++ )
+  {
+    if( !(p[i] = proc_lookup( proc_ids[i] )) )
+      EXIT_WITH_ERROR("Error: reduce of unknown processor %" PRIu64 "\n",
+                      proc_ids[i] );
+    for( j = 0; j < i; j++ )
+      if( p[j] == p[i] )
+        EXIT_WITH_ERROR("Error: processor %" PRIu64 " given twice to reduce\n",
+                        proc_ids[i] );
+  }
+
+  while( left )
+  {
+    s = __atomic_load_n( &proc_exit_seq, __ATOMIC_ACQUIRE );
+    for( i = 0; i < n; i++ )
+    {
+      if( !p[i] || !proc_done( p[i] ) )
+        continue;
+      proc_reap( p[i], &v );
+      reduce_insert( &t, n, op, i, v, ret_val );
+      p[i] = NULL;
+      left--;
+    }
+    if( left )
+      futex_wait( &proc_exit_seq, s );
   }
-  *ret_val = (uint64_t) CAST_INT ret;
-  //free( pt );
 
   return 0;
 }
@@ -402,10 +725,450 @@ void test_block_macros( uint64_t ptr_as_int )
 }
 
 /*
- * fetch_execute
+ * parfor_run
  *
- * Get the next instruction and execute it.
+ * Runs processor p's share of a parfor. With a static schedule that is
+ * the idx'th of nprocs contiguous ranges, with a dynamic one it takes
+ * chunk sized ranges off the shared counter until the range is used up.
+ * Each range is one call of the work function with its bounds in
+ * registers 1 and 2 and the extra arguments from register 3 on.
+ */
+static void parfor_run( parfor_info *pf, xpvm_proc *p, uint32_t idx )
+{
+  uint64_t reg[NUM_REGS];
+  int64_t start, end, ret_val;
+  int64_t n = pf->hi - pf->lo;
+  int i;
+
+  if( !pf->chunk )
+  {
+    start = pf->lo + (n / pf->nprocs) * idx +
+            (idx < n % pf->nprocs ? idx : n % pf->nprocs);
+    end = start + n / pf->nprocs + (idx < n % pf->nprocs);
+  }
+  else
+  {
+    start = __atomic_fetch_add( &pf->next, pf->chunk, __ATOMIC_RELAXED );
+    end = start + pf->chunk < pf->hi ? start + pf->chunk : pf->hi;
+  }
+
+  while( start < end )
+  {
+    reg[0] = 0;
+    reg[1] = start;
+    reg[2] = end;
+    for( i = 0; i < pf->argc; i++ )
+      reg[i+3] = pf->args[i];
+    if( interp( p, reg, pf->work, &ret_val ) != 0 )
+      EXIT_WITH_ERROR("Error: parfor work function did not return\n");
+
+    if( !pf->chunk )
+      break;
+    start = __atomic_fetch_add( &pf->next, pf->chunk, __ATOMIC_RELAXED );
+    end = start + pf->chunk < pf->hi ? start + pf->chunk : pf->hi;
+  }
+}
+
+/*
+ * parfor_thread
+ *
+ * Thread start routine for the helper processors of a parfor.
+ */
+static void *parfor_thread( void *v )
+{
+  parfor_worker *w = (parfor_worker*)v;
+
+  cur_proc = w->proc;
+  affinity_apply( w->proc );
+  sample_thread_start( w->proc );
+  TIMELINE( w->proc, TIMELINE_RUN_BEGIN, (uint64_t) CAST_INT w->info->work );
+  parfor_run( w->info, w->proc, w->idx );
+  TIMELINE( w->proc, TIMELINE_RUN_END, 0 );
+  sample_thread_stop( w->proc );
+  proc_exit( w->proc );
+  return NULL;
+}
+
+/*
+ * do_parfor
  *
+ * C function implementation of the parfor opcode. Runs the work function
+ * over [lo, hi) on up to nprocs processors, the calling one included,
+ * and returns once every range is done. nprocs of 0 means one per online
+ * CPU. A chunk of 0 splits the range evenly up front, otherwise the
+ * processors repeatedly take the next chunk iterations from a shared
+ * counter. Fewer processors are used if not enough ids are free. Returns
+ * the number of processors that took part.
+ */
+int do_parfor( xpvm_proc *self, int64_t lo, int64_t hi, uint64_t nprocs,
+               int64_t chunk, uint64_t work, int argc, uint64_t *args )
+{
+  parfor_info pf;
+  parfor_worker w[XPVM_MAX_PROCESSORS];
+  uint32_t i;
+
+  if( hi <= lo )
+    return 0;
+  if( !nprocs )
+    nprocs = sysconf( _SC_NPROCESSORS_ONLN );
+  if( chunk < 0 )
+    chunk = 0;
+  if( !chunk && nprocs > hi - lo )
+    nprocs = hi - lo;
+  if( chunk && nprocs > (hi - lo + chunk - 1) / chunk )
+    nprocs = (hi - lo + chunk - 1) / chunk;
+  if( nprocs > XPVM_MAX_PROCESSORS )
+    nprocs = XPVM_MAX_PROCESSORS;
+  if( argc > XPVM_PARFOR_MAX_ARGS )
+    argc = XPVM_PARFOR_MAX_ARGS;
+
+  pf.lo = lo;
+  pf.hi = hi;
+  pf.chunk = chunk;
+  pf.next = lo;
+  pf.work = (uint8_t*) CAST_INT work;
+  pf.argc = argc;
+  memcpy( pf.args, args, argc * sizeof(uint64_t) );
+
+  /* Claim the helpers before starting any of them, the static schedule
+   * needs to know how many there are. */
+  for( i = 1; i < nprocs; i++ )
+  {
+    w[i].info = &pf;
+    w[i].idx = i;
+    if( !(w[i].proc = proc_try_alloc()) )
+      break;
+  }
+  pf.nprocs = nprocs = i;
+
+  for( i = 1; i < nprocs; i++ )
+  {
+    if (pthread_create(&w[i].proc->thread, NULL, parfor_thread,
+                       (void *) &w[i]) != 0)
+    {
+      perror("error in thread create");
+      exit(-1);
+    }
+  }
+
+  parfor_run( &pf, self, 0 );
+
+  for( i = 1; i < nprocs; i++ )
+  {
+    if (pthread_join(w[i].proc->thread, NULL) != 0)
+    {
+      perror("error in thread join");
+      exit(-1);
+    }
+    proc_free( w[i].proc );
+  }
+
+  return nprocs;
+}
+
+/*
+ * opcode_name
+ *
+ * Name of an opcode from the opcode table, for reports.
+ */
+const char *opcode_name( uint32_t op )
+{
+  if( op > MAX_OPCODE_XPVM )
+    return "?";
+  return opcodes[op].opcode;
+}
+
+static safepoint_hook safepoint_hooks[XPVM_MAX_SAFEPOINT_HOOKS];
+static uint32_t num_safepoint_hooks = 0;
+
+/*
+ * safepoint_add_hook
+ *
+ * Adds a function to be called at every safepoint of every processor.
+ * Returns 0 on success or -1 if there are too many hooks already.
+ */
+int safepoint_add_hook( safepoint_hook h )
+{
+  int r = -1;
+
+  pthread_mutex_lock( &procs_mu );
+  if( num_safepoint_hooks < XPVM_MAX_SAFEPOINT_HOOKS )
+  {
+    safepoint_hooks[num_safepoint_hooks] = h;
+    __atomic_store_n( &num_safepoint_hooks, num_safepoint_hooks + 1,
+                      __ATOMIC_RELEASE );
+    r = 0;
+  }
+  pthread_mutex_unlock( &procs_mu );
+  return r;
+}
+
+static xpvm_report reports[XPVM_MAX_REPORTS];
+static uint32_t num_reports = 0;
+
+/* Writes every report each time SIGUSR1 comes in */
+static void *report_thread( void *v )
+{
+  uint32_t i, n;
+  sigset_t set;
+  int sig;
+
+  sigemptyset( &set );
+  sigaddset( &set, SIGUSR1 );
+  while( !sigwait( &set, &sig ) )
+  {
+    n = __atomic_load_n( &num_reports, __ATOMIC_ACQUIRE );
+    for( i = 0; i < n; i++ )
+      reports[i]();
+  }
+  return NULL;
+}
+
+/*
+ * report_add
+ *
+ * Has fn called on SIGUSR1 and at exit. Called by main before any
+ * processor starts; the first call blocks SIGUSR1, which the processors
+ * then inherit, and starts the thread which takes it. Returns 0, or -1
+ * if there are too many reports or the thread cannot be started.
+ */
+int report_add( xpvm_report fn )
+{
+  pthread_t tid;
+  sigset_t set;
+  int r = -1;
+
+  pthread_mutex_lock( &procs_mu );
+  if( num_reports < XPVM_MAX_REPORTS )
+  {
+    r = 0;
+    if( !num_reports )
+    {
+      sigemptyset( &set );
+      sigaddset( &set, SIGUSR1 );
+      if( pthread_sigmask( SIG_BLOCK, &set, NULL ) ||
+          pthread_create( &tid, NULL, report_thread, NULL ) )
+        r = -1;
+      else
+        pthread_detach( tid );
+    }
+    if( !r )
+    {
+      reports[num_reports] = fn;
+      __atomic_store_n( &num_reports, num_reports + 1, __ATOMIC_RELEASE );
+      atexit( fn );
+    }
+  }
+  pthread_mutex_unlock( &procs_mu );
+  return r;
+}
+
+/*
+ * safepoint_request
+ *
+ * Makes processor p stop at a safepoint at its next backward branch or
+ * call. Safe to call from any thread or from a signal handler.
+ */
+void safepoint_request( xpvm_proc *p )
+{
+  __atomic_store_n( &p->budget, 0, __ATOMIC_RELAXED );
+}
+
+/*
+ * safepoint
+ *
+ * Called by the interpreter between instructions once p has used up its
+ * budget. Runs the safepoint hooks; the caller decides whether to
+ * preempt.
+ */
+static void safepoint( xpvm_proc *p, unsigned int pid, uint64_t *reg,
+                       stack_frame *stack )
+{
+  uint32_t i, n = __atomic_load_n( &num_safepoint_hooks, __ATOMIC_ACQUIRE );
+
+  p->safepoints++;
+  for( i = 0; i < n; i++ )
+    safepoint_hooks[i]( p, pid, reg, stack );
+}
+
+/*
+ * interp_enter
+ *
+ * Pushes the first frame for a call of function block b and points the
+ * registers at it. The caller loads the arguments into reg.
+ */
+stack_frame *interp_enter( xpvm_proc *p, uint64_t *reg, uint8_t *b )
+{
+  stack_frame *stack = frame_alloc( p, BLOCK_FRAME_SIZE( b ) );
+
+  reg[BLOCK_REG] = (uint64_t) CAST_INT block_ptr;
+  PCX = (uint64_t) CAST_INT b;
+  CIB = (uint64_t) CAST_INT b;
+  CIO = 0;
+  reg[STACK_FRAME_REG] = (uint64_t) CAST_INT stack->block;
+  return stack;
+}
+
+/*
+ * interp_run
+ *
+ * The fetch/execute cycle. Runs on processor p as pid until the
+ * outermost frame returns, in which case it returns the status of the
+ * final opcode and sets *ret_val to the value returned. If budget is
+ * nonzero it also stops at the first safepoint, after that many backward
+ * branches and calls, or when an opcode asks to yield, and returns
+ * XPVM_YIELD with the state left in reg and *stackp to be resumed later.
+ * Otherwise safepoints come every XPVM_BUDGET and a yield just gives up
+ * the CPU.
+ */
+int interp_run( xpvm_proc *p, unsigned int pid, uint64_t *reg,
+                stack_frame **stackp, int32_t budget, int64_t *ret_val )
+{
+  stack_frame *stack = *stackp;
+  xpvm_trace *trace = trace_get( p );
+  xpvm_trace_rec *trace_rec = NULL;
+#if PROFILE_XPVM
+  xpvm_prof *prof = prof_get( p );
+  uint32_t prof_blk;
+  uint64_t prof_t0;
+#endif
+
+  p->budget = budget ? budget : XPVM_BUDGET;
+  p->reg = reg;
+
+  while (1)
+  {
+    // fetch
+    uint8_t *pc = ((uint8_t *) CAST_INT CIB) + CIO;
+    uint8_t c1 = pc[0];
+    uint8_t c2 = pc[1];
+    uint8_t c3 = pc[2];
+    uint8_t c4 = pc[3];
+    if( trace )
+      TRACE_BEGIN( trace, trace_rec, pid, reg, pc );
+
+    // update PC
+    if( CIO + 4 > BLOCK_LENGTH( (uint8_t *) CAST_INT CIB ) )
+      EXIT_WITH_ERROR("Error: Instructions over ran CIB in fetch_execute!\n");
+    CIO += 4;
+    p->insns++;
+
+    // execute
+    uint32_t opcode = c1;
+    if (opcode > MAX_OPCODE_XPVM || opcode < MIN_OPCODE_XPVM )
+    {
+      *stackp = stack;
+      return XPVM_ILLEGAL_INSTRUCTION;
+    }
+
+    if (!opcodes[opcode].formatFunc )
+      EXIT_WITH_ERROR("Error: opcode %d not implemented or not valid\n", 
+                      opcode );
+
+#if PROFILE_XPVM
+    prof_blk = PROF_BLOCK( prof, (uint8_t*) CAST_INT CIB );
+    prof->op_count[opcode]++;
+    prof->blk_count[prof_blk]++;
+    prof->pair_count[prof->last_op << 8 | opcode]++;
+    prof->last_op = opcode;
+    prof_t0 = --prof->countdown ? 0 : prof_ticks();
+#endif
+
+    int32_t ret = opcodes[opcode].formatFunc(pid, reg, &stack,
+                                                 c1, c2, c3, c4 );
+    if( trace )
+      TRACE_END( trace, trace_rec, reg );
+#if PROFILE_XPVM
+    if( prof_t0 )
+    {
+      prof_t0 = (prof_ticks() - prof_t0) * prof->interval;
+      prof->op_cycles[opcode] += prof_t0;
+      prof->blk_cycles[prof_blk] += prof_t0;
+      prof->interval = prof->countdown = PROF_NEXT_INTERVAL( prof );
+    }
+#endif
+    if (ret == 1)
+    {
+      /* Nothing to do for most instructions */
+    }
+    else if (ret == XPVM_SAFEPOINT)
+    {
+      safepoint( p, pid, reg, stack );
+      if( budget )
+      {
+        *stackp = stack;
+        return XPVM_YIELD;
+      }
+      p->budget = XPVM_BUDGET;
+    }
+    else if (ret <= 0)
+    {
+      /* Check if ret was called */
+      if( RET_OPCODE == opcode )
+      {
+        *ret_val = reg[stack->ret_reg];
+        stack_frame *old_frame = stack;
+        stack = stack->prev;
+        frame_free( p, old_frame );
+      }
+      *stackp = stack;
+      return ret;
+    }
+    else if (ret == 2)
+    {
+      /*Uncaught exception*/
+      EXIT_WITH_ERROR("Error: uncaught exception\n");
+    }
+    else if (ret == XPVM_YIELD)
+    {
+      if( budget )
+      {
+        *stackp = stack;
+        return XPVM_YIELD;
+      }
+      sched_yield();
+    }
+    else
+      EXIT_WITH_ERROR("Error: Unexpected return value from formatFunc"
+                      " in fetch_execute\n");
+  }
+  
+  /* won't reach here */
+  return 0;
+}
+
+/*
+ * interp
+ *
+ * Runs the function block b on processor p until it returns. The caller
+ * loads the arguments into reg beforehand. parfor runs one inside an
+ * opcode, so the register bank and budget of the run it interrupted are
+ * put back afterwards.
+ */
+static int interp( xpvm_proc *p, uint64_t *reg, uint8_t *b, int64_t *ret_val )
+{
+  stack_frame *stack = interp_enter( p, reg, b );
+  uint64_t *outer_reg = p->reg;
+  int32_t outer_budget = p->budget;
+  int32_t left;
+  int status;
+
+  status = interp_run( p, p->id, reg, &stack, 0, ret_val );
+  p->reg = outer_reg;
+  /* Never raise it, that would lose a safepoint_request made meanwhile */
+  left = __atomic_load_n( &p->budget, __ATOMIC_RELAXED );
+  while( left > outer_budget &&
+         !__atomic_compare_exchange_n( &p->budget, &left, outer_budget, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    ;
+  return status;
+}
+
+/*
+ * fetch_execute
+ *
+ * Thread start routine for a processor. Sets up the registers with the
+ * arguments it was started with and runs its function block.
  */
 static void *fetch_execute(void *v)
 {
@@ -414,12 +1177,15 @@ static void *fetch_execute(void *v)
 #endif
   /*int i = 0;*/
   fe_args *args = (fe_args*)v;
+  xpvm_proc *p = args->proc;
   uint64_t *reg_bank = args->reg_bank;
   int argc = args->argc;
   uint64_t work = args->work;
-  unsigned int pid = pthread_self();
 
   free( args );
+  cur_proc = p;
+  affinity_apply( p );
+  sample_thread_start( p );
 
   int i = 0;
   int len = 0;
@@ -428,35 +1194,13 @@ static void *fetch_execute(void *v)
   uint64_t reg[NUM_REGS];
   reg[0] = 0;
   reg[1] = 0;
-  reg[BLOCK_REG] = (uint64_t) CAST_INT block_ptr;
   //test_block_macros( block_ptr[0] );
-  stack_frame *stack = calloc( 1, sizeof(stack_frame) );
-  if( !stack )
-    EXIT_WITH_ERROR("Error: malloc failed in fetch_execute");
-
   uint8_t *b = NULL;
   if( !work )
-    b = (uint8_t *) CAST_INT ((uint64_t*) CAST_INT reg[BLOCK_REG])[0];
+    b = (uint8_t *) CAST_INT block_ptr[0];
   else
     b = (uint8_t*) CAST_INT work;
 
-  if( 0 < BLOCK_FRAME_SIZE( b ) )
-  {
-    stack->block = calloc( BLOCK_FRAME_SIZE( b ) + BLOCK_HEADER_LENGTH, 
-                           sizeof(uint8_t) );
-    // FIXME: Throw OutOfMemory Exception
-    if( !stack->block )
-      EXIT_WITH_ERROR("Error: malloc failed in fetch_execute\n");
-    stack->block = stack->block + BLOCK_HEADER_LENGTH;
-    BLOCK_LENGTH( stack->block ) = BLOCK_FRAME_SIZE( b );
-  }
-
-  
-  PCX = (uint64_t) CAST_INT b;
-  CIB = (uint64_t) CAST_INT b;
-  CIO = 0;
-  reg[STACK_FRAME_REG] = (uint64_t) CAST_INT stack->block;
-
   /* FIXME */
   /* This currently only supports 10 args */
   /* If work is NULL, this was started from the command line */
@@ -491,90 +1235,107 @@ static void *fetch_execute(void *v)
     free( reg_bank );
   }
 
-  /* the processor ID is passed in */
-  /*int processorID = args->procNum;*/
-  ret_struct *r = calloc( 1, sizeof(ret_struct) );
-  if( !r )
-    EXIT_WITH_ERROR("Error: malloc failed in do_init_proc\n");
+  TIMELINE( p, TIMELINE_RUN_BEGIN, (uint64_t) CAST_INT b );
+  p->result.status = interp( p, reg, b, &p->result.ret_val );
+  TIMELINE( p, TIMELINE_RUN_END, 0 );
+  sample_thread_stop( p );
+  proc_exit( p );
+  return NULL;
+}
 
-  /* fetch/execute cycle */
-  while (1)
-  {
-#if TRACK_EXEC
-    fprintf( stderr, "------- start fetch/execute cycle -------\n");
-#endif
+/* Left out when the VM is linked into bench/microbench */
+#ifndef XPVM_NO_MAIN
 
-    // fetch
-    uint8_t *pc = ((uint8_t *) CAST_INT CIB) + CIO;
-    uint8_t c1 = pc[0];
-    uint8_t c2 = pc[1];
-    uint8_t c3 = pc[2];
-    uint8_t c4 = pc[3];
-#if TRACK_EXEC
-    uint32_t word = assemble_inst( ((unsigned char*) CAST_INT CIB) + CIO );
-    fprintf( stderr, "\tword: %08x\n", word );
-#endif
+/*
+ * write_stats
+ *
+ * Appends one line of JSON with the totals of the run to path, for make
+ * bench. loaded is when the object file was loaded and load_rss the peak
+ * RSS at that point. Counters of processors which are still running are
+ * read as they are.
+ */
+static void write_stats( const char *path, const char *obj_name,
+                         struct timespec *start, struct timespec *loaded,
+                         long load_rss )
+{
+  uint64_t insns = 0, calls = 0, allocs = 0, safepoints = 0;
+  struct timespec now;
+  struct rusage ru;
+  double wall, load;
+  int i, nprocs = 0;
+  FILE *fp;
 
-    // update PC
-    if( CIO + 4 > BLOCK_LENGTH( (uint8_t *) CAST_INT CIB ) )
-      EXIT_WITH_ERROR("Error: Instructions over ran CIB in fetch_execute!\n");
-    CIO += 4;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  wall = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+  load = (loaded->tv_sec - start->tv_sec) +
+         (loaded->tv_nsec - start->tv_nsec) / 1e9;
+  getrusage( RUSAGE_SELF, &ru );
+  for( i = 0; i < XPVM_MAX_PROCESSORS; i++ )
+  {
+    if( !procs[i].insns )
+      continue;
+    nprocs++;
+    insns += procs[i].insns;
+    calls += procs[i].calls;
+    allocs += procs[i].allocs;
+    safepoints += procs[i].safepoints;
+  }
 
-    // execute
-    uint32_t opcode = c1;
-#if TRACK_EXEC
-    fprintf( stderr, "\topcode: %d\n", opcode );
-#endif
-    if (opcode > MAX_OPCODE_XPVM || opcode < MIN_OPCODE_XPVM )
-    {
-      return  (void *) XPVM_ILLEGAL_INSTRUCTION;
-    }
+  if( !(fp = fopen( path, "a" )) )
+  {
+    perror( path );
+    return;
+  }
+  fprintf( fp, "{\"program\": \"%s\", \"wall_seconds\": %.6f, "
+               "\"instructions\": %" PRIu64 ", "
+               "\"instructions_per_second\": %.0f, \"peak_rss_kb\": %ld, "
+               "\"processors\": %d, \"calls\": %" PRIu64 ", "
+               "\"allocs\": %" PRIu64 ", \"safepoints\": %" PRIu64 ", "
+               "\"blocks\": %u, \"load_seconds\": %.6f, "
+               "\"load_rss_kb\": %ld}\n",
+           obj_name, wall, insns, wall > 0 ? insns / wall : 0.0,
+           ru.ru_maxrss, nprocs, calls, allocs, safepoints, block_cnt, load,
+           load_rss );
+  fclose( fp );
+}
 
-    if (!opcodes[opcode].formatFunc )
-      EXIT_WITH_ERROR("Error: opcode %d not implemented or not valid\n", 
-                      opcode );
+/*
+ * parse_size
+ *
+ * Reads a byte count with an optional k, m or g suffix, or returns 0 if
+ * s is not one.
+ */
+static uint64_t parse_size( const char *s )
+{
+  char *end;
+  uint64_t n = strtoull( s, &end, 10 );
 
-    int32_t ret = opcodes[opcode].formatFunc(pid, reg, &stack,
-                                                 c1, c2, c3, c4 );
-#if TRACK_EXEC
-    fprintf( stderr, "\tret: %d\n", ret );
-#endif
-    if (ret <= 0)
-    {
-      /* Check if ret was called */
-      if( RET_OPCODE == opcode )
-      {
-        r->ret_val = reg[stack->ret_reg];
-        stack_frame *old_frame = stack;
-        stack = stack->prev;
-        if( old_frame->block )
-          free( old_frame->block - BLOCK_HEADER_LENGTH );
-        //free( oldNode->data );
-        free( old_frame );
-      }
-      r->status = ret;
-      pthread_exit( (void*) CAST_INT r );
-      return (void *) CAST_INT ret;
-    }
-    else if (ret == 2)
-    {
-      /*Uncaught exception*/
-      EXIT_WITH_ERROR("Error: uncaught exception\n");
-    }
-    else if (ret != 1)
-      EXIT_WITH_ERROR("Error: Unexpected return value from formatFunc"
-                      " in fetch_execute\n");
-#if TRACK_EXEC
-    fprintf( stderr, "------- end fetch/execute cycle -------\n");
-#endif
+  if( end == s )
+    return 0;
+  switch( *end )
+  {
+    case 'g': case 'G':
+      n <<= 10;
+      /* fall through */
+    case 'm': case 'M':
+      n <<= 10;
+      /* fall through */
+    case 'k': case 'K':
+      n <<= 10;
+      end++;
   }
-  
-  /* won't reach here */
-  return 0;
+  return *end ? 0 : n;
 }
 
 /***************** main function ********************/
 
+#define XPVM_USAGE \
+  "Usage: xpvm [-a rr|compact|cpu,cpu,...] [-p profile_prefix]" \
+  " [-s|-S stacks_file] [-t trace_file]\n" \
+  "            [-A alloc_profile] [-L contention_profile] [-m heap_size]" \
+  " [-b stats_file]\n            [-M metrics_file [-i seconds]]" \
+  " [-T timeline_file] one_object_file.obj\n"
+
 int main( int argc, char **argv )
 {
   /* error for functions returning from XPVM */
@@ -583,27 +1344,97 @@ int main( int argc, char **argv )
   uint64_t obj_len = 0;
   ret_struct *r = NULL;
   /*uint64_t ret_val = 0;*/
-  void *ret = NULL;
   int i;
+  int opt;
+  char *obj_name;
+  char *prof_prefix = "xpvm_prof";
+  int sampling = 0;
+  char *stats_path = NULL;
+  char *metrics_path = NULL;
+  double metrics_every = 0;
+  uint64_t mem_size = XPVM_MEM_SIZE;
+  struct timespec start, loaded;
+  struct rusage ru;
 
-  if( argc != 2 )
-    EXIT_WITH_ERROR("Usage: xpvm one_object_file.obj\n");
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  while( (opt = getopt( argc, argv, "a:A:b:i:L:m:M:p:s:S:t:T:" )) != -1 )
+  {
+    switch( opt )
+    {
+      case 'A':
+        if( alloc_prof_init( optarg ) )
+          EXIT_WITH_ERROR("Error: could not start the allocation profile\n");
+        break;
+      case 'b':
+        stats_path = optarg;
+        break;
+      case 'i':
+        metrics_every = atof( optarg );
+        break;
+      case 'L':
+        if( contend_init( optarg ) )
+          EXIT_WITH_ERROR("Error: could not start the contention profile\n");
+        break;
+      case 'M':
+        metrics_path = optarg;
+        break;
+      case 'm':
+        if( !(mem_size = parse_size( optarg )) )
+          EXIT_WITH_ERROR("Error: bad heap size '%s'\n", optarg );
+        break;
+      case 's':
+      case 'S':
+        if( sample_init( optarg, 'S' == opt ) )
+          EXIT_WITH_ERROR("Error: could not start the sampling profiler\n");
+        sampling = 1;
+        break;
+      case 't':
+        if( trace_init( optarg ) )
+          EXIT_WITH_ERROR("Error: could not start tracing\n");
+        break;
+      case 'T':
+        if( timeline_init( optarg ) )
+          EXIT_WITH_ERROR("Error: could not start the timeline\n");
+        break;
+      case 'p':
+        if( !PROFILE_XPVM )
+          EXIT_WITH_ERROR("Error: -p needs a build with PROFILE_XPVM,"
+                          " see make BUILD=profile\n");
+        prof_prefix = optarg;
+        break;
+      case 'a':
+        if( affinity_init( optarg ) )
+          EXIT_WITH_ERROR("Error: bad affinity '%s', expected rr, compact"
+                          " or a list of cpus\n", optarg );
+        break;
+      default:
+        EXIT_WITH_ERROR(XPVM_USAGE);
+    }
+  }
+  if( optind != argc - 1 )
+    EXIT_WITH_ERROR(XPVM_USAGE);
+  obj_name = argv[optind];
+  if( metrics_path && metrics_init( metrics_path, metrics_every ) )
+    EXIT_WITH_ERROR("Error: could not start the metrics\n");
+  if( AFFINITY_NONE != xpvm_affinity )
+    affinity_report();
 
   regs[0] = 0;
   regs[1] = 0;
 
   pthread_mutex_init( &malloc_xpvm_mu, NULL );
+  vec_init();
 
   /* Initialize the allocator and the dynamic libraries */
   pthread_mutex_lock( &malloc_xpvm_mu );
-  malloc_xpvm_init( XPVM_MEM_SIZE );
+  malloc_xpvm_init( mem_size );
   load_native_funcs();
   pthread_mutex_unlock( &malloc_xpvm_mu );
 
-  if( verify_obj_format( argv[1], &obj_len ) != 0 )
+  if( verify_obj_format( obj_name, &obj_len ) != 0 )
     EXIT_WITH_ERROR("Error: Invalid of corrupt object file.\n");
 
-  if (!load_object_file(argv[1], &error_num, &block_cnt, &block_ptr))
+  if (!load_object_file(obj_name, &error_num, &block_cnt, &block_ptr))
     EXIT_WITH_ERROR("Error: load_object_file failed with error %d\n", error_num );
 
   patch_native_refs( native_ref_patches, block_ptr, block_cnt );
@@ -611,30 +1442,39 @@ int main( int argc, char **argv )
   blocks = NULL;
   for( i = 0; i < block_cnt; i++ )
     add_blk( &blocks, block_ptr[i] );
+  clock_gettime( CLOCK_MONOTONIC, &loaded );
+  getrusage( RUSAGE_SELF, &ru );
 
-  do_init_proc( &ptr, 0, 0, NULL );
+  if( PROFILE_XPVM || sampling || alloc_prof_on || contend_on ||
+      timeline_on )
+    prof_init();
 
-  pthread_t *pt = (pthread_t*) CAST_INT ptr;
+  do_init_proc( &ptr, 0, 0, NULL );
 
   /*do_proc_join( (uint64_t)(uint32_t)pt, &ret_val );*/
   /* Since this is the main process we need to return the whole struct
    * not just the 64 bit thing that it returned as its return value */
-  if (pthread_join(*pt, &ret) != 0)
+  if (pthread_join(procs[ptr].thread, NULL) != 0)
   {
     perror("error in thread join");
     exit(-1);
   }
 
-  r =  (ret_struct*)ret;
-  /*r = (ret_struct*) (uint32_t) ret;*/
+  r = &procs[ptr].result;
+
+  if( PROFILE_XPVM )
+    prof_dump( prof_prefix );
+  sample_dump();
+  if( stats_path )
+    write_stats( stats_path, obj_name, &start, &loaded, ru.ru_maxrss );
 
   /* For floats. */
   /*fprintf( stderr, "r->ret_val: %1.8lf\n", *(double*)&(r->ret_val) );*/
   /*fprintf( stderr, "r->ret_val: %lld\n", (uint64_t)r->ret_val );*/
   /*fprintf( stderr, "r->status: %d\n", (int)r->status );*/
 
-  /* FIXME: Double free when running with multiple processors */
-  /*free( r );*/
 
   return 0;
 }
+
+#endif /* XPVM_NO_MAIN */
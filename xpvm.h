@@ -15,11 +15,18 @@
 #include <inttypes.h>
 
 #include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
 
 /*************************** Macros ********************************/
 
 #define DEBUG_XPVM  0
-#define TRACK_EXEC  0
+
+/* Set to 1 by make BUILD=profile, see prof.c */
+#ifndef PROFILE_XPVM
+#define PROFILE_XPVM 0
+#endif
 
 #define MAX_REGS      256
 #define HIDDEN_REGS   4
@@ -99,7 +106,7 @@
 } while(0)
 
 // maximum number of processors
-#define XPVM_MAX_PROCESSORS 16
+#define XPVM_MAX_PROCESSORS 64
 
 // error codes for load_object_file
 #define XPVM_FILE_NOT_FOUND -1
@@ -114,6 +121,13 @@
 #define XPVM_ADDRESS_OUT_OF_RANGE -2
 #define XPVM_ILLEGAL_INSTRUCTION -3
 
+/* Returned by an opcode which wants the processor to give up the CPU,
+ * and by interp_run when it stops a task to be resumed later. */
+#define XPVM_YIELD 3
+
+/* Returned by a backward branch or call which used up the budget */
+#define XPVM_SAFEPOINT 4
+
 /****************** Public Interface Functions **********************/
 
 /* obj_file.c */
@@ -126,6 +140,7 @@ int do_init_proc( uint64_t *proc_id, uint64_t work, int argc,
                  uint64_t *reg_bank );
 int do_proc_join( uint64_t proc_id, uint64_t *ret_val );
 int do_join2( uint64_t proc_id, uint64_t *ret_val );
+uint32_t do_join_any( uint64_t *proc_ids, uint32_t n, uint64_t *ret_val );
 
 uint64_t malloc_xpvm_native( uint32_t bytes );
 
@@ -145,8 +160,382 @@ struct _stack_frame
   uint64_t      payload;
   struct _stack_frame *prev;
   uint8_t     *block;
+  /* Allocation backing block, kept when the frame is recycled */
+  uint8_t     *block_mem;
+  uint32_t    block_cap;
 } typedef stack_frame;
 
+/*
+ * Struct for passing back the exit status and return value
+ * of a processor (thread)i from doJoin.
+ */
+struct _ret_struct
+{
+  int status;
+  int64_t ret_val;
+} typedef ret_struct;
+
+/*
+ * Per processor state. Processors are numbered densely from 0 by the VM
+ * and the id indexes the procs table, so anything a processor needs for
+ * itself lives here rather than behind a lock.
+ */
+#define PROC_FREE     0
+#define PROC_RUNNING  1
+#define PROC_DONE     2
+
+/* Allocations up to this size come from the processor's own chunk */
+#define XPVM_PROC_CACHE_MAX   256
+#define XPVM_PROC_CACHE_CHUNK 1024
+
+/*
+ * Profile counters of a processor, see prof.c. Blocks are counted by their
+ * index in block_ptr, with one extra slot for anything else.
+ */
+/* Average instructions between timed ones */
+#define XPVM_PROF_SAMPLE 64
+
+struct _xpvm_prof
+{
+  uint64_t      op_count[256];
+  uint64_t      op_cycles[256];
+  /* Indexed by previous opcode << 8 | opcode */
+  uint64_t      pair_count[256 * 256];
+  uint64_t      *blk_count;
+  uint64_t      *blk_cycles;
+  /* Block of the last instruction and its index */
+  uint8_t       *last_cib;
+  uint32_t      last_blk;
+  uint32_t      last_op;
+  /* Instructions until the next timed one, out of interval. The
+   * interval is random so that it does not line up with loops. */
+  uint32_t      countdown;
+  uint32_t      interval;
+  uint32_t      rng;
+} typedef xpvm_prof;
+
+/* Next sampling interval, uniform over XPVM_PROF_SAMPLE / 2 and up */
+#define PROF_NEXT_INTERVAL( pr ) (                                      \
+  (pr)->rng ^= (pr)->rng << 13, (pr)->rng ^= (pr)->rng >> 17,           \
+  (pr)->rng ^= (pr)->rng << 5,                                         \
+  XPVM_PROF_SAMPLE / 2 + (pr)->rng % XPVM_PROF_SAMPLE )
+
+/*
+ * Guest call stacks taken by the sampling profiler, see sample.c. Level 0
+ * is the innermost frame; each level is a block index as for the profile
+ * counters and the offset execution resumes at in that block.
+ */
+#define XPVM_SAMPLE_DEPTH 32
+#define XPVM_SAMPLE_HZ    997
+
+struct _xpvm_sample
+{
+  uint32_t      count;
+  uint32_t      depth;
+  uint32_t      blk[XPVM_SAMPLE_DEPTH];
+  uint32_t      off[XPVM_SAMPLE_DEPTH];
+} typedef xpvm_sample;
+
+struct _xpvm_samples
+{
+  pthread_mutex_t mu;
+  xpvm_sample   *s;
+  uint32_t      n;
+  uint32_t      cap;
+} typedef xpvm_samples;
+
+/*
+ * Trace ring of a processor, see trace.c. Only the processor writes it;
+ * head counts the records written so far.
+ */
+#define XPVM_TRACE_RECORDS 65536
+
+struct _xpvm_trace
+{
+  uint64_t      head;
+  uint32_t      proc;
+  xpvm_trace_rec *rec;
+} typedef xpvm_trace;
+
+/*
+ * Allocation profile of a processor, see alloc_prof.c. Allocations are
+ * counted by kind, by power of two size class and by the instruction
+ * which made them, an alloc_blk or the calln of a native. Sizes are as
+ * asked for; heap is what they took with headers and rounding.
+ */
+#define ALLOC_SHARED      0
+#define ALLOC_PRIVATE     1
+#define ALLOC_NATIVE      2
+#define ALLOC_KINDS       3
+#define ALLOC_SIZES       33
+
+struct _xpvm_alloc_site
+{
+  uint64_t      cib;
+  uint32_t      cio;
+  uint32_t      kind;
+  uint64_t      count;
+  uint64_t      bytes;
+  uint64_t      heap;
+} typedef xpvm_alloc_site;
+
+struct _xpvm_alloc_prof
+{
+  pthread_mutex_t mu;
+  /* Open addressing on cib and cio */
+  xpvm_alloc_site *sites;
+  uint32_t      n;
+  uint32_t      cap;
+  uint64_t      kind_count[ALLOC_KINDS];
+  uint64_t      kind_bytes[ALLOC_KINDS];
+  uint64_t      kind_heap[ALLOC_KINDS];
+  uint64_t      size_count[ALLOC_SIZES];
+  uint64_t      size_bytes[ALLOC_SIZES];
+} typedef xpvm_alloc_prof;
+
+/*
+ * Block contention of a processor, see contend.c. Every block it has
+ * tried to aquire or has allocated, with the instruction which allocated
+ * it. Times are in prof_ticks.
+ */
+struct _xpvm_contend_blk
+{
+  uint64_t      b;
+  uint64_t      cib;
+  uint32_t      cio;
+  /* Bit for each processor which tried to aquire it */
+  uint64_t      procs;
+  uint64_t      attempts;
+  uint64_t      failures;
+  uint64_t      acquires;
+  uint64_t      wait_ticks;
+  uint64_t      hold_ticks;
+  /* When this processor last took the block, 0 once released */
+  uint64_t      held_since;
+} typedef xpvm_contend_blk;
+
+struct _xpvm_contend
+{
+  pthread_mutex_t mu;
+  /* Open addressing on b */
+  xpvm_contend_blk *blks;
+  uint32_t      n;
+  uint32_t      cap;
+} typedef xpvm_contend;
+
+/*
+ * Timeline of a processor, see timeline.c. Events are in prof_ticks and
+ * in the order the processor recorded them. flow links the creation of a
+ * processor to the start of its run.
+ */
+#define TIMELINE_RUN_BEGIN    0
+#define TIMELINE_RUN_END      1
+#define TIMELINE_CREATE       2
+#define TIMELINE_JOIN_BEGIN   3
+#define TIMELINE_JOIN_END     4
+#define TIMELINE_WAIT_BEGIN   5
+#define TIMELINE_WAIT_END     6
+
+/* Events a processor keeps before it starts dropping them */
+#define XPVM_TIMELINE_MAX     (1 << 20)
+
+struct _xpvm_timeline_ev
+{
+  uint64_t      ts;
+  uint64_t      arg;
+  uint32_t      kind;
+  uint32_t      flow;
+} typedef xpvm_timeline_ev;
+
+struct _xpvm_timeline
+{
+  pthread_mutex_t mu;
+  xpvm_timeline_ev *ev;
+  uint32_t      n;
+  uint32_t      cap;
+  uint64_t      dropped;
+  /* Flow of the creation the next run started from, or 0 */
+  uint32_t      flow;
+} typedef xpvm_timeline;
+
+struct _xpvm_proc
+{
+  uint32_t      id;
+  uint32_t      state;
+  pthread_t     thread;
+  /* Set when the processor returns, read by whoever joins it */
+  ret_struct    result;
+  /* Frames popped by ret, reused by the next call */
+  stack_frame   *free_frames;
+  /* Allocator cache, a chunk of the heap only this processor uses */
+  uint8_t       *alloc_next;
+  uint8_t       *alloc_end;
+  /* CPU and NUMA node the processor is pinned to, or -1 */
+  int32_t       cpu;
+  int32_t       node;
+  /* Backward branches and calls left before the next safepoint */
+  int32_t       budget;
+  /* Counters, only written by the processor itself */
+  uint64_t      insns;
+  uint64_t      calls;
+  uint64_t      allocs;
+  uint64_t      safepoints;
+  uint64_t      natives;
+  uint64_t      exceptions;
+  uint64_t      alloc_bytes;
+  /* Profile counters, only with PROFILE_XPVM */
+  xpvm_prof     *prof;
+  /* Sampling profiler, set by its timer signal and taken at a safepoint */
+  volatile int  sample_pending;
+  timer_t       sample_timer;
+  xpvm_samples  *samples;
+  /* Trace ring, when tracing is on */
+  xpvm_trace    *trace;
+  /* Allocation profile, when it is on */
+  xpvm_alloc_prof *alloc_prof;
+  /* Block contention, when it is on */
+  xpvm_contend  *contend;
+  /* Timeline, when it is on */
+  xpvm_timeline *timeline;
+  /* Registers of the code running, for natives to find their caller */
+  uint64_t      *reg;
+} typedef xpvm_proc;
+
+/* Blocks loaded from the object file and their names */
+extern uint32_t block_cnt;
+extern uint64_t *block_ptr;
+extern char **block_names;
+
+extern xpvm_proc procs[XPVM_MAX_PROCESSORS];
+extern __thread xpvm_proc *cur_proc;
+
+/* Bumped and woken by every processor as it finishes */
+extern uint32_t proc_exit_seq;
+
+xpvm_proc *proc_try_alloc( void );
+stack_frame *frame_alloc( xpvm_proc *p, uint32_t frame_size );
+void frame_free( xpvm_proc *p, stack_frame *f );
+int do_parfor( xpvm_proc *self, int64_t lo, int64_t hi, uint64_t nprocs,
+               int64_t chunk, uint64_t work, int argc, uint64_t *args );
+int do_reduce( uint64_t *proc_ids, uint32_t n, uint8_t op,
+               uint64_t *ret_val );
+stack_frame *interp_enter( xpvm_proc *p, uint64_t *reg, uint8_t *b );
+int interp_run( xpvm_proc *p, unsigned int pid, uint64_t *reg,
+                stack_frame **stackp, int32_t budget, int64_t *ret_val );
+
+/*
+ * Safepoints. Instead of checking for anything between every pair of
+ * instructions, backward branches and calls count down the processor's
+ * budget and the interpreter stops at a safepoint when it runs out. At
+ * that point the registers and frames are consistent, so hooks added with
+ * safepoint_add_hook can look at them, and a task is preempted.
+ * safepoint_request makes a processor stop at its next backward branch
+ * or call. It may rarely be lost to a racing decrement, in which case
+ * the processor stops when the budget runs out as usual.
+ */
+#define XPVM_BUDGET               10000
+#define XPVM_MAX_SAFEPOINT_HOOKS  8
+
+typedef void (*safepoint_hook)( xpvm_proc *p, unsigned int pid,
+                                uint64_t *reg, stack_frame *stack );
+
+int safepoint_add_hook( safepoint_hook h );
+void safepoint_request( xpvm_proc *p );
+
+/*
+ * Reports, such as the allocation profile, written whenever the VM gets
+ * SIGUSR1 and once more at exit. The signal is blocked in the processors
+ * and taken by a thread of its own with sigwait, so a report can use
+ * stdio and locks and never interrupts the interpreter.
+ */
+#define XPVM_MAX_REPORTS          8
+
+typedef void (*xpvm_report)( void );
+
+int report_add( xpvm_report fn );
+
+#define SAFEPOINT_POLL() ({                                             \
+  int32_t __b = __atomic_load_n( &cur_proc->budget, __ATOMIC_RELAXED ) - 1; \
+  __atomic_store_n( &cur_proc->budget, __b, __ATOMIC_RELAXED );         \
+  __b > 0 ? 1 : XPVM_SAFEPOINT;                                         \
+})
+
+/*
+ * Tasks, see sched.c. A task is a lightweight processor with its own
+ * register bank and frame stack but no thread of its own. Tasks are run
+ * a slice at a time by a pool of carrier processors and switched when
+ * they yield, block or reach a safepoint, which gives a slice of
+ * XPVM_TASK_SLICE backward branches and calls. Task ids follow on from the
+ * processor ids, so owner words and join work the same for both.
+ */
+#define XPVM_MAX_TASKS    (1 << 20)
+#define XPVM_TASK_SLICE   10000
+/* Carriers take processor ids for good, so most are left for init_proc */
+#define XPVM_MAX_CARRIERS (XPVM_MAX_PROCESSORS / 4)
+
+/* State of a finished task claimed by the join that frees it */
+#define TASK_REAPED       3
+
+#define IS_TASK_ID( id )  ((id) >= XPVM_MAX_PROCESSORS)
+#define TASK_ID( idx )    ((idx) + XPVM_MAX_PROCESSORS)
+#define TASK_IDX( id )    ((id) - XPVM_MAX_PROCESSORS)
+
+struct _xpvm_task
+{
+  uint32_t      id;
+  uint32_t      state;
+  uint32_t      detached;
+  uint32_t      join_waiters;
+  /* Run queue, parking bucket or free list link */
+  struct _xpvm_task *next;
+  /* Set by TASK_BLOCK, and the key it is parking on and the bucket
+   * sequence number when it started to */
+  uint32_t      blocked;
+  uint32_t      park_seq;
+  uint64_t      park_key;
+  /* Function block, entered the first time the task is run */
+  uint8_t       *work;
+  stack_frame   *stack;
+  /* Monitor being waited on and its sequence number at the time */
+  uint8_t       *wait_blk;
+  uint32_t      wait_seq;
+  /* Barrier arrived at and its generation at the time */
+  struct _xpvm_barrier *wait_bar;
+  uint32_t      wait_gen;
+  ret_struct    result;
+  uint64_t      reg[NUM_REGS];
+} typedef xpvm_task;
+
+extern __thread xpvm_task *cur_task;
+
+/* Id of whatever is executing on this thread, task or processor */
+#define CUR_PID ( cur_task ? cur_task->id : cur_proc->id )
+
+/*
+ * Backs the current task up to retry its opcode and yields. A task that
+ * parked itself first runs again once it is unparked, any other after the
+ * tasks that are runnable.
+ */
+#define TASK_BLOCK() ({ cur_task->blocked = 1; CIO -= 4; XPVM_YIELD; })
+
+uint64_t task_spawn( uint64_t work, int argc, uint64_t *args, int detached );
+int task_join( uint64_t id, uint64_t *ret_val, int block );
+int task_lock( uint8_t *b, uint32_t pid );
+int task_wait( xpvm_task *t, uint8_t *b, uint32_t pid );
+void task_park_prepare( xpvm_task *t, uint64_t key );
+void task_park_cancel( xpvm_task *t );
+void task_unpark( uint64_t key, int all );
+
+/*
+ * Operators of the reduce opcode.
+ */
+#define REDUCE_SUML   0
+#define REDUCE_MINL   1
+#define REDUCE_MAXL   2
+#define REDUCE_SUMD   3
+#define REDUCE_MIND   4
+#define REDUCE_MAXD   5
+
 uint32_t num_native_funcs;
 
 struct native_func_table {
@@ -157,6 +546,7 @@ struct native_func_table {
 native_func_table *native_funcs;
 
 int get_native_func_ind( const char * );
+int load_native_funcs( void );
 
 struct native_ref_patch {
   uint64_t offset;
@@ -186,6 +576,7 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
  * at a negative index where the headers are stored and evaluate
  * to the requested header info.
  */
+/* Owner tag of the owning processor, or 0 if the block is free */
 #define BLOCK_OWNER( b ) *(uint64_t*)(b - 8)
 #define BLOCK_CHAIN( b ) *(uint64_t*)(b - 16)
 #define BLOCK_ANNOTS( b ) *(uint64_t*)(b - 24)
@@ -197,8 +588,18 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 #define BLOCK_NATIVE_REFS( b ) *(uint64_t*)(b - 44)
 #define BLOCK_FRAME_SIZE( b ) *(uint32_t*)(b - 48)
 #define BLOCK_LENGTH( b ) *(uint32_t*)(b - 52)
+/* Monitor state, see sync.c */
+#define BLOCK_MON_LOCK( b ) *(uint32_t*)(b - 56)
+#define BLOCK_MON_SEQ( b ) *(uint32_t*)(b - 60)
+#define BLOCK_MON_HOLDER( b ) *(uint32_t*)(b - 64)
+
+#define BLOCK_HEADER_LENGTH 64
 
-#define BLOCK_HEADER_LENGTH 52
+/*
+ * Processor ids start at 0, so the owner and monitor holder fields store
+ * the id plus one to keep 0 meaning nobody.
+ */
+#define OWNER_TAG( pid ) ((pid) + 1)
 
 /*
  * Macros defining masks used in checking annotations
@@ -213,6 +614,7 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 #define OWNED_MASK        0x0000000000000008
 #define PRIVATE_MASK      0x0000000000000010 
 #define VOLATILE_MASK     0x0000000000000020 
+#define SEQ_CST_MASK      0x0000000000000040
 
 /*
  * Macros for native function API memory checking
@@ -226,21 +628,24 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 #define CHECK_OWNED( b ) OWNED_MASK & BLOCK_ANNOTS( b )
 #define CHECK_FREE( b ) !(OWNED_MASK & BLOCK_ANNOTS( b ))
 #define CHECK_VOLATILE( b ) VOLATILE_MASK & BLOCK_ANNOTS( b )
+#define CHECK_SEQ_CST( b ) SEQ_CST_MASK & BLOCK_ANNOTS( b )
 #define CHECK_OWNED_VOLATILE(b) CHECK_OWNED(b) && CHECK_VOLATILE(b)
 #define CHECK_FREE_VOLATILE(b) CHECK_FREE(b) && CHECK_VOLATILE(b)
+#define MONITOR_HOLDER( b ) \
+  __atomic_load_n( &BLOCK_MON_HOLDER( b ), __ATOMIC_RELAXED )
 
 #if CHECKS
 /*
  * Macros for checking annotations
  */
 #define CHECK_READ_ANNOTS( pid, b ) do {                        \
-  if( CHECK_PRIVATE(b) && !(pid == BLOCK_OWNER(b)) ) {          \
+  if( CHECK_PRIVATE(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {          \
     DEBUG_PRINT("Error: proc %d attempted to read "             \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
     return process_exception( pid, reg, stack, ILLEGAL_MEMORY_OPERATION, 0);   \
   }                                                             \
-  if( CHECK_OWNED(b) && !(pid == BLOCK_OWNER(b)) ) {            \
+  if( CHECK_OWNED(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {            \
     DEBUG_PRINT("Error: proc %d attempted to read "             \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
@@ -255,13 +660,13 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 }while(0)
 
 #define CHECK_WRITE_ANNOTS( pid, b ) do {                       \
-  if( CHECK_PRIVATE(b) && !(pid == BLOCK_OWNER(b)) ) {          \
+  if( CHECK_PRIVATE(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {          \
     DEBUG_PRINT("Error: proc %d attempted to write "            \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
     return process_exception( pid, reg, stack, ILLEGAL_MEMORY_OPERATION, 0);   \
   }                                                             \
-  if( CHECK_OWNED(b) && !(pid == BLOCK_OWNER(b)) ) {            \
+  if( CHECK_OWNED(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {            \
     DEBUG_PRINT("Error: proc %d attempted to write "            \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
@@ -276,12 +681,12 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 }while(0)
 
 #define CHECK_READ_ANNOTS_NATIVE( pid, b ) do {                 \
-  if( CHECK_PRIVATE(b) && !(pid == BLOCK_OWNER(b)) ) {          \
+  if( CHECK_PRIVATE(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {          \
     EXIT_WITH_ERROR("Error: proc %d attempted to read "             \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
   }                                                             \
-  if( CHECK_OWNED(b) && !(pid == BLOCK_OWNER(b)) ) {            \
+  if( CHECK_OWNED(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {            \
     EXIT_WITH_ERROR("Error: proc %d attempted to read "             \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
@@ -294,12 +699,12 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 }while(0)
 
 #define CHECK_WRITE_ANNOTS_NATIVE( pid, b ) do {                \
-  if( CHECK_PRIVATE(b) && !(pid == BLOCK_OWNER(b)) ) {          \
+  if( CHECK_PRIVATE(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {          \
     EXIT_WITH_ERROR("Error: proc %d attempted to write "            \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
   }                                                             \
-  if( CHECK_OWNED(b) && !(pid == BLOCK_OWNER(b)) ) {            \
+  if( CHECK_OWNED(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {            \
     EXIT_WITH_ERROR("Error: proc %d attempted to write "            \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
@@ -334,7 +739,7 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
                     pid, b );                                   \
     return process_exception( pid, reg, stack, NOT_THE_OWNER, 0);   \
   }                                                             \
-  if( CHECK_OWNED(b) && !(pid == BLOCK_OWNER(b)) ) {            \
+  if( CHECK_OWNED(b) && !(OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {            \
     DEBUG_PRINT("Error: proc %d attempted to realse "           \
                     "block %p illegally\n",                     \
                     pid, b );                                   \
@@ -348,7 +753,7 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
                     b);                                         \
     return process_exception( pid, reg, stack, BAD_BLOCK_ID, 0);   \
   }                                                             \
-  if( CHECK_OWNED(b) && (pid == BLOCK_OWNER(b)) ) {             \
+  if( CHECK_OWNED(b) && (OWNER_TAG(pid) == BLOCK_OWNER(b)) ) {             \
     DEBUG_PRINT("Error: proc %d already owns block %p\n",       \
                     pid, b );                                   \
     return process_exception( pid, reg, stack, ALREADY_OWNER, 0);   \
@@ -361,6 +766,31 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
   }                                                             \
 } while(0)
 
+#define CHECK_LOCK_ANNOTS( pid, b ) do {                        \
+  if( ! valid_bid((u64)b) ) {                                   \
+    DEBUG_PRINT("Error: %p is not a valid block\n",             \
+                    b);                                         \
+    return process_exception( pid, reg, stack, BAD_BLOCK_ID, 0);   \
+  }                                                             \
+  if( OWNER_TAG(pid) == MONITOR_HOLDER(b) ) {                              \
+    DEBUG_PRINT("Error: proc %d already holds monitor %p\n",    \
+                    pid, b );                                   \
+    return process_exception( pid, reg, stack, ALREADY_OWNER, 0);   \
+  }                                                             \
+} while(0)
+
+#define CHECK_MONITOR_ANNOTS( pid, b ) do {                     \
+  if( ! valid_bid((u64)b) ) {                                   \
+    DEBUG_PRINT("Error: %p is not a valid block\n",             \
+                    b);                                         \
+    return process_exception( pid, reg, stack, BAD_BLOCK_ID, 0);   \
+  }                                                             \
+  if( !(OWNER_TAG(pid) == MONITOR_HOLDER(b)) ) {                           \
+    DEBUG_PRINT("Error: proc %d does not hold monitor %p\n",    \
+                    pid, b );                                   \
+    return process_exception( pid, reg, stack, NOT_THE_OWNER, 0);   \
+  }                                                             \
+} while(0)
 
 #else //CHECKS
 
@@ -377,20 +807,73 @@ int process_exception( unsigned int proc_id, uint64_t *reg, stack_frame **stack,
 #define CHECK_EXEC_ANNOTS(pid, b) {}
 #define CHECK_RELEASE_ANNOTS(pid, b) {}
 #define CHECK_AQUIRE_ANNOTS(pid, b) {}
+#define CHECK_LOCK_ANNOTS(pid, b) {}
+#define CHECK_MONITOR_ANNOTS(pid, b) {}
 
 #endif //CHECKS
 
 uint8_t *blk_2_ptr( uint8_t *b, int offset, uint64_t checks );
 
 /*
- * Macros for setting annotations
+ * Macros for loading and storing block contents. Accesses to volatile
+ * blocks are atomic, relaxed unless the block is also annotated
+ * SEQ_CST in which case they are sequentially consistent. Accesses to
+ * any other block are plain, they are ordered by the acquire and
+ * release done when ownership changes hands.
  */
-#define SET_BLOCK_OWNED( b ) do {                     \
-  BLOCK_ANNOTS( b ) = BLOCK_ANNOTS( b ) | OWNED_MASK; \
+#define BLOCK_LOAD( type, b, off ) ({                               \
+  type *__p = (type *)((b) + (off));                                \
+  !(CHECK_VOLATILE(b)) ? *__p :                                     \
+    (CHECK_SEQ_CST(b)) ? __atomic_load_n( __p, __ATOMIC_SEQ_CST ) : \
+                         __atomic_load_n( __p, __ATOMIC_RELAXED );  \
+})
+
+#define BLOCK_STORE( type, b, off, v ) do {                         \
+  type *__p = (type *)((b) + (off));                                \
+  if( !(CHECK_VOLATILE(b)) )                                        \
+    *__p = (type)(v);                                               \
+  else if( CHECK_SEQ_CST(b) )                                       \
+    __atomic_store_n( __p, (type)(v), __ATOMIC_SEQ_CST );           \
+  else                                                              \
+    __atomic_store_n( __p, (type)(v), __ATOMIC_RELAXED );           \
 } while(0)
 
-#define SET_BLOCK_FREE( b ) do {                        \
-  BLOCK_ANNOTS( b ) = BLOCK_ANNOTS( b ) & ~OWNED_MASK;  \
+/*
+ * Check for the atomic read-modify-write opcodes. They are allowed on
+ * blocks the processor owns and, unlike plain stores, on free volatile
+ * blocks, so shared counters do not need a change of ownership. The
+ * word has to be inside the block and naturally aligned.
+ */
+#define CHECK_ATOMIC_ANNOTS( pid, b, off, size ) do {                 \
+  CHECK_READ_ANNOTS( pid, b );                                        \
+  if( (off) > BLOCK_LENGTH( b ) || (size) > BLOCK_LENGTH( b ) - (off) || \
+      ((off) & ((size) - 1)) )                                        \
+    return process_exception( pid, reg, stack, ILLEGAL_MEMORY_ADDRESS, 0 ); \
+} while(0)
+
+/*
+ * Checks a range of n elements of the given size starting at element
+ * idx of block b, for the opcodes which work on a whole range at once.
+ * check is CHECK_READ_ANNOTS or CHECK_WRITE_ANNOTS. The bounds are
+ * checked even without CHECKS since the range goes straight to C.
+ */
+#define CHECK_RANGE_ANNOTS( pid, b, idx, n, size, check ) do {          \
+  check( pid, b );                                                    \
+  if( (idx) > BLOCK_LENGTH( b ) / (size) ||                           \
+      (n) > BLOCK_LENGTH( b ) / (size) - (idx) )                      \
+    return process_exception( pid, reg, stack, ILLEGAL_MEMORY_ADDRESS, 0 ); \
+} while(0)
+
+/*
+ * Macros for setting annotations. The owned bit is flipped with an
+ * atomic or/and since other processors may be acquiring the block.
+ */
+#define SET_BLOCK_OWNED( b ) do {                                 \
+  __atomic_or_fetch( &BLOCK_ANNOTS( b ), OWNED_MASK, __ATOMIC_RELAXED ); \
+} while(0)
+
+#define SET_BLOCK_FREE( b ) do {                                  \
+  __atomic_and_fetch( &BLOCK_ANNOTS( b ), ~OWNED_MASK, __ATOMIC_RELAXED ); \
 } while(0)
 
 #define SET_BLOCK_VOLATILE( b ) do {                     \
@@ -413,33 +896,98 @@ uint8_t *blk_2_ptr( uint8_t *b, int offset, uint64_t checks );
 
 /*
  * CMPXCHG
- * Compare exchange macro for aquire block.
- */
-int aquire_blk_asm( uint64_t*, uint32_t );
-#define CMPXCHG( own_ptr, nil, new_owner ) do {     \
-  if( aquire_blk_asm( own_ptr, new_owner ) )        \
-    reg[rk] = 1;                                    \
-  else                                              \
-    reg[rk] = 0;                                    \
-}while(0)
+ * Compare exchange macro for aquire block. Evaluates to nonzero if the
+ * owner was nil and has been set to new_owner. A successful exchange is
+ * an acquire, pairing with the release in block_release_wake, so
+ * everything the previous owner wrote is visible to the new one.
+ */
+#define CMPXCHG( own_ptr, nil, new_owner ) ({                     \
+  uint64_t __nil = (nil);                                         \
+  __atomic_compare_exchange_n( own_ptr, &__nil, (uint64_t) new_owner, \
+                               0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ); \
+})
 
 /*
- * Struct to hold the arguments passed to doProcInit.
+ * Monitors and futex wrappers, see sync.c.
  */
-struct _cmd_arg
+int futex_wait( uint32_t *addr, uint32_t val );
+int futex_wake( uint32_t *addr, int n );
+void monitor_lock( uint8_t *b, uint32_t pid );
+void monitor_unlock( uint8_t *b );
+void monitor_wait( uint8_t *b, uint32_t pid );
+void monitor_signal( uint8_t *b );
+void monitor_broadcast( uint8_t *b );
+void block_aquire_wait( uint8_t *b, uint32_t pid );
+void block_release_wake( uint8_t *b );
+
+/*
+ * Channels between processors, see sync.c. A channel is a bounded ring
+ * of cells, each carrying a 64 bit value or the id of a block whose
+ * ownership is handed to the receiver. Channels are referred to by their
+ * index in a fixed table and live as long as the VM.
+ */
+#define XPVM_MAX_CHANNELS     256
+#define XPVM_CHAN_DEFAULT_CAP 64
+#define XPVM_CHAN_MAX_CAP     (1 << 20)
+
+/* Owner word of a block while it sits in a channel */
+#define OWNER_IN_CHANNEL      UINT64_MAX
+
+struct _chan_cell
 {
-  char s[0];
-} typedef cmd_arg;
+  uint64_t seq;
+  uint64_t val;
+  uint64_t is_blk;
+} typedef chan_cell;
+
+struct _xpvm_chan
+{
+  chan_cell *buf;
+  uint64_t  mask;
+  /* Next cell to send to and receive from */
+  uint64_t  head __attribute__((aligned(64)));
+  uint64_t  tail __attribute__((aligned(64)));
+  /* Futex sequences for processors blocked on a full or empty channel */
+  uint32_t  sent __attribute__((aligned(64)));
+  uint32_t  recv_waiters;
+  uint32_t  received;
+  uint32_t  send_waiters;
+} typedef xpvm_chan;
 
 /*
- * Struct for passing back the exit status and return value
- * of a processor (thread)i from doJoin.
+ * Barriers, see sync.c. Like channels they live in a fixed table and are
+ * referred to by index.
  */
-struct _ret_struct
+#define XPVM_MAX_BARRIERS     256
+
+struct _xpvm_barrier
 {
-  int status;
-  int64_t ret_val;
-} typedef ret_struct;
+  uint32_t count;
+  uint32_t arrived;
+  /* Bumped by the last processor to arrive, the others sleep on it */
+  uint32_t gen;
+} typedef xpvm_barrier;
+
+int64_t barrier_create( uint32_t count );
+xpvm_barrier *barrier_lookup( uint64_t handle );
+int barrier_arrive( xpvm_barrier *b, uint32_t *gen );
+int barrier_passed( xpvm_barrier *b, uint32_t gen );
+int barrier_wait( xpvm_barrier *b );
+
+int64_t chan_create( uint64_t cap );
+xpvm_chan *chan_lookup( uint64_t handle );
+void chan_send( xpvm_chan *c, uint64_t val, uint64_t is_blk );
+int chan_task_send( xpvm_chan *c, uint64_t val, uint64_t is_blk );
+uint64_t chan_recv( xpvm_chan *c, uint64_t *is_blk );
+int chan_try_recv( xpvm_chan *c, uint64_t *val, uint64_t *is_blk );
+
+/*
+ * Struct to hold the arguments passed to doProcInit.
+ */
+struct _cmd_arg
+{
+  char s[0];
+} typedef cmd_arg;
 
 /*
  * Struct for the arguments to the fetch_execute function
@@ -447,17 +995,226 @@ struct _ret_struct
  */
 struct _fe_args
 {
+  xpvm_proc *proc;
   uint64_t *reg_bank;
   uint64_t work;
   int argc;
 } typedef fe_args;
 
+/*
+ * Shared state of a parfor and the argument to each of its helper
+ * processors.
+ */
+#define XPVM_PARFOR_MAX_ARGS 8
+
+struct _parfor_info
+{
+  int64_t lo;
+  int64_t hi;
+  int64_t chunk;
+  int64_t next;
+  uint32_t nprocs;
+  uint8_t *work;
+  int argc;
+  uint64_t args[XPVM_PARFOR_MAX_ARGS];
+} typedef parfor_info;
+
+struct _parfor_worker
+{
+  parfor_info *info;
+  xpvm_proc *proc;
+  uint32_t idx;
+} typedef parfor_worker;
+
 /*
  * Allocator function and mutex.
  */
 pthread_mutex_t malloc_xpvm_mu;
+extern uint8_t *allocd_memory;
+extern uint8_t *next_block;
+extern uint64_t xpvm_mem_amt;
+extern uint32_t num_blocks_allocd;
 int malloc_xpvm_init( uint64_t );
 uint64_t malloc_xpvm( uint32_t );
+uint64_t malloc_xpvm_proc( xpvm_proc *, uint32_t );
+
+/*
+ * Profiling, see prof.c. prof_ticks reads the cycle counter where there
+ * is one and the monotonic clock in nanoseconds elsewhere.
+ */
+void prof_init( void );
+xpvm_prof *prof_get( xpvm_proc *p );
+uint32_t prof_find_block( uint8_t *cib );
+uint32_t prof_block_slow( xpvm_prof *pr, uint8_t *cib );
+const char *prof_block_name( uint32_t blk, char *buf, size_t len );
+void prof_dump( const char *prefix );
+const char *opcode_name( uint32_t op );
+
+/*
+ * Sampling profiler, see sample.c. sample_thread_start and
+ * sample_thread_stop bracket every thread that runs a processor.
+ */
+int sample_init( const char *path, int offsets );
+void sample_thread_start( xpvm_proc *p );
+void sample_thread_stop( xpvm_proc *p );
+void sample_dump( void );
+
+#define PROF_BLOCK( pr, cib ) \
+  ( (cib) == (pr)->last_cib ? (pr)->last_blk : prof_block_slow( pr, cib ) )
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define prof_ticks() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t prof_ticks( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+/*
+ * Allocation profiling, see alloc_prof.c. ALLOC_PROF goes before every
+ * allocation the guest makes, with the registers of the code making it.
+ */
+extern int alloc_prof_on;
+int alloc_prof_init( const char *path );
+void alloc_prof_record( xpvm_proc *p, uint64_t *reg, uint32_t bytes,
+                        int kind );
+void alloc_prof_dump( void );
+
+#define ALLOC_PROF( p, reg, bytes, kind ) do {                          \
+  if( alloc_prof_on )                                                   \
+    alloc_prof_record( p, reg, bytes, kind );                           \
+} while(0)
+
+/*
+ * Block contention, see contend.c. CONTEND_AQUIRE goes after every try at
+ * aquiring a block, with whether it was found held, whether it was taken
+ * and the ticks spent waiting for it; CONTEND_RELEASE after every release
+ * and CONTEND_ALLOC after every shared block is allocated.
+ */
+extern int contend_on;
+int contend_init( const char *path );
+void contend_aquire( xpvm_proc *p, uint8_t *b, int failed, int got,
+                     uint64_t wait );
+void contend_release( xpvm_proc *p, uint8_t *b );
+void contend_alloc( xpvm_proc *p, uint64_t *reg, uint8_t *b );
+void contend_dump( void );
+
+#define CONTEND_AQUIRE( p, b, failed, got, wait ) do {                  \
+  if( contend_on )                                                      \
+    contend_aquire( p, b, failed, got, wait );                          \
+} while(0)
+
+#define CONTEND_RELEASE( p, b ) do {                                    \
+  if( contend_on )                                                      \
+    contend_release( p, b );                                            \
+} while(0)
+
+#define CONTEND_ALLOC( p, reg, b ) do {                                 \
+  if( contend_on )                                                      \
+    contend_alloc( p, reg, b );                                         \
+} while(0)
+
+/*
+ * Timeline, see timeline.c. TIMELINE records an event of processor p,
+ * whose arg is the block run, the processor created or joined or the
+ * block waited for; TIMELINE_SPAWN goes before the thread of a new
+ * processor child is started, by parent or by main if that is NULL.
+ */
+extern int timeline_on;
+int timeline_init( const char *path );
+void timeline_record( xpvm_proc *p, uint32_t kind, uint64_t arg );
+void timeline_spawn( xpvm_proc *parent, xpvm_proc *child );
+void timeline_dump( void );
+
+#define TIMELINE( p, kind, arg ) do {                                   \
+  if( timeline_on )                                                     \
+    timeline_record( p, kind, arg );                                    \
+} while(0)
+
+#define TIMELINE_SPAWN( parent, child ) do {                            \
+  if( timeline_on )                                                     \
+    timeline_spawn( parent, child );                                    \
+} while(0)
+
+/*
+ * Metrics, see metrics.c. Written in the Prometheus text format on
+ * SIGUSR1, at exit and, with an interval, every so many seconds.
+ */
+int metrics_init( const char *path, double interval );
+void metrics_dump( void );
+
+/*
+ * Execution trace, see trace.c. TRACE_BEGIN takes a slot for the
+ * instruction about to run and TRACE_END finishes it once it has.
+ */
+int trace_init( const char *path );
+xpvm_trace *trace_get( xpvm_proc *p );
+
+#define TRACE_BEGIN( t, r, pid, reg, pc ) do {                          \
+  (r) = &(t)->rec[(t)->head & (XPVM_TRACE_RECORDS - 1)];                \
+  __atomic_store_n( &(r)->seq, XPVM_TRACE_NO_SEQ, __ATOMIC_RELAXED );   \
+  (r)->ts = prof_ticks();                                               \
+  (r)->cib = CIB;                                                       \
+  (r)->cio = CIO;                                                       \
+  (r)->pid = (pid);                                                     \
+  memcpy( (r)->insn, (pc), 4 );                                         \
+  (r)->vj = (reg)[(pc)[2]];                                             \
+  (r)->vk = (reg)[(pc)[3]];                                             \
+} while(0)
+
+#define TRACE_END( t, r, reg ) do {                                     \
+  (r)->vi = (reg)[(r)->insn[1]];                                        \
+  __atomic_store_n( &(r)->seq, (t)->head, __ATOMIC_RELEASE );           \
+  __atomic_store_n( &(t)->head, (t)->head + 1, __ATOMIC_RELEASE );      \
+} while(0)
+
+/*
+ * Vector kernels, see vec.c. vec_ops points at the fastest set this CPU
+ * supports. fma kernels compute d[i] += a[i] * b[i].
+ */
+struct _vec_kernels
+{
+  const char *name;
+  void    (*addd)( double *d, const double *a, const double *b, uint64_t n );
+  void    (*muld)( double *d, const double *a, const double *b, uint64_t n );
+  void    (*fmad)( double *d, const double *a, const double *b, uint64_t n );
+  void    (*scaled)( double *d, const double *a, double s, uint64_t n );
+  double  (*dotd)( const double *a, const double *b, uint64_t n );
+  double  (*sumd)( const double *a, uint64_t n );
+  void    (*addl)( int64_t *d, const int64_t *a, const int64_t *b, uint64_t n );
+  void    (*mull)( int64_t *d, const int64_t *a, const int64_t *b, uint64_t n );
+  void    (*fmal)( int64_t *d, const int64_t *a, const int64_t *b, uint64_t n );
+  void    (*scalel)( int64_t *d, const int64_t *a, int64_t s, uint64_t n );
+  int64_t (*dotl)( const int64_t *a, const int64_t *b, uint64_t n );
+  int64_t (*suml)( const int64_t *a, uint64_t n );
+} typedef vec_kernels;
+
+extern const vec_kernels *vec_ops;
+
+void vec_init( void );
+
+/*
+ * Processor placement, see affinity.c. With affinity on, allocator chunks
+ * are whole pages of an untouched heap so that the processor using one is
+ * the first to touch it.
+ */
+#define AFFINITY_NONE     0
+#define AFFINITY_RR       1
+#define AFFINITY_COMPACT  2
+#define AFFINITY_LIST     3
+
+#define XPVM_PAGE_SIZE    4096
+
+extern int xpvm_affinity;
+
+int affinity_init( const char *spec );
+void affinity_report( void );
+void affinity_apply( xpvm_proc *p );
 
 /*
  * Dynamic link handle.
@@ -521,18 +1278,75 @@ int xor_58                    OPCODE_FUNC
 int ornot_59                  OPCODE_FUNC
 int cmplt_68                  OPCODE_FUNC
 int jmp_80                    OPCODE_FUNC
+int jmp_81                    OPCODE_FUNC
 int btrue_82                  OPCODE_FUNC
 int bfalse_83                 OPCODE_FUNC
+int faddb_84                  OPCODE_FUNC
+int faddi_85                  OPCODE_FUNC
+int faddl_86                  OPCODE_FUNC
+int xchgb_87                  OPCODE_FUNC
+int xchgi_88                  OPCODE_FUNC
+int xchgl_89                  OPCODE_FUNC
+int casb_90                   OPCODE_FUNC
+int casi_91                   OPCODE_FUNC
+int casl_92                   OPCODE_FUNC
 int alloc_blk_96              OPCODE_FUNC
 int alloc_private_blk_97      OPCODE_FUNC
 int aquire_blk_98             OPCODE_FUNC
 int release_blk_99            OPCODE_FUNC
+int aquire_blkw_108           OPCODE_FUNC
+int towner_102                OPCODE_FUNC
+int lock_103                  OPCODE_FUNC
+int unlock_104                OPCODE_FUNC
+int wait_105                  OPCODE_FUNC
+int sig_106                   OPCODE_FUNC
+int sigall_107                OPCODE_FUNC
 int ldfunc_112                OPCODE_FUNC
 int call_114                  OPCODE_FUNC
 int calln_115                 OPCODE_FUNC
 int ret_116                   OPCODE_FUNC
+int fmad_117                  OPCODE_FUNC
+int sqrtd_118                 OPCODE_FUNC
+int mind_119                  OPCODE_FUNC
+int maxd_120                  OPCODE_FUNC
+int absd_121                  OPCODE_FUNC
+int floord_122                OPCODE_FUNC
+int ceild_123                 OPCODE_FUNC
+int expd_124                  OPCODE_FUNC
+int logd_125                  OPCODE_FUNC
+int sind_126                  OPCODE_FUNC
+int cosd_127                  OPCODE_FUNC
+int chan_create_130           OPCODE_FUNC
+int chan_send_131             OPCODE_FUNC
+int chan_recv_132             OPCODE_FUNC
+int chan_tryrecv_133          OPCODE_FUNC
+int barrier_init_134          OPCODE_FUNC
+int barrier_135               OPCODE_FUNC
+int joinany_136               OPCODE_FUNC
+int spawn_137                 OPCODE_FUNC
+int spawnd_138                OPCODE_FUNC
+int yield_139                 OPCODE_FUNC
+int bcopy_140                 OPCODE_FUNC
+int bfill_141                 OPCODE_FUNC
+int bcmp_142                  OPCODE_FUNC
 int init_proc_144             OPCODE_FUNC
 int join_145                  OPCODE_FUNC
+int join2_146                 OPCODE_FUNC
+int whoami_147                OPCODE_FUNC
+int parfor_148                OPCODE_FUNC
+int reduce_149                OPCODE_FUNC
+int vaddd_160                 OPCODE_FUNC
+int vaddl_161                 OPCODE_FUNC
+int vmuld_162                 OPCODE_FUNC
+int vmull_163                 OPCODE_FUNC
+int vfmad_164                 OPCODE_FUNC
+int vfmal_165                 OPCODE_FUNC
+int vscaled_166               OPCODE_FUNC
+int vscalel_167               OPCODE_FUNC
+int vdotd_168                 OPCODE_FUNC
+int vdotl_169                 OPCODE_FUNC
+int vsumd_170                 OPCODE_FUNC
+int vsuml_171                 OPCODE_FUNC
 
 /*************************** Native functions ****************************/
 
@@ -0,0 +1,183 @@
+/*
+ * xpvm_trace.c
+ *
+ * Decoder for the execution traces written by xpvm -t. Prints the
+ * instructions of every processor's ring merged in time order, one per
+ * line, with the block named from the object file.
+ *
+ *   xpvm_trace [-p proc] trace_file
+ *
+ * Author: Jeffrey Picard
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* A decoded record and the processor it came from */
+struct rec
+{
+  xpvm_trace_rec r;
+  uint32_t  proc;
+  int       done;
+};
+
+struct blk
+{
+  uint64_t  addr;
+  char      *name;
+};
+
+static char *op_names[256];
+static struct blk *blks;
+static uint32_t nblks;
+
+static void die( const char *msg, const char *path )
+{
+  fprintf( stderr, "xpvm_trace: %s%s%s\n", path ? path : "",
+           path ? ": " : "", msg );
+  exit( 1 );
+}
+
+static void get( void *buf, size_t len, FILE *fp, const char *path )
+{
+  if( fread( buf, 1, len, fp ) != len )
+    die( "truncated trace", path );
+}
+
+static char *get_str( FILE *fp, const char *path )
+{
+  uint16_t len;
+  char *s;
+
+  get( &len, sizeof(len), fp, path );
+  if( !(s = malloc( len + 1 )) )
+    die( "out of memory", NULL );
+  get( s, len, fp, path );
+  s[len] = 0;
+  return s;
+}
+
+static int rec_cmp( const void *x, const void *y )
+{
+  const struct rec *a = x, *b = y;
+
+  if( a->r.ts != b->r.ts )
+    return a->r.ts < b->r.ts ? -1 : 1;
+  if( a->proc != b->proc )
+    return a->proc < b->proc ? -1 : 1;
+  return (a->r.seq > b->r.seq) - (a->r.seq < b->r.seq);
+}
+
+static int blk_cmp( const void *x, const void *y )
+{
+  const struct blk *a = x, *b = y;
+  return (a->addr > b->addr) - (a->addr < b->addr);
+}
+
+/* Name of the block at cib, or NULL if it was not loaded from the file */
+static const char *blk_name( uint64_t cib )
+{
+  struct blk key, *b;
+
+  key.addr = cib;
+  b = bsearch( &key, blks, nblks, sizeof(struct blk), blk_cmp );
+  return b ? b->name : NULL;
+}
+
+int main( int argc, char **argv )
+{
+  trace_header h;
+  trace_ring_header rh;
+  struct rec *recs = NULL;
+  uint64_t n = 0, i, dropped;
+  double ns_per_tick;
+  const char *path, *name;
+  long only = -1;
+  uint32_t r;
+  int opt;
+  FILE *fp;
+
+  while( (opt = getopt( argc, argv, "p:" )) != -1 )
+  {
+    if( 'p' != opt )
+      die( "usage: xpvm_trace [-p proc] trace_file", NULL );
+    only = atol( optarg );
+  }
+  if( optind != argc - 1 )
+    die( "usage: xpvm_trace [-p proc] trace_file", NULL );
+  path = argv[optind];
+  if( !(fp = fopen( path, "r" )) )
+    die( "cannot open", path );
+
+  get( &h, sizeof(h), fp, path );
+  if( memcmp( h.magic, XPVM_TRACE_MAGIC, sizeof(h.magic) ) ||
+      XPVM_TRACE_VERSION != h.version ||
+      sizeof(xpvm_trace_rec) != h.rec_size || 256 != h.nops )
+    die( "not a trace from this version of xpvm", path );
+  ns_per_tick = h.tick1 > h.tick0 ?
+                (double)(h.ns1 - h.ns0) / (h.tick1 - h.tick0) : 1.0;
+
+  for( i = 0; i < 256; i++ )
+    op_names[i] = get_str( fp, path );
+  nblks = h.nblocks;
+  if( !(blks = calloc( nblks + 1, sizeof(struct blk) )) )
+    die( "out of memory", NULL );
+  for( i = 0; i < nblks; i++ )
+  {
+    get( &blks[i].addr, sizeof(uint64_t), fp, path );
+    blks[i].name = get_str( fp, path );
+  }
+  qsort( blks, nblks, sizeof(struct blk), blk_cmp );
+
+  for( r = 0; r < h.nrings; r++ )
+  {
+    get( &rh, sizeof(rh), fp, path );
+    if( !(recs = realloc( recs, (n + rh.count) * sizeof(struct rec) )) )
+      die( "out of memory", NULL );
+    dropped = 0;
+    for( i = 0; i < rh.count; i++ )
+    {
+      struct rec *d = &recs[n];
+
+      get( &d->r, sizeof(xpvm_trace_rec), fp, path );
+      d->proc = rh.proc;
+      /* The last slot is the instruction in progress, if any */
+      d->done = d->r.seq == rh.head + 1 - rh.count + i;
+      if( only >= 0 && only != rh.proc )
+        continue;
+      if( d->done ||
+          (i == rh.count - 1 && XPVM_TRACE_NO_SEQ == d->r.seq &&
+           XPVM_TRACE_NO_SEQ != d->r.ts) )
+        n++;
+      else if( i != rh.count - 1 )
+        dropped++;
+    }
+    fprintf( stderr, "processor %u: %" PRIu64 " instructions, %" PRIu64
+             " in the ring, %" PRIu64 " torn\n", rh.proc, rh.head,
+             rh.count - 1, dropped );
+  }
+  fclose( fp );
+
+  qsort( recs, n, sizeof(struct rec), rec_cmp );
+  for( i = 0; i < n; i++ )
+  {
+    xpvm_trace_rec *t = &recs[i].r;
+
+    printf( "%14.3f p%-2u t%-4u ",
+            ((int64_t)(t->ts - h.tick0) * ns_per_tick) / 1000.0,
+            recs[i].proc, t->pid );
+    if( (name = blk_name( t->cib )) && *name )
+      printf( "%s+0x%x", name, t->cio );
+    else
+      printf( "0x%" PRIx64 "+0x%x", t->cib, t->cio );
+    printf( "\t%02x%02x %02x%02x  %-12s r%02x=%" PRIx64 " r%02x=%"
+            PRIx64 " r%02x=%" PRIx64 "%s\n", t->insn[0], t->insn[1],
+            t->insn[2], t->insn[3], op_names[t->insn[0]], t->insn[1],
+            t->vi, t->insn[2], t->vj, t->insn[3], t->vk,
+            recs[i].done ? "" : "  (did not finish)" );
+  }
+  return 0;
+}